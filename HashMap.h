@@ -220,9 +220,19 @@ public:
     return const_cast<HashMap *>(this)->find(key);
   }
 
+  // Prefetch the bucket where a lookup of key starts
+  void prefetch(key_type key) const {
+    __builtin_prefetch(&buckets_[key_to_idx(key)]);
+  }
+
   // Bucket interface
   size_type bucket_count() const { return buckets_.size(); }
 
+  // Distance from the ideal bucket, number of extra probes to find it
+  size_type probe_length(iterator it) const {
+    return diff(it.idx_, key_to_idx(it->first));
+  }
+
   // Hash policy
   void rehash(size_type count) {
     count = std::max(count, size() * 2);
@@ -241,17 +251,17 @@ public:
   hasher hash_function() const { return hasher(); }
 
 private:
-  inline size_t key_to_idx(key_type key) {
+  inline size_t key_to_idx(key_type key) const {
     const size_t mask = buckets_.size() - 1;
     return hasher()(key) & mask;
   }
 
-  inline size_t probe_next(size_t idx) {
+  inline size_t probe_next(size_t idx) const {
     const size_t mask = buckets_.size() - 1;
     return (idx + 1) & mask;
   }
 
-  inline size_t diff(size_t a, size_t b) {
+  inline size_t diff(size_t a, size_t b) const {
     const size_t mask = buckets_.size() - 1;
     return (buckets_.size() + (a - b)) & mask;
   }
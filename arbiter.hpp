@@ -0,0 +1,212 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+A/B line arbitration
+
+Exchanges publish every feed on two redundant lines. LineArbiter takes
+packets from both lines and hands them to a single sequencing decoder,
+MoldUDP64 or PitchSUH, which forwards the first copy of every sequence
+number and drops the later copy with a sequence compare. The book is
+therefore updated once, from whichever line is faster.
+
+A packet that arrives ahead of the next expected sequence number is not
+passed on right away, since the decoder would skip the gap for good and
+the other line may still deliver the missing packets. It is held for up
+to the window and passed on as soon as the gap is filled. When the window
+expires, or too many packets are held, the gap is given up on and held
+packets are passed on in sequence order. Poll releases expired packets
+when no traffic arrives.
+
+Unsequenced packets, PITCH unit 0, have no sequence number to compare.
+Each line keeps its last few of them and a packet is dropped as a copy
+when it matches one the other line delivered, byte for byte.
+
+The arbiter adds per line statistics: how many packets each line
+delivered first and, for the copies that arrived second, how far behind
+the leading copy they were. Arrival times of recent leading packets are
+kept in a small table indexed by a hash of Framing::PacketId.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+template <typename Framing> class LineArbiter {
+
+public:
+  static constexpr size_t kLines = 2;
+  static constexpr size_t kHistoryBits = 12;
+  static constexpr size_t kMaxHeld = 64;
+  static constexpr size_t kUnsequenced = 16; // kept per line
+  static constexpr uint64_t kWindow = 1000000; // ns
+
+  struct LineStats {
+    uint64_t packets = 0;
+    uint64_t leads = 0;     // packets this line delivered first
+    uint64_t lags = 0;      // copies that arrived after the other line's
+    uint64_t late = 0;      // packets starting before the next expected
+    uint64_t lag_total = 0; // ns behind the leading copy
+    uint64_t lag_max = 0;
+  };
+
+  LineArbiter(Framing &framing, uint64_t window = kWindow)
+      : framing_(framing), window_(window) {
+    held_.reserve(kMaxHeld);
+  }
+
+  // Pass a packet received on line at time ns. Returns the number of
+  // messages passed on, including those of released held packets.
+  size_t ParsePacket(size_t line, const char *buf, size_t len, uint64_t ns) {
+    LineStats &stats = stats_[line];
+    stats.packets++;
+    if (len < Framing::kHeaderSize) {
+      return framing_.ParsePacket(buf, len);
+    }
+    if (!Framing::Sequenced(buf)) {
+      return Unsequenced(line, buf, len, ns) + Poll(ns);
+    }
+    uint64_t id = Framing::PacketId(buf);
+    int64_t offset = framing_.Offset(buf);
+    // Fibonacci hashing spreads both sequence numbers and PITCH units
+    Arrival &arrival = history_[(id * 0x9E3779B97F4A7C15ull) >>
+                                (64 - kHistoryBits)];
+    bool copy = arrival.id == id && arrival.line != line;
+    if (copy) {
+      Lag(stats, arrival.ns, ns);
+    } else if (offset < 0) {
+      stats.late++;
+    } else {
+      stats.leads++;
+      arrival.id = id;
+      arrival.line = line;
+      arrival.ns = ns;
+    }
+
+    size_t count = 0;
+    if (offset <= 0) {
+      count += framing_.ParsePacket(buf, len);
+    } else if (!copy) {
+      // The leading copy of a copy ahead of sequence is already held
+      if (held_.size() == kMaxHeld) {
+        count += Release();
+      }
+      held_.push_back(Held{ns, std::string(buf, len)});
+    }
+    count += Drain();
+    return count + Poll(ns);
+  }
+
+  // Release packets held longer than the window at time ns. Returns the
+  // number of messages passed on.
+  size_t Poll(uint64_t ns) {
+    size_t count = 0;
+    while (!held_.empty() && ns >= held_.front().ns + window_) {
+      count += Release();
+      count += Drain();
+    }
+    return count;
+  }
+
+  const LineStats &Stats(size_t line) const { return stats_[line]; }
+
+private:
+  struct Arrival {
+    uint64_t id = ~0ull;
+    uint64_t line = 0;
+    uint64_t ns = 0;
+  };
+
+  struct Held {
+    uint64_t ns;
+    std::string data;
+  };
+
+  void Lag(LineStats &stats, uint64_t first, uint64_t ns) {
+    uint64_t lag = ns > first ? ns - first : 0;
+    stats.lags++;
+    stats.lag_total += lag;
+    stats.lag_max = lag > stats.lag_max ? lag : stats.lag_max;
+  }
+
+  // Pass on an unsequenced packet unless the other line delivered it
+  size_t Unsequenced(size_t line, const char *buf, size_t len, uint64_t ns) {
+    LineStats &stats = stats_[line];
+    std::vector<Held> &other = unsequenced_[(line + 1) % kLines];
+    for (auto it = other.begin(); it != other.end(); ++it) {
+      if (it->data.size() == len &&
+          std::memcmp(it->data.data(), buf, len) == 0) {
+        Lag(stats, it->ns, ns);
+        other.erase(it);
+        return 0;
+      }
+    }
+    stats.leads++;
+    std::vector<Held> &own = unsequenced_[line];
+    if (own.size() == kUnsequenced) {
+      own.erase(own.begin());
+    }
+    own.push_back(Held{ns, std::string(buf, len)});
+    return framing_.ParsePacket(buf, len);
+  }
+
+  // Pass on held packets that no longer follow a gap
+  size_t Drain() {
+    size_t count = 0;
+    for (size_t i = 0; i < held_.size();) {
+      const std::string &data = held_[i].data;
+      if (framing_.Offset(data.data()) > 0) {
+        ++i;
+        continue;
+      }
+      count += framing_.ParsePacket(data.data(), data.size());
+      held_.erase(held_.begin() + i);
+      i = 0;
+    }
+    return count;
+  }
+
+  // Give up on the first gap by passing on the held packet closest to it
+  size_t Release() {
+    auto first = held_.begin();
+    for (auto it = held_.begin(); it != held_.end(); ++it) {
+      if (framing_.Offset(it->data.data()) <
+          framing_.Offset(first->data.data())) {
+        first = it;
+      }
+    }
+    size_t count = framing_.ParsePacket(first->data.data(), first->data.size());
+    held_.erase(first);
+    return count;
+  }
+
+  Framing &framing_;
+  uint64_t window_;
+  LineStats stats_[kLines];
+  Arrival history_[size_t(1) << kHistoryBits];
+  std::vector<Held> held_;
+  std::vector<Held> unsequenced_[kLines]; // recent, oldest first
+};
@@ -0,0 +1,206 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "arbiter.hpp"
+#include "moldudp64.hpp"
+#include "pitch_suh.hpp"
+#include <cassert>
+#include <string>
+#include <vector>
+
+struct Parser {
+  static bool Valid(const char *buf, size_t len) { return len > 0; }
+
+  void ParseMessage(uint64_t seqno, const char *buf) {
+    seqnos.push_back(seqno);
+  }
+
+  std::vector<uint64_t> seqnos;
+};
+
+static std::string MoldPacket(uint64_t seqno, size_t count) {
+  std::string s = "SESSION001";
+  for (int i = 7; i >= 0; --i) {
+    s.push_back(seqno >> (8 * i));
+  }
+  s.push_back(count >> 8);
+  s.push_back(count);
+  for (size_t i = 0; i < count; ++i) {
+    s += std::string("\0\1A", 3);
+  }
+  return s;
+}
+
+static std::string PitchPacket(uint8_t unit, uint32_t seqno, size_t count) {
+  std::string s(8, 0);
+  s[2] = count;
+  s[3] = unit;
+  for (int i = 0; i < 4; ++i) {
+    s[4 + i] = seqno >> (8 * i);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    s += std::string("\2\x21", 2);
+  }
+  s[0] = s.size();
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+
+  {
+    // Test first copy wins and lag is measured against it
+    Parser parser;
+    MoldUDP64<Parser> mold(parser);
+    LineArbiter<MoldUDP64<Parser>> arb(mold);
+    std::string p1 = MoldPacket(1, 2), p2 = MoldPacket(3, 1),
+                p3 = MoldPacket(4, 3);
+    size_t n[6];
+    n[0] = arb.ParsePacket(0, p1.data(), p1.size(), 1000);
+    n[1] = arb.ParsePacket(1, p1.data(), p1.size(), 1300);
+    n[2] = arb.ParsePacket(1, p2.data(), p2.size(), 2000);
+    n[3] = arb.ParsePacket(0, p2.data(), p2.size(), 2100);
+    n[4] = arb.ParsePacket(0, p3.data(), p3.size(), 3000);
+    n[5] = arb.ParsePacket(1, p3.data(), p3.size(), 3050);
+    assert(n[0] == 2 && n[1] == 0 && n[2] == 1 && n[3] == 0);
+    assert(n[4] == 3 && n[5] == 0);
+    assert((parser.seqnos == std::vector<uint64_t>{1, 2, 3, 4, 5, 6}));
+
+    auto &a = arb.Stats(0), &b = arb.Stats(1);
+    assert(a.packets == 3 && b.packets == 3);
+    assert(a.leads == 2 && a.lags == 1);
+    assert(b.leads == 1 && b.lags == 2);
+    assert(a.lag_total == 100 && a.lag_max == 100);
+    assert(b.lag_total == 350 && b.lag_max == 300);
+  }
+
+  {
+    // Test a gap on one line is filled from the other
+    Parser parser;
+    MoldUDP64<Parser> mold(parser);
+    LineArbiter<MoldUDP64<Parser>> arb(mold);
+    std::string p1 = MoldPacket(1, 1), p2 = MoldPacket(2, 1),
+                p3 = MoldPacket(3, 1);
+    arb.ParsePacket(0, p1.data(), p1.size(), 0);
+    arb.ParsePacket(1, p1.data(), p1.size(), 0);
+    arb.ParsePacket(1, p2.data(), p2.size(), 0); // lost on line A
+    arb.ParsePacket(0, p3.data(), p3.size(), 0);
+    arb.ParsePacket(1, p3.data(), p3.size(), 0);
+    assert((parser.seqnos == std::vector<uint64_t>{1, 2, 3}));
+    assert(mold.Gaps() == 0);
+  }
+
+  {
+    // Test a gap on the leading line is held open for the other line
+    Parser parser;
+    MoldUDP64<Parser> mold(parser);
+    LineArbiter<MoldUDP64<Parser>> arb(mold, 1000);
+    std::string p1 = MoldPacket(1, 1), p2 = MoldPacket(2, 1),
+                p3 = MoldPacket(3, 1);
+    size_t n[5];
+    n[0] = arb.ParsePacket(0, p1.data(), p1.size(), 0);
+    n[1] = arb.ParsePacket(0, p3.data(), p3.size(), 10); // 2 lost on line A
+    n[2] = arb.ParsePacket(1, p1.data(), p1.size(), 50);
+    n[3] = arb.ParsePacket(1, p2.data(), p2.size(), 60);
+    n[4] = arb.ParsePacket(1, p3.data(), p3.size(), 70);
+    assert(n[0] == 1 && n[1] == 0 && n[2] == 0 && n[3] == 2 && n[4] == 0);
+    assert((parser.seqnos == std::vector<uint64_t>{1, 2, 3}));
+    assert(mold.Gaps() == 0);
+    assert(arb.Stats(0).leads == 2 && arb.Stats(0).lags == 0);
+    assert(arb.Stats(1).leads == 1 && arb.Stats(1).lags == 2);
+    assert(arb.Stats(1).lag_total == 110);
+  }
+
+  {
+    // Test a gap lost on both lines is given up on after the window
+    Parser parser;
+    MoldUDP64<Parser> mold(parser);
+    LineArbiter<MoldUDP64<Parser>> arb(mold, 1000);
+    std::string p1 = MoldPacket(1, 1), p3 = MoldPacket(3, 1),
+                p4 = MoldPacket(4, 1);
+    size_t n[5];
+    n[0] = arb.ParsePacket(0, p1.data(), p1.size(), 0);
+    n[1] = arb.ParsePacket(0, p4.data(), p4.size(), 10);
+    n[2] = arb.ParsePacket(1, p3.data(), p3.size(), 20);
+    n[3] = arb.Poll(1009);
+    assert(n[0] == 1 && n[1] == 0 && n[2] == 0 && n[3] == 0);
+    n[4] = arb.Poll(1010);
+    assert(n[4] == 2);
+    assert((parser.seqnos == std::vector<uint64_t>{1, 3, 4}));
+    assert(mold.Gaps() == 1);
+  }
+
+  {
+    // Test heartbeats lead and late overlapping packets don't
+    Parser parser;
+    MoldUDP64<Parser> mold(parser);
+    LineArbiter<MoldUDP64<Parser>> arb(mold);
+    std::string p1 = MoldPacket(1, 3), hb = MoldPacket(4, 0),
+                p2 = MoldPacket(3, 2);
+    size_t n[4];
+    n[0] = arb.ParsePacket(0, p1.data(), p1.size(), 0);
+    n[1] = arb.ParsePacket(1, hb.data(), hb.size(), 10);
+    n[2] = arb.ParsePacket(0, hb.data(), hb.size(), 30);
+    n[3] = arb.ParsePacket(1, p2.data(), p2.size(), 40);
+    assert(n[0] == 3 && n[1] == 0 && n[2] == 0 && n[3] == 1);
+    assert((parser.seqnos == std::vector<uint64_t>{1, 2, 3, 4}));
+    assert(arb.Stats(0).leads == 1 && arb.Stats(0).lags == 1);
+    assert(arb.Stats(0).lag_total == 20);
+    assert(arb.Stats(1).leads == 1 && arb.Stats(1).late == 1);
+  }
+
+  {
+    // Test PITCH units are arbitrated independently
+    Parser parser;
+    PitchSUH<Parser> suh(parser);
+    LineArbiter<PitchSUH<Parser>> arb(suh);
+    std::string u1 = PitchPacket(1, 1, 2), u2 = PitchPacket(2, 1, 2);
+    arb.ParsePacket(0, u1.data(), u1.size(), 10);
+    arb.ParsePacket(1, u2.data(), u2.size(), 20);
+    arb.ParsePacket(1, u1.data(), u1.size(), 15);
+    arb.ParsePacket(0, u2.data(), u2.size(), 40);
+    assert(parser.seqnos.size() == 4);
+    assert(arb.Stats(0).leads == 1 && arb.Stats(0).lag_total == 20);
+    assert(arb.Stats(1).leads == 1 && arb.Stats(1).lag_total == 5);
+  }
+
+  {
+    // Test unsequenced PITCH packets are passed on once, matched by content
+    Parser parser;
+    PitchSUH<Parser> suh(parser);
+    LineArbiter<PitchSUH<Parser>> arb(suh);
+    std::string p1 = PitchPacket(0, 0, 1), p2 = PitchPacket(0, 0, 2);
+    arb.ParsePacket(0, p1.data(), p1.size(), 10);
+    arb.ParsePacket(0, p2.data(), p2.size(), 20);
+    arb.ParsePacket(1, p1.data(), p1.size(), 25);
+    arb.ParsePacket(1, p2.data(), p2.size(), 30);
+    assert(parser.seqnos.size() == 3);
+    // the same packet again on one line is a new packet
+    arb.ParsePacket(1, p1.data(), p1.size(), 40);
+    arb.ParsePacket(0, p1.data(), p1.size(), 45);
+    assert(parser.seqnos.size() == 4);
+    assert(arb.Stats(0).leads == 2 && arb.Stats(0).lags == 1);
+    assert(arb.Stats(1).leads == 1 && arb.Stats(1).lags == 2);
+    assert(arb.Stats(1).lag_total == 25);
+  }
+
+  return 0;
+}
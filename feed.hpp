@@ -23,8 +23,12 @@ SOFTWARE.
 #pragma once
 
 #include "HashMap.h"
+#include "stats.hpp"
+#include "timestamp.hpp"
+#include <algorithm>
 #include <boost/container/flat_map.hpp>
 #include <iostream>
+#include <type_traits>
 
 struct BestPrice {
   int64_t bidqty;
@@ -80,6 +84,10 @@ public:
 
   void SetUserData(void *data) { data_ = data; }
 
+  char GetTradingState() const { return state_; }
+
+  void SetTradingState(char state) { state_ = state; }
+
   bool Add(uint64_t seqno, bool buy_sell, int64_t price, int64_t qty) {
     if (qty <= 0) {
       return false;
@@ -144,9 +152,61 @@ public:
 private:
   boost::container::flat_map<int64_t, Level, std::greater<int64_t>> buy_, sell_;
   void *data_ = nullptr;
+  char state_ = 'T';
 };
 
-template <typename Handler> class Feed {
+/*
+Optional handler callbacks
+
+Every handler gets OnQuote and OnTrade. A handler that declares one of
+
+  static constexpr bool kBrokenTrades = true;
+  void OnBrokenTrade(uint64_t match);
+
+  static constexpr bool kImbalances = true;
+  void OnImbalance(OrderBook *book, int64_t paired, int64_t imbalance,
+                   char direction, int64_t far, int64_t near, int64_t ref,
+                   char cross_type);
+
+  static constexpr bool kRetailInterest = true;
+  void OnRetailInterest(OrderBook *book, char interest);
+
+  static constexpr bool kAttributions = true;
+  void OnAttribution(OrderBook *book, uint64_t ref, bool buy_sell,
+                     int64_t qty, int64_t price, uint32_t participant);
+
+gets that callback as well, see also OnTimestamp. For other handlers the
+feed skips the callback and the symbol lookup it needs.
+ */
+template <typename T, typename = void>
+struct WantsBrokenTrades : std::false_type {};
+
+template <typename T>
+struct WantsBrokenTrades<T, decltype(void(T::kBrokenTrades))>
+    : std::integral_constant<bool, T::kBrokenTrades> {};
+
+template <typename T, typename = void>
+struct WantsImbalances : std::false_type {};
+
+template <typename T>
+struct WantsImbalances<T, decltype(void(T::kImbalances))>
+    : std::integral_constant<bool, T::kImbalances> {};
+
+template <typename T, typename = void>
+struct WantsRetailInterest : std::false_type {};
+
+template <typename T>
+struct WantsRetailInterest<T, decltype(void(T::kRetailInterest))>
+    : std::integral_constant<bool, T::kRetailInterest> {};
+
+template <typename T, typename = void>
+struct WantsAttributions : std::false_type {};
+
+template <typename T>
+struct WantsAttributions<T, decltype(void(T::kAttributions))>
+    : std::integral_constant<bool, T::kAttributions> {};
+
+template <typename Handler, typename Stats = NullStats> class Feed {
 
   static constexpr int16_t NOBOOK = std::numeric_limits<int16_t>::max();
   static constexpr int16_t MAXBOOK = std::numeric_limits<int16_t>::max();
@@ -165,10 +225,13 @@ template <typename Handler> class Feed {
   static_assert(sizeof(Order) == 16, "");
 
 public:
+  // Parsers decode exchange timestamps only if the handler wants them
+  static constexpr bool kTimestamps = WantsTimestamps<Handler>::value;
+
   Feed(Handler &handler, size_t size_hint, bool all_orders = false,
-       bool all_books = false)
-      : handler_(handler), all_orders_(all_orders), all_books_(all_books),
-        symbols_(16384, 0),
+       bool all_books = false, Stats stats = Stats())
+      : handler_(handler), stats_(stats), all_orders_(all_orders),
+        all_books_(all_books), symbols_(16384, 0),
         orders_(size_hint, std::numeric_limits<uint64_t>::max()) {
     size_hint_ = orders_.bucket_count();
   }
@@ -207,31 +270,11 @@ public:
 
   void Add(uint64_t seqno, uint64_t ref, bool buy_sell, int32_t qty,
            uint64_t symbol, int64_t price) {
-    auto it = symbols_.find(symbol);
-    if (it == symbols_.end()) {
-      if (!all_books_) {
-        if (all_orders_) {
-          orders_.emplace(ref, Order(price, qty, buy_sell, NOBOOK));
-        }
-        return;
-      }
-      if (books_.size() == MAXBOOK) {
-        // too many books
-        return;
-      }
-      books_.push_back(OrderBook());
-      it = symbols_.emplace(symbol, books_.size() - 1).first;
-    }
-    int16_t bookid = it->second;
-    OrderBook &book = books_[bookid];
-    if (orders_.emplace(ref, Order(price, qty, buy_sell, bookid)).second) {
-      bool top = book.Add(seqno, buy_sell, price, qty);
-      handler_.OnQuote(&book, top);
-    }
+    Insert(seqno, ref, buy_sell, qty, symbol, price);
   }
 
   void Executed(uint64_t seqno, uint64_t ref, int32_t qty) {
-    auto oit = orders_.find(ref);
+    auto oit = FindOrder(ref);
     if (oit == orders_.end()) {
       return;
     }
@@ -251,7 +294,7 @@ public:
 
   void ExecutedAtPrice(uint64_t seqno, uint64_t ref, int32_t qty,
                        int64_t price) {
-    auto oit = orders_.find(ref);
+    auto oit = FindOrder(ref);
     if (oit == orders_.end()) {
       return;
     }
@@ -271,7 +314,7 @@ public:
 
   void ExecutedAtPriceSize(uint64_t seqno, uint64_t id, int32_t qty,
                            int32_t leaves_qty, int64_t price) {
-    auto oit = orders_.find(id);
+    auto oit = FindOrder(id);
     if (oit == orders_.end()) {
       return;
     }
@@ -296,7 +339,7 @@ public:
   }
 
   void Reduce(uint64_t seqno, uint64_t ref, int32_t qty) {
-    auto oit = orders_.find(ref);
+    auto oit = FindOrder(ref);
     if (oit == orders_.end()) {
       return;
     }
@@ -315,7 +358,7 @@ public:
   }
 
   void Delete(uint64_t seqno, uint64_t ref) {
-    auto oit = orders_.find(ref);
+    auto oit = FindOrder(ref);
     if (oit == orders_.end()) {
       return;
     }
@@ -332,7 +375,7 @@ public:
 
   void Replace(uint64_t seqno, uint64_t ref, uint64_t ref2, int32_t qty,
                int64_t price) {
-    auto oit = orders_.find(ref);
+    auto oit = FindOrder(ref);
     if (oit == orders_.end()) {
       return;
     }
@@ -350,7 +393,7 @@ public:
   }
 
   void Modify(uint64_t seqno, uint64_t id, int32_t qty, int64_t price) {
-    auto oit = orders_.find(id);
+    auto oit = FindOrder(id);
     if (oit == orders_.end()) {
       return;
     }
@@ -380,13 +423,190 @@ public:
     handler_.OnTrade(book, shares, price, false);
   }
 
+  // Add an order whose participant is disclosed
+  void AddAttributed(uint64_t seqno, uint64_t ref, bool buy_sell, int32_t qty,
+                     uint64_t symbol, int64_t price, uint32_t participant) {
+    OrderBook *book = Insert(seqno, ref, buy_sell, qty, symbol, price);
+    if (book) {
+      Attribution(book, ref, buy_sell, qty, price, participant,
+                  WantsAttributions<Handler>());
+    }
+  }
+
+  void CrossTrade(uint64_t seqno, int64_t shares, uint64_t symbol,
+                  int64_t price, char cross_type) {
+    Trade(seqno, shares, symbol, price);
+  }
+
+  void BrokenTrade(uint64_t seqno, uint64_t match) {
+    BrokenTrade(match, WantsBrokenTrades<Handler>());
+  }
+
+  void Imbalance(uint64_t seqno, uint64_t symbol, int64_t paired,
+                 int64_t imbalance, char direction, int64_t far, int64_t near,
+                 int64_t ref, char cross_type) {
+    Imbalance(symbol, paired, imbalance, direction, far, near, ref,
+              cross_type, WantsImbalances<Handler>());
+  }
+
+  void RetailInterest(uint64_t seqno, uint64_t symbol, char interest) {
+    RetailInterest(symbol, interest, WantsRetailInterest<Handler>());
+  }
+
+  void SystemEvent(uint64_t seqno, char code) {
+    if (code == 'S') {
+      // Start of system hours, the stock directory has been received
+      Reserve(directory_size_);
+    }
+  }
+
+  void StockDirectory(uint64_t seqno, uint16_t locate, uint64_t symbol,
+                      int32_t round_lot) {
+    directory_size_++;
+    if (locate >= locates_.size()) {
+      locates_.resize(locate + 1, int16_t(NOBOOK));
+    }
+    auto it = symbols_.find(symbol);
+    if (it == symbols_.end()) {
+      if (!all_books_ || books_.size() == MAXBOOK) {
+        return;
+      }
+      books_.push_back(OrderBook());
+      it = symbols_.emplace(symbol, books_.size() - 1).first;
+    }
+    locates_[locate] = it->second;
+  }
+
+  void TradingAction(uint64_t seqno, uint16_t locate, uint64_t symbol,
+                     char state) {
+    int16_t bookid = NOBOOK;
+    if (locate < locates_.size()) {
+      bookid = locates_[locate];
+    }
+    if (bookid == NOBOOK) {
+      auto it = symbols_.find(symbol);
+      if (it == symbols_.end()) {
+        return;
+      }
+      bookid = it->second;
+    }
+    books_[bookid].SetTradingState(state);
+  }
+
+  // Size books, symbol and order maps for nsymbols instruments so that no
+  // container grows during the trading day. Called automatically at start
+  // of system hours when the feed provides a stock directory.
+  void Reserve(size_t nsymbols) {
+    if (all_books_) {
+      books_.reserve(std::min(nsymbols, size_t(MAXBOOK)));
+    }
+    if (symbols_.bucket_count() < 2 * nsymbols) {
+      symbols_.rehash(2 * nsymbols);
+    }
+    size_t norders = nsymbols * orders_per_symbol_;
+    if (orders_.bucket_count() < 2 * norders) {
+      orders_.rehash(2 * norders);
+    }
+    size_hint_ = orders_.bucket_count();
+  }
+
+  void SetOrdersPerSymbol(size_t n) { orders_per_symbol_ = n; }
+
+  void OnTimestamp(uint64_t ns) {
+    timestamp_ = ns;
+    handler_.OnTimestamp(ns);
+  }
+
+  // Exchange timestamp of the current message, nanoseconds since midnight
+  uint64_t Timestamp() const { return timestamp_; }
+
+  // Hint that ref will be looked up soon
+  void Prefetch(uint64_t ref) const { orders_.prefetch(ref); }
+
   size_t Size() const { return orders_.size(); }
 
+  size_t Capacity() const { return orders_.bucket_count() / 2; }
+
 private:
   // Non-copyable
   Feed(const Feed &) = delete;
   Feed &operator=(const Feed &) = delete;
 
+  // Add an order, returns its book or nullptr if it has none or the
+  // reference is a duplicate
+  OrderBook *Insert(uint64_t seqno, uint64_t ref, bool buy_sell, int32_t qty,
+                    uint64_t symbol, int64_t price) {
+    auto it = symbols_.find(symbol);
+    if (it == symbols_.end()) {
+      if (!all_books_) {
+        if (all_orders_ &&
+            !orders_.emplace(ref, Order(price, qty, buy_sell, NOBOOK))
+                 .second) {
+          stats_.DuplicateRef();
+        }
+        return nullptr;
+      }
+      if (books_.size() == MAXBOOK) {
+        // too many books
+        return nullptr;
+      }
+      books_.push_back(OrderBook());
+      it = symbols_.emplace(symbol, books_.size() - 1).first;
+    }
+    int16_t bookid = it->second;
+    OrderBook &book = books_[bookid];
+    if (!orders_.emplace(ref, Order(price, qty, buy_sell, bookid)).second) {
+      stats_.DuplicateRef();
+      return nullptr;
+    }
+    bool top = book.Add(seqno, buy_sell, price, qty);
+    handler_.OnQuote(&book, top);
+    return &book;
+  }
+
+  void Attribution(OrderBook *book, uint64_t ref, bool buy_sell, int32_t qty,
+                   int64_t price, uint32_t participant, std::true_type) {
+    handler_.OnAttribution(book, ref, buy_sell, qty, price, participant);
+  }
+
+  void Attribution(OrderBook *book, uint64_t ref, bool buy_sell, int32_t qty,
+                   int64_t price, uint32_t participant, std::false_type) {}
+
+  void BrokenTrade(uint64_t match, std::true_type) {
+    handler_.OnBrokenTrade(match);
+  }
+
+  void BrokenTrade(uint64_t match, std::false_type) {}
+
+  void Imbalance(uint64_t symbol, int64_t paired, int64_t imbalance,
+                 char direction, int64_t far, int64_t near, int64_t ref,
+                 char cross_type, std::true_type) {
+    auto it = symbols_.find(symbol);
+    if (it == symbols_.end()) {
+      return;
+    }
+
+    OrderBook *book = &books_[it->second];
+    handler_.OnImbalance(book, paired, imbalance, direction, far, near, ref,
+                         cross_type);
+  }
+
+  void Imbalance(uint64_t symbol, int64_t paired, int64_t imbalance,
+                 char direction, int64_t far, int64_t near, int64_t ref,
+                 char cross_type, std::false_type) {}
+
+  void RetailInterest(uint64_t symbol, char interest, std::true_type) {
+    auto it = symbols_.find(symbol);
+    if (it == symbols_.end()) {
+      return;
+    }
+
+    OrderBook *book = &books_[it->second];
+    handler_.OnRetailInterest(book, interest);
+  }
+
+  void RetailInterest(uint64_t symbol, char interest, std::false_type) {}
+
   struct Hash {
     size_t operator()(uint64_t h) const noexcept {
       h ^= h >> 33;
@@ -398,14 +618,34 @@ private:
     }
   };
 
+  using OrderMap = HashMap<uint64_t, Order, Hash>;
+
+  typename OrderMap::iterator FindOrder(uint64_t ref) {
+    auto oit = orders_.find(ref);
+    if (Stats::enabled) {
+      if (oit == orders_.end()) {
+        // Without all_orders_ refs of unsubscribed books are expected misses
+        stats_.Miss(all_orders_);
+      } else {
+        stats_.Lookup(orders_.probe_length(oit));
+      }
+    }
+    return oit;
+  }
+
   Handler &handler_;
+  Stats stats_;
   size_t size_hint_ = 0;
   bool all_orders_ = false;
   bool all_books_ = false;
+  size_t directory_size_ = 0;
+  uint64_t timestamp_ = 0;
+  size_t orders_per_symbol_ = 512;
 
   std::vector<OrderBook> books_;
+  std::vector<int16_t> locates_;
   // std::unordered_map<uint64_t, uint16_t, Hash> symbols_;
   HashMap<uint64_t, uint16_t, Hash> symbols_;
   // std::unordered_map<uint64_t, Order, Hash> orders_;
-  HashMap<uint64_t, Order, Hash> orders_;
+  OrderMap orders_;
 };
@@ -0,0 +1,370 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+
+/*
+Format strings
+
+A format string is literal text with {} placeholders, one per argument
+in order. A placeholder can carry a spec, {:[[fill]align][+][0][width]
+[.precision][type]}:
+
+  align      < left, > right, ^ center, numbers default to right
+  +          show the sign of positive numbers
+  0          pad numbers with zeros after the sign
+  precision  digits after the point, or maximum string length
+  type       d decimal, x X hex, o octal, b binary, f e g floating point,
+             s string, c character
+
+{{ and }} are literal braces. NextFormatToken is constexpr so a format
+string known at compile time can be parsed and checked at compile time,
+see FormatTable, and formatted without looking at the string again.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+struct FormatSpec {
+  char fill = ' ';
+  char align = 0;
+  bool plus = false;
+  bool zero = false;
+  int width = 0;
+  int precision = -1;
+  char type = 0;
+};
+
+struct FormatToken {
+  enum Kind : uint8_t { kEnd, kLiteral, kArg, kError };
+
+  Kind kind = kEnd;
+  size_t begin = 0; // literal text
+  size_t len = 0;
+  size_t next = 0; // position after the token
+  FormatSpec spec;
+};
+
+constexpr bool IsFormatAlign(char c) {
+  return c == '<' || c == '>' || c == '^';
+}
+
+// Token starting at position pos of the format string s
+constexpr FormatToken NextFormatToken(const char *s, size_t pos) {
+  FormatToken t;
+  t.begin = pos;
+  if (s[pos] == 0) {
+    return t;
+  }
+  if ((s[pos] == '{' && s[pos + 1] == '{') ||
+      (s[pos] == '}' && s[pos + 1] == '}')) {
+    t.kind = FormatToken::kLiteral;
+    t.len = 1;
+    t.next = pos + 2;
+    return t;
+  }
+  if (s[pos] == '}') {
+    t.kind = FormatToken::kError;
+    return t;
+  }
+  if (s[pos] != '{') {
+    size_t i = pos;
+    while (s[i] != 0 && s[i] != '{' && s[i] != '}') {
+      ++i;
+    }
+    t.kind = FormatToken::kLiteral;
+    t.len = i - pos;
+    t.next = i;
+    return t;
+  }
+
+  size_t i = pos + 1;
+  t.kind = FormatToken::kError;
+  if (s[i] == ':') {
+    ++i;
+    if (s[i] != 0 && s[i] != '}' && IsFormatAlign(s[i + 1])) {
+      t.spec.fill = s[i];
+      t.spec.align = s[i + 1];
+      i += 2;
+    } else if (IsFormatAlign(s[i])) {
+      t.spec.align = s[i++];
+    }
+    if (s[i] == '+') {
+      t.spec.plus = true;
+      ++i;
+    }
+    if (s[i] == '0') {
+      t.spec.zero = true;
+      ++i;
+    }
+    while (s[i] >= '0' && s[i] <= '9') {
+      t.spec.width = t.spec.width * 10 + (s[i++] - '0');
+    }
+    if (s[i] == '.') {
+      ++i;
+      if (s[i] < '0' || s[i] > '9') {
+        return t;
+      }
+      t.spec.precision = 0;
+      while (s[i] >= '0' && s[i] <= '9') {
+        t.spec.precision = t.spec.precision * 10 + (s[i++] - '0');
+      }
+    }
+    switch (s[i]) {
+    case 'd':
+    case 'x':
+    case 'X':
+    case 'o':
+    case 'b':
+    case 'f':
+    case 'e':
+    case 'g':
+    case 's':
+    case 'c':
+      t.spec.type = s[i++];
+      break;
+    }
+  }
+  if (s[i] != '}') {
+    return t;
+  }
+  t.kind = FormatToken::kArg;
+  t.next = i + 1;
+  return t;
+}
+
+// Number of tokens in s, or -1 if s is not a valid format string
+constexpr int CountFormatTokens(const char *s) {
+  int count = 0;
+  for (FormatToken t = NextFormatToken(s, 0); t.kind != FormatToken::kEnd;
+       t = NextFormatToken(s, t.next)) {
+    if (t.kind == FormatToken::kError) {
+      return -1;
+    }
+    count++;
+  }
+  return count;
+}
+
+// Number of placeholders in s, or -1 if s is not a valid format string
+constexpr int CountFormatArgs(const char *s) {
+  int count = 0;
+  for (FormatToken t = NextFormatToken(s, 0); t.kind != FormatToken::kEnd;
+       t = NextFormatToken(s, t.next)) {
+    if (t.kind == FormatToken::kError) {
+      return -1;
+    }
+    count += t.kind == FormatToken::kArg;
+  }
+  return count;
+}
+
+template <size_t N> struct FormatTokens {
+  FormatToken tokens[N + 1]; // ends with a kEnd token
+};
+
+template <size_t N> constexpr FormatTokens<N> ParseFormat(const char *s) {
+  FormatTokens<N> out;
+  FormatToken t = NextFormatToken(s, 0);
+  for (size_t i = 0; i < N; ++i) {
+    out.tokens[i] = t;
+    t = NextFormatToken(s, t.next);
+  }
+  return out;
+}
+
+// Parsed form of the format string Fmt::Str(), Fmt being a type with a
+// constexpr static member function returning the string
+template <typename Fmt> struct FormatTable {
+  static constexpr int kTokens = CountFormatTokens(Fmt::Str());
+  static constexpr int kArgs = CountFormatArgs(Fmt::Str());
+  static_assert(kTokens >= 0, "invalid format string");
+  static constexpr FormatTokens<(kTokens > 0 ? kTokens : 0)> kTable =
+      ParseFormat<(kTokens > 0 ? kTokens : 0)>(Fmt::Str());
+};
+
+template <typename Fmt> constexpr int FormatTable<Fmt>::kTokens;
+template <typename Fmt> constexpr int FormatTable<Fmt>::kArgs;
+template <typename Fmt>
+constexpr FormatTokens<(FormatTable<Fmt>::kTokens > 0
+                            ? FormatTable<Fmt>::kTokens
+                            : 0)>
+    FormatTable<Fmt>::kTable;
+
+// Append the literal tokens starting at t, returns the next placeholder or
+// the end token
+inline const FormatToken *FormatLiterals(std::string &out, const char *fmt,
+                                         const FormatToken *t) {
+  while (t->kind == FormatToken::kLiteral) {
+    out.append(fmt + t->begin, t->len);
+    ++t;
+  }
+  return t;
+}
+
+// Append prefix and body padded according to spec
+inline void FormatPad(std::string &out, const char *prefix, const char *body,
+                      size_t len, const FormatSpec &spec, bool numeric) {
+  size_t prefix_len = std::strlen(prefix);
+  size_t n = prefix_len + len;
+  size_t pad = size_t(spec.width) > n ? spec.width - n : 0;
+  if (numeric && spec.zero && !spec.align) {
+    out.append(prefix, prefix_len);
+    out.append(pad, '0');
+    out.append(body, len);
+    return;
+  }
+  char align = spec.align ? spec.align : numeric ? '>' : '<';
+  size_t left = align == '>' ? pad : align == '^' ? pad / 2 : 0;
+  out.append(left, spec.fill);
+  out.append(prefix, prefix_len);
+  out.append(body, len);
+  out.append(pad - left, spec.fill);
+}
+
+inline void FormatString(std::string &out, const char *s, size_t len,
+                         const FormatSpec &spec) {
+  if (spec.precision >= 0 && size_t(spec.precision) < len) {
+    len = spec.precision;
+  }
+  FormatPad(out, "", s, len, spec, false);
+}
+
+template <typename T>
+void FormatInteger(std::string &out, T v, const FormatSpec &spec) {
+  using U = typename std::make_unsigned<T>::type;
+  bool neg = v < 0;
+  U u = neg ? U(0) - U(v) : U(v);
+  unsigned base = 10;
+  switch (spec.type) {
+  case 'x':
+  case 'X':
+    base = 16;
+    break;
+  case 'o':
+    base = 8;
+    break;
+  case 'b':
+    base = 2;
+    break;
+  }
+  const char *digits =
+      spec.type == 'X' ? "0123456789ABCDEF" : "0123456789abcdef";
+  char buf[sizeof(U) * 8];
+  char *end = buf + sizeof(buf);
+  char *p = end;
+  do {
+    *--p = digits[u % base];
+    u /= base;
+  } while (u != 0);
+  FormatPad(out, neg ? "-" : spec.plus ? "+" : "", p, end - p, spec, true);
+}
+
+template <typename T>
+void FormatFloat(std::string &out, T v, const FormatSpec &spec) {
+  char conv[8] = {'%', '.', '*'};
+  size_t n = 3;
+  if (std::is_same<T, long double>::value) {
+    conv[n++] = 'L';
+  }
+  conv[n] = spec.type == 'f' || spec.type == 'e' ? spec.type : 'g';
+  int precision = spec.precision >= 0 ? spec.precision : 6;
+  char buf[128];
+  std::string big;
+  char *p = buf;
+  int len = std::snprintf(buf, sizeof(buf), conv, precision, v);
+  if (len >= int(sizeof(buf))) {
+    big.resize(len + 1);
+    p = &big[0];
+    std::snprintf(p, len + 1, conv, precision, v);
+  }
+  const char *sign = spec.plus ? "+" : "";
+  if (len > 0 && p[0] == '-') {
+    sign = "-";
+    p++;
+    len--;
+  }
+  FormatPad(out, sign, p, len < 0 ? 0 : len, spec, true);
+}
+
+// Append the argument v formatted according to spec
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value &&
+                        !std::is_same<T, bool>::value &&
+                        !std::is_same<T, char>::value>::type
+FormatArg(std::string &out, T v, const FormatSpec &spec) {
+  FormatInteger(out, v, spec);
+}
+
+inline void FormatArg(std::string &out, bool v, const FormatSpec &spec) {
+  if (spec.type == 'd') {
+    FormatInteger(out, int(v), spec);
+  } else {
+    FormatString(out, v ? "true" : "false", v ? 4 : 5, spec);
+  }
+}
+
+inline void FormatArg(std::string &out, char v, const FormatSpec &spec) {
+  switch (spec.type) {
+  case 'd':
+  case 'x':
+  case 'X':
+  case 'o':
+  case 'b':
+    FormatInteger(out, v, spec);
+    break;
+  default:
+    FormatString(out, &v, 1, spec);
+  }
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+FormatArg(std::string &out, T v, const FormatSpec &spec) {
+  FormatFloat(out, v, spec);
+}
+
+inline void FormatArg(std::string &out, const char *s,
+                      const FormatSpec &spec) {
+  FormatString(out, s, std::strlen(s), spec);
+}
+
+inline void FormatArg(std::string &out, const std::string &s,
+                      const FormatSpec &spec) {
+  FormatString(out, s.data(), s.size(), spec);
+}
+
+// Anything else through its operator<<
+template <typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value &&
+                        !std::is_convertible<T, const char *>::value &&
+                        !std::is_same<T, std::string>::value>::type
+FormatArg(std::string &out, const T &v, const FormatSpec &spec) {
+  std::ostringstream os;
+  os << v;
+  FormatArg(out, os.str(), spec);
+}
@@ -0,0 +1,215 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+GzipReader
+
+Pipelined streaming decompression of gzip compressed ITCH or PITCH
+archives. A background thread decompresses into a ring of large buffers
+while the calling thread parses the other end, so replay runs at the
+speed of the slower stage.
+
+Each buffer has headroom in front of its data. A message straddling two
+buffers is completed by copying the unconsumed tail of the previous
+buffer into the headroom of the next, so the parser always sees whole
+messages in contiguous memory.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class GzipReader {
+public:
+  static constexpr size_t kBufferSize = 16 << 20;
+  static constexpr size_t kBuffers = 4;
+  static constexpr size_t kHeadroom = 64 << 10;
+
+  GzipReader(const std::string &fname, size_t buffer_size = kBufferSize,
+             size_t nbuffers = kBuffers, size_t headroom = kHeadroom)
+      : fname_(fname), buffer_size_(buffer_size), headroom_(headroom),
+        buffers_(std::max<size_t>(nbuffers, 3)) {
+    for (auto &b : buffers_) {
+      b.data.reset(new char[headroom_ + buffer_size_]);
+    }
+  }
+
+  ~GzipReader() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  // Decompress the file and call parse(const char *buf, size_t len) for
+  // each chunk. parse returns the number of bytes consumed, the remainder
+  // is passed again at the front of the next chunk. Returns the number of
+  // decompressed bytes.
+  template <typename Parse> uint64_t Run(Parse parse) {
+    thread_ = std::thread([this] { Decompress(); });
+
+    uint64_t total = 0;
+    const char *carry = nullptr;
+    size_t carry_len = 0;
+    for (size_t n = 0;; ++n) {
+      Buffer &buf = buffers_[n % buffers_.size()];
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto start = std::chrono::steady_clock::now();
+        cond_.wait(lock, [&] { return filled_ > n || error_; });
+        consumer_wait_ += std::chrono::steady_clock::now() - start;
+        if (filled_ <= n) {
+          std::rethrow_exception(error_);
+        }
+      }
+
+      if (carry_len > headroom_) {
+        throw std::runtime_error("gzip: message larger than headroom");
+      }
+      char *begin = buf.data.get() + headroom_ - carry_len;
+      if (carry_len > 0) {
+        std::memcpy(begin, carry, carry_len);
+      }
+      if (n > 0) {
+        Release(n - 1);
+      }
+
+      size_t len = carry_len + buf.len;
+      size_t used = len > 0 ? parse(begin, len) : 0;
+      carry = begin + used;
+      carry_len = len - used;
+      total += buf.len;
+
+      if (buf.eof) {
+        Release(n);
+        thread_.join();
+        return total;
+      }
+    }
+  }
+
+  // Time the parser waited for decompressed data
+  std::chrono::nanoseconds ConsumerWait() const { return consumer_wait_; }
+
+  // Time decompression waited for a free buffer
+  std::chrono::nanoseconds ProducerWait() const { return producer_wait_; }
+
+private:
+  GzipReader(const GzipReader &) = delete;
+  GzipReader &operator=(const GzipReader &) = delete;
+
+  struct Buffer {
+    std::unique_ptr<char[]> data;
+    size_t len = 0;
+    bool eof = false;
+  };
+
+  void Release(size_t n) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      released_ = n + 1;
+    }
+    cond_.notify_all();
+  }
+
+  void Decompress() {
+    try {
+      boost::iostreams::filtering_istream in;
+      in.push(boost::iostreams::gzip_decompressor());
+      in.push(boost::iostreams::file_source(fname_, std::ios::binary));
+      if (!in.component<boost::iostreams::file_source>(1)->is_open()) {
+        throw std::runtime_error("gzip: cannot open " + fname_);
+      }
+      for (size_t n = 0;; ++n) {
+        Buffer &buf = buffers_[n % buffers_.size()];
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          auto start = std::chrono::steady_clock::now();
+          cond_.wait(lock,
+                     [&] { return n - released_ < buffers_.size() || stop_; });
+          producer_wait_ += std::chrono::steady_clock::now() - start;
+          if (stop_) {
+            return;
+          }
+        }
+        char *data = buf.data.get() + headroom_;
+        size_t len = 0;
+        while (len < buffer_size_ && in) {
+          in.read(data + len, buffer_size_ - len);
+          len += in.gcount();
+        }
+        buf.len = len;
+        buf.eof = !in;
+        if (in.bad()) {
+          throw std::runtime_error("gzip: read error in " + fname_);
+        }
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          filled_ = n + 1;
+        }
+        cond_.notify_all();
+        if (buf.eof) {
+          return;
+        }
+      }
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = std::current_exception();
+      }
+      cond_.notify_all();
+    }
+  }
+
+  const std::string fname_;
+  const size_t buffer_size_;
+  const size_t headroom_;
+  std::vector<Buffer> buffers_;
+  std::thread thread_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  size_t filled_ = 0;   // buffers decompressed
+  size_t released_ = 0; // buffers returned by the parser
+  bool stop_ = false;
+  std::exception_ptr error_;
+
+  std::chrono::nanoseconds consumer_wait_{0};
+  std::chrono::nanoseconds producer_wait_{0};
+};
@@ -0,0 +1,114 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "gzip_reader.hpp"
+#include <boost/iostreams/device/file.hpp>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+
+static void Write(const std::string &fname, const std::string &data) {
+  boost::iostreams::filtering_ostream out;
+  out.push(boost::iostreams::gzip_compressor());
+  out.push(boost::iostreams::file_sink(fname, std::ios::binary));
+  out.write(data.data(), data.size());
+}
+
+int main(int argc, char *argv[]) {
+  std::string fname =
+      "/tmp/gzip_reader_test." + std::to_string(getpid()) + ".gz";
+
+  // Length prefixed messages of varying size, message i filled with i
+  std::string data;
+  const int count = 20000;
+  for (int i = 0; i < count; ++i) {
+    size_t len = 1 + i % 300;
+    data.push_back(len >> 8);
+    data.push_back(len);
+    data.append(len, (char)i);
+  }
+  Write(fname, data);
+
+  {
+    // Small buffers so most messages straddle a buffer boundary
+    GzipReader reader(fname, 1000, 3, 512);
+    int n = 0;
+    size_t chunks = 0;
+    uint64_t bytes = reader.Run([&](const char *buf, size_t len) {
+      chunks++;
+      size_t i = 0;
+      while (i + 2 <= len) {
+        size_t msg_len = (uint8_t)buf[i] << 8 | (uint8_t)buf[i + 1];
+        if (i + 2 + msg_len > len) {
+          break;
+        }
+        assert(msg_len == size_t(1 + n % 300));
+        assert(buf[i + 2] == (char)n && buf[i + 1 + msg_len] == (char)n);
+        n++;
+        i += 2 + msg_len;
+      }
+      return i;
+    });
+    assert(bytes == data.size());
+    assert(n == count);
+    assert(chunks >= data.size() / 1000);
+  }
+
+  {
+    // Default buffers, nothing consumed until the end
+    GzipReader reader(fname);
+    std::string out;
+    reader.Run([&](const char *buf, size_t len) {
+      out.append(buf, len);
+      return len;
+    });
+    assert(out == data);
+  }
+
+  {
+    // Message larger than the headroom
+    GzipReader reader(fname, 100, 3, 16);
+    bool thrown = false;
+    try {
+      reader.Run([](const char *buf, size_t len) { return 0; });
+    } catch (std::runtime_error &) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+
+  {
+    // Missing file
+    GzipReader reader(fname + ".missing");
+    bool thrown = false;
+    try {
+      reader.Run([](const char *buf, size_t len) { return len; });
+    } catch (std::exception &) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+
+  std::remove(fname.c_str());
+  return 0;
+}
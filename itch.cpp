@@ -21,11 +21,19 @@ SOFTWARE.
  */
 
 #include "feed.hpp"
+#include "gzip_reader.hpp"
 #include "itch.hpp"
+#include "replay.hpp"
 #include <algorithm>
 #include <boost/iostreams/device/mapped_file.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <numeric>
 #include <sys/time.h>
+#include <unistd.h>
 #include <vector>
 
 using namespace std;
@@ -48,6 +56,66 @@ public:
   int count;
 };
 
+// Records how late each callback fires compared to when its message was
+// due in a replay paced by the exchange timestamps, in a fixed histogram
+// so a full day replay doesn't grow memory
+class LatencyHandler : public Handler {
+public:
+  static constexpr bool kTimestamps = true;
+  static constexpr size_t kBuckets = 100000;
+  static constexpr int64_t kBucketNs = 10; // last bucket is open ended
+
+  LatencyHandler(double speed) : speed(speed) {}
+
+  void OnTimestamp(uint64_t ns) {
+    if (origin == 0) {
+      origin = Now();
+      first = ns;
+    }
+    due = origin + (ns - first) / speed;
+  }
+
+  void OnQuote(OrderBook *book, bool top) {
+    count++;
+    int64_t late = std::max<int64_t>(Now() - due, 0);
+    hist[std::min<size_t>(late / kBucketNs, kBuckets - 1)]++;
+    max = std::max(max, late);
+    samples++;
+  }
+
+  // Lateness of the callback at fraction p of them, rounded up to the
+  // bucket
+  int64_t Percentile(double p) const {
+    uint64_t rank = p * (samples - 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; samples > 0 && i < kBuckets - 1; ++i) {
+      seen += hist[i];
+      if (seen > rank) {
+        return std::min<int64_t>((i + 1) * kBucketNs, max);
+      }
+    }
+    return max;
+  }
+
+  void OnTrade(OrderBook *book, int64_t shares, int64_t price, bool top) {
+    OnQuote(book, top);
+  }
+
+  static uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  double speed;
+  uint64_t origin = 0;
+  uint64_t first = 0;
+  uint64_t due = 0;
+  std::vector<uint64_t> hist = std::vector<uint64_t>(kBuckets);
+  uint64_t samples = 0;
+  int64_t max = 0;
+};
+
 static inline uint64_t rdtscp() {
   uint64_t lo, hi;
   uint32_t aux;
@@ -55,14 +123,158 @@ static inline uint64_t rdtscp() {
   return (hi << 32) + lo;
 }
 
-int main(int argc, char *argv[]) {
+#ifdef SPARTAN_STATS
+using Stats = SharedStats;
+#else
+using Stats = NullStats;
+#endif
+
+static int Run(int argc, char *argv[]) {
+#ifdef SPARTAN_STATS
+  StatsSegment segment("/spartan-itch");
+  Stats stats(segment.get());
+#else
+  Stats stats;
+#endif
+
   Handler handler;
-  Feed<Handler> feed(handler, 16000000, true, true);
-  Itch50Parser<Feed<Handler>> parser(feed);
+  // Order map is presized from the stock directory at start of system hours
+  Feed<Handler, Stats> feed(handler, 1000000, true, true, stats);
+  Itch50Parser<Feed<Handler, Stats>, Stats> parser(feed, stats);
 
   // feed.Subscribe("SPY");
 
-  boost::iostreams::mapped_file_source file(argv[1]);
+  // -t measures ParseMany throughput, -b ParseBatch throughput, -j N
+  // parallel replay throughput with N threads, -x SPEED exchange to callback
+  // latency in a replay paced at SPEED times real time, default measures
+  // per message latency
+  int opt;
+  char mode = 'l';
+  size_t nthreads = 1;
+  double pace = 1;
+  bool usage = false;
+  while ((opt = getopt(argc, argv, "btj:x:")) != -1) {
+    if (opt == '?') {
+      usage = true;
+      continue;
+    }
+    mode = opt;
+    if (opt == 'j') {
+      nthreads = std::max(1, atoi(optarg));
+    }
+    if (opt == 'x') {
+      pace = atof(optarg);
+    }
+  }
+  if (usage || optind >= argc || pace <= 0) {
+    std::cerr << "usage: " << argv[0] << " [-b|-t|-j N|-x SPEED] FILE[.gz]"
+              << std::endl;
+    return 1;
+  }
+
+  std::string fname = argv[optind];
+  if (fname.size() > 3 && fname.compare(fname.size() - 3, 3, ".gz") == 0) {
+    // Compressed archives are decompressed on a separate thread, which only
+    // the throughput modes can measure
+    if (mode != 'b' && mode != 't') {
+      std::cerr << argv[0] << ": " << fname
+                << ": compressed files need -b or -t" << std::endl;
+      return 1;
+    }
+    GzipReader reader(fname);
+    auto start = std::chrono::steady_clock::now();
+    uint64_t bytes = reader.Run([&](const char *buf, size_t len) {
+      return mode == 'b' ? parser.ParseBatch(buf, len)
+                         : parser.ParseMany(buf, len);
+    });
+    auto stop = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(stop - start).count();
+    std::cout << bytes << " bytes in " << secs << " s, " << bytes / secs / 1e6
+              << " MB/s" << std::endl;
+    std::cout << "Parser waited " << reader.ConsumerWait().count() / 1e9
+              << " s, decompression waited "
+              << reader.ProducerWait().count() / 1e9 << " s" << std::endl;
+    std::cout << "Open orders: " << feed.Size() << std::endl;
+    return 0;
+  }
+
+  boost::iostreams::mapped_file_source file(fname);
+
+  if (mode == 'j') {
+    using ParallelFeed = Feed<Handler>;
+    using ParallelParser = Itch50Parser<ParallelFeed>;
+    std::vector<std::unique_ptr<Handler>> handlers;
+    std::vector<std::unique_ptr<ParallelFeed>> feeds;
+    std::vector<std::unique_ptr<ParallelParser>> parsers;
+    std::vector<ParallelParser *> workers;
+    for (size_t i = 0; i < nthreads; ++i) {
+      handlers.emplace_back(new Handler());
+      feeds.emplace_back(new ParallelFeed(*handlers.back(), 1000000 / nthreads,
+                                          true, true));
+      parsers.emplace_back(new ParallelParser(*feeds.back()));
+      workers.push_back(parsers.back().get());
+    }
+    ParallelReplay<ParallelParser> replay(workers);
+    auto start = std::chrono::steady_clock::now();
+    uint64_t msgs = replay.Run(file.data(), file.size());
+    auto stop = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(stop - start).count();
+    std::cout << msgs << " messages in " << secs << " s, " << msgs / secs
+              << " messages/s with " << nthreads << " threads" << std::endl;
+    for (size_t i = 0; i < nthreads; ++i) {
+      std::cout << "Thread " << i << " callbacks " << handlers[i]->count
+                << " orders " << feeds[i]->Size() << std::endl;
+    }
+    return 0;
+  }
+
+  if (mode == 'x') {
+    LatencyHandler handler(pace);
+    Feed<LatencyHandler> feed(handler, 1000000, true, true);
+    Itch50Parser<Feed<LatencyHandler>> parser(feed);
+    for (size_t i = 0; i + 2 <= file.size();) {
+      const char *msg = file.data() + i + 2;
+      if (handler.origin != 0) {
+        uint64_t ts = itch50::AddOrder::Timestamp::Read(msg);
+        uint64_t due = handler.origin + (ts - handler.first) / pace;
+        while (LatencyHandler::Now() < due) {
+        }
+      }
+      parser.ParseMessage(0, msg);
+      i += __builtin_bswap16(
+               *reinterpret_cast<const uint16_t *>(file.data() + i)) +
+           2;
+    }
+    std::cout << handler.samples << " callbacks, exchange to callback ns"
+              << std::endl;
+    std::cout << "50%:    " << handler.Percentile(0.5) << std::endl;
+    std::cout << "99%:    " << handler.Percentile(0.99) << std::endl;
+    std::cout << "99.9%:  " << handler.Percentile(0.999) << std::endl;
+    std::cout << "Max:    " << handler.max << std::endl;
+    return 0;
+  }
+
+  if (mode != 'l') {
+    size_t msgs = 0;
+    for (size_t i = 0; i + 2 <= file.size();) {
+      i += __builtin_bswap16(
+               *reinterpret_cast<const uint16_t *>(file.data() + i)) +
+           2;
+      msgs++;
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (mode == 'b') {
+      parser.ParseBatch(file.data(), file.size());
+    } else {
+      parser.ParseMany(file.data(), file.size());
+    }
+    auto stop = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(stop - start).count();
+    std::cout << msgs << " messages in " << secs << " s, " << msgs / secs
+              << " messages/s" << std::endl;
+    std::cout << "Open orders: " << feed.Size() << std::endl;
+    return 0;
+  }
 
   uint64_t overhead = std::numeric_limits<uint64_t>::max();
   for (int i = 0; i < 10; ++i) {
@@ -82,12 +294,10 @@ int main(int argc, char *argv[]) {
 
   size_t i = 0;
   size_t count = 0;
-  char buf[2048];
   while (i < file.size() && count < 1000000) {
     int len =
         __builtin_bswap16(*reinterpret_cast<const uint16_t *>(file.data() + i));
-    memcpy(buf, file.data() + i + 2, len);
-    parser.ParseMessage(0, buf);
+    parser.ParseMessage(0, file.data() + i + 2);
     count++;
     i += len + 2;
   }
@@ -100,9 +310,8 @@ int main(int argc, char *argv[]) {
   while (i < file.size()) {
     int len =
         __builtin_bswap16(*reinterpret_cast<const uint16_t *>(file.data() + i));
-    memcpy(buf, file.data() + i + 2, len);
     auto start = rdtscp();
-    parser.ParseMessage(0, buf);
+    parser.ParseMessage(0, file.data() + i + 2);
     auto stop = rdtscp();
     auto diff = (stop - start - overhead) / speed;
     if (diff < 10000000000) {
@@ -143,3 +352,12 @@ int main(int argc, char *argv[]) {
 
   return 0;
 }
+
+int main(int argc, char *argv[]) {
+  try {
+    return Run(argc, argv);
+  } catch (const std::exception &e) {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -22,107 +22,388 @@ SOFTWARE.
 
 #pragma once
 
+#include "schema.hpp"
+#include "stats.hpp"
+#include "timestamp.hpp"
 #include <cstdint>
 
-template <typename Handler> class Itch50Parser {
+// NASDAQ TotalView-ITCH 5.0 message layouts, all integers big endian
+namespace itch50 {
+
+// Header common to all messages
+template <typename M, uint8_t Type, size_t Length>
+struct Header : Message<Type, Length> {
+  using Locate = BigEndian<M, 1, uint16_t>;
+  using Tracking = BigEndian<M, 3, uint16_t>;
+  using Timestamp = BigEndian48<M, 5>;
+};
+
+struct SystemEvent : Header<SystemEvent, 'S', 12> {
+  using EventCode = Char<SystemEvent, 11>;
+};
+
+struct StockDirectory : Header<StockDirectory, 'R', 39> {
+  using Stock = Alpha<StockDirectory, 11, 8>;
+  using MarketCategory = Char<StockDirectory, 19>;
+  using FinancialStatus = Char<StockDirectory, 20>;
+  using RoundLotSize = BigEndian<StockDirectory, 21, int32_t>;
+};
+
+struct StockTradingAction : Header<StockTradingAction, 'H', 25> {
+  using Stock = Alpha<StockTradingAction, 11, 8>;
+  using TradingState = Char<StockTradingAction, 19>;
+  using Reason = Alpha<StockTradingAction, 21, 4>;
+};
+
+struct AddOrder : Header<AddOrder, 'A', 36> {
+  using Ref = BigEndian<AddOrder, 11, uint64_t>;
+  using Side = Char<AddOrder, 19>;
+  using Shares = BigEndian<AddOrder, 20, int32_t>;
+  using Stock = Alpha<AddOrder, 24, 8>;
+  using Price = BigEndian<AddOrder, 32, int32_t>;
+};
+
+struct AddOrderMPID : Header<AddOrderMPID, 'F', 40> {
+  using Ref = BigEndian<AddOrderMPID, 11, uint64_t>;
+  using Side = Char<AddOrderMPID, 19>;
+  using Shares = BigEndian<AddOrderMPID, 20, int32_t>;
+  using Stock = Alpha<AddOrderMPID, 24, 8>;
+  using Price = BigEndian<AddOrderMPID, 32, int32_t>;
+  using Attribution = Alpha<AddOrderMPID, 36, 4>;
+};
+
+struct OrderExecuted : Header<OrderExecuted, 'E', 31> {
+  using Ref = BigEndian<OrderExecuted, 11, uint64_t>;
+  using Shares = BigEndian<OrderExecuted, 19, int32_t>;
+  using Match = BigEndian<OrderExecuted, 23, uint64_t>;
+};
+
+struct OrderExecutedWithPrice : Header<OrderExecutedWithPrice, 'C', 36> {
+  using Ref = BigEndian<OrderExecutedWithPrice, 11, uint64_t>;
+  using Shares = BigEndian<OrderExecutedWithPrice, 19, int32_t>;
+  using Match = BigEndian<OrderExecutedWithPrice, 23, uint64_t>;
+  using Printable = Char<OrderExecutedWithPrice, 31>;
+  using Price = BigEndian<OrderExecutedWithPrice, 32, int32_t>;
+};
+
+struct OrderCancel : Header<OrderCancel, 'X', 23> {
+  using Ref = BigEndian<OrderCancel, 11, uint64_t>;
+  using Shares = BigEndian<OrderCancel, 19, int32_t>;
+};
+
+struct OrderDelete : Header<OrderDelete, 'D', 19> {
+  using Ref = BigEndian<OrderDelete, 11, uint64_t>;
+};
+
+struct OrderReplace : Header<OrderReplace, 'U', 35> {
+  using Ref = BigEndian<OrderReplace, 11, uint64_t>;
+  using NewRef = BigEndian<OrderReplace, 19, uint64_t>;
+  using Shares = BigEndian<OrderReplace, 27, int32_t>;
+  using Price = BigEndian<OrderReplace, 31, int32_t>;
+};
+
+struct Trade : Header<Trade, 'P', 44> {
+  using Ref = BigEndian<Trade, 11, uint64_t>;
+  using Side = Char<Trade, 19>;
+  using Shares = BigEndian<Trade, 20, int32_t>;
+  using Stock = Alpha<Trade, 24, 8>;
+  using Price = BigEndian<Trade, 32, int32_t>;
+  using Match = BigEndian<Trade, 36, uint64_t>;
+};
+
+struct CrossTrade : Header<CrossTrade, 'Q', 40> {
+  using Shares = BigEndian<CrossTrade, 11, uint64_t>;
+  using Stock = Alpha<CrossTrade, 19, 8>;
+  using Price = BigEndian<CrossTrade, 27, int32_t>;
+  using Match = BigEndian<CrossTrade, 31, uint64_t>;
+  using CrossType = Char<CrossTrade, 39>;
+};
+
+struct BrokenTrade : Header<BrokenTrade, 'B', 19> {
+  using Match = BigEndian<BrokenTrade, 11, uint64_t>;
+};
+
+struct NOII : Header<NOII, 'I', 50> {
+  using PairedShares = BigEndian<NOII, 11, uint64_t>;
+  using ImbalanceShares = BigEndian<NOII, 19, uint64_t>;
+  using Direction = Char<NOII, 27>;
+  using Stock = Alpha<NOII, 28, 8>;
+  using FarPrice = BigEndian<NOII, 36, int32_t>;
+  using NearPrice = BigEndian<NOII, 40, int32_t>;
+  using RefPrice = BigEndian<NOII, 44, int32_t>;
+  using CrossType = Char<NOII, 48>;
+  using PriceVariation = Char<NOII, 49>;
+};
+
+using Messages =
+    MessageSet<SystemEvent, StockDirectory, StockTradingAction, AddOrder,
+               AddOrderMPID, OrderExecuted, OrderExecutedWithPrice,
+               OrderCancel, OrderDelete, OrderReplace, Trade, CrossTrade,
+               BrokenTrade, NOII>;
+
+constexpr LengthTable<Messages> kLengths;
+
+} // namespace itch50
+
+template <typename Handler, typename Stats = NullStats> class Itch50Parser {
 
 public:
-  Itch50Parser(Handler &handler) : handler_(handler) {}
+  Itch50Parser(Handler &handler, Stats stats = Stats())
+      : handler_(handler), stats_(stats) {}
 
   void ParseMessage(uint64_t seqno, const char *buf) {
-    switch (buf[0]) {
-    case 'A':
-      return Add(seqno, buf);
-    case 'F':
-      return Add(seqno, buf);
-    case 'E':
-      return Executed(seqno, buf);
-    case 'C':
-      return ExecutedAtPrice(seqno, buf);
-    case 'X':
-      return Cancel(seqno, buf);
-    case 'D':
-      return Delete(seqno, buf);
-    case 'U':
-      return Replace(seqno, buf);
-    }
+    uint64_t start = stats_.Start();
+    Timestamp(buf, WantsTimestamps<Handler>());
+    Dispatch(seqno, buf);
+    stats_.Message(buf[0], start);
   }
 
   size_t ParseMany(const char *buf, size_t len) {
     size_t i = 0;
-    while (i < len) {
+    while (i + 2 <= len) {
       int msg_len = read16(&buf[i]);
       if (i + msg_len + 2 > len) {
         break;
       }
-      ParseMessage(0, &buf[i + 2]);
+      if (Valid(&buf[i + 2], msg_len)) {
+        ParseMessage(0, &buf[i + 2]);
+      } else {
+        invalid_++;
+      }
       i += msg_len + 2;
     }
     return i;
   }
 
+  // Same as ParseMany but works on batches of messages. Each batch is first
+  // indexed and the order refs handed to Handler::Prefetch, then the
+  // messages are applied in order. This overlaps the order map cache misses
+  // of a batch instead of taking them one message at a time.
+  size_t ParseBatch(const char *buf, size_t len) {
+    const char *msgs[kBatchSize];
+    size_t i = 0;
+    for (;;) {
+      size_t n = 0;
+      while (n < kBatchSize && i + 2 <= len) {
+        size_t msg_len = read16(&buf[i]);
+        if (i + msg_len + 2 > len) {
+          break;
+        }
+        if (Valid(&buf[i + 2], msg_len)) {
+          msgs[n++] = &buf[i + 2];
+        } else {
+          invalid_++;
+        }
+        i += msg_len + 2;
+      }
+      if (n == 0) {
+        return i;
+      }
+      for (size_t j = 0; j < n; ++j) {
+        Prefetch(msgs[j]);
+      }
+      for (size_t j = 0; j < n; ++j) {
+        ParseMessage(0, msgs[j]);
+      }
+    }
+  }
+
+  // Known message type of at least the length its layout requires
+  static bool Valid(const char *buf, size_t len) {
+    return len > 0 && itch50::kLengths.Valid(buf[0], len);
+  }
+
+  // Number of messages ParseMany and ParseBatch skipped as truncated or of
+  // unknown type
+  uint64_t Invalid() const { return invalid_; }
+
+  static constexpr size_t kBatchSize = 32;
+
   using Id = uint64_t;
   using Qty = int32_t;
   using Price = int32_t;
   using Symbol = uint64_t;
+  using Locate = uint16_t;
 
 private:
-  uint32_t read16(const void *buf) {
-    return __builtin_bswap16(*static_cast<const uint16_t *>(buf));
+  // Order messages make up almost all of the feed, keep them in a small
+  // jump table and move everything else out of line.
+  void Dispatch(uint64_t seqno, const char *buf) {
+    switch (read8(buf)) {
+    case itch50::AddOrder::kType:
+      return Add<itch50::AddOrder>(seqno, buf);
+    case itch50::AddOrderMPID::kType:
+      return Add<itch50::AddOrderMPID>(seqno, buf);
+    case itch50::OrderExecuted::kType:
+      return Executed(seqno, buf);
+    case itch50::OrderExecutedWithPrice::kType:
+      return ExecutedAtPrice(seqno, buf);
+    case itch50::OrderCancel::kType:
+      return Cancel(seqno, buf);
+    case itch50::OrderDelete::kType:
+      return Delete(seqno, buf);
+    case itch50::OrderReplace::kType:
+      return Replace(seqno, buf);
+    default:
+      return DispatchOther(seqno, buf);
+    }
   }
 
-  uint32_t read32(const void *buf) {
-    return __builtin_bswap32(*static_cast<const uint32_t *>(buf));
+  __attribute__((noinline, cold)) void DispatchOther(uint64_t seqno,
+                                                      const char *buf) {
+    switch (read8(buf)) {
+    case itch50::SystemEvent::kType:
+      return SystemEvent(seqno, buf);
+    case itch50::StockDirectory::kType:
+      return StockDirectory(seqno, buf);
+    case itch50::StockTradingAction::kType:
+      return TradingAction(seqno, buf);
+    case itch50::Trade::kType:
+      return Trade(seqno, buf);
+    case itch50::CrossTrade::kType:
+      return CrossTrade(seqno, buf);
+    case itch50::BrokenTrade::kType:
+      return BrokenTrade(seqno, buf);
+    case itch50::NOII::kType:
+      return Imbalance(seqno, buf);
+    }
   }
 
-  uint64_t read64(const void *buf) {
-    return __builtin_bswap64(*static_cast<const uint64_t *>(buf));
+  void Timestamp(const char *buf, std::true_type) {
+    handler_.OnTimestamp(itch50::AddOrder::Timestamp::Read(buf));
   }
 
-  uint64_t readsym8(const void *buf) {
-    return __builtin_bswap64(*static_cast<const uint64_t *>(buf));
+  void Timestamp(const char *buf, std::false_type) {}
+
+  void Prefetch(const char *buf) {
+    using namespace itch50;
+    static_assert(AddOrder::Ref::kOffset == OrderReplace::Ref::kOffset &&
+                      AddOrderMPID::Ref::kOffset == OrderDelete::Ref::kOffset,
+                  "order messages disagree on the ref offset");
+    switch (read8(buf)) {
+    case AddOrder::kType:
+    case AddOrderMPID::kType:
+    case OrderExecuted::kType:
+    case OrderExecutedWithPrice::kType:
+    case OrderCancel::kType:
+    case OrderDelete::kType:
+    case OrderReplace::kType:
+      handler_.Prefetch(OrderDelete::Ref::Read(buf));
+    }
+  }
+
+  uint8_t read8(const void *buf) { return *static_cast<const uint8_t *>(buf); }
+
+  uint32_t read16(const void *buf) {
+    return __builtin_bswap16(*static_cast<const uint16_t *>(buf));
   }
 
-  void Add(uint64_t seqno, const char *buf) {
-    Id ref = read64(buf + 11);
-    bool bs = buf[19] == 'B' ? true : false;
-    Qty shares = read32(buf + 20);
-    Symbol stock = readsym8(buf + 24);
-    Price price = read32(buf + 32);
+  template <typename M> void Add(uint64_t seqno, const char *buf) {
+    Id ref = M::Ref::Read(buf);
+    bool bs = M::Side::Read(buf) == 'B' ? true : false;
+    Qty shares = M::Shares::Read(buf);
+    Symbol stock = M::Stock::Read(buf);
+    Price price = M::Price::Read(buf);
     handler_.Add(seqno, ref, bs, shares, stock, price);
   }
 
   void Executed(uint64_t seqno, const char *buf) {
-    Id ref = read64(buf + 11);
-    Qty shares = read32(buf + 19);
+    using M = itch50::OrderExecuted;
+    Id ref = M::Ref::Read(buf);
+    Qty shares = M::Shares::Read(buf);
     handler_.Executed(seqno, ref, shares);
   }
 
   void ExecutedAtPrice(uint64_t seqno, const char *buf) {
-    Id ref = read64(buf + 11);
-    Qty shares = read32(buf + 19);
-    Price price = read32(buf + 32);
+    using M = itch50::OrderExecutedWithPrice;
+    Id ref = M::Ref::Read(buf);
+    Qty shares = M::Shares::Read(buf);
+    Price price = M::Price::Read(buf);
     handler_.ExecutedAtPrice(seqno, ref, shares, price);
   }
 
   void Cancel(uint64_t seqno, const char *buf) {
-    Id ref = read64(buf + 11);
-    Qty shares = read32(buf + 19);
+    using M = itch50::OrderCancel;
+    Id ref = M::Ref::Read(buf);
+    Qty shares = M::Shares::Read(buf);
     handler_.Reduce(seqno, ref, shares);
   }
 
   void Delete(uint64_t seqno, const char *buf) {
-    Id ref = read64(buf + 11);
+    using M = itch50::OrderDelete;
+    Id ref = M::Ref::Read(buf);
     handler_.Delete(seqno, ref);
   }
 
   void Replace(uint64_t seqno, const char *buf) {
-    Id ref = read64(buf + 11);
-    Id ref2 = read64(buf + 19);
-    Qty shares = read32(buf + 27);
-    Price price = read32(buf + 31);
+    using M = itch50::OrderReplace;
+    Id ref = M::Ref::Read(buf);
+    Id ref2 = M::NewRef::Read(buf);
+    Qty shares = M::Shares::Read(buf);
+    Price price = M::Price::Read(buf);
     handler_.Replace(seqno, ref, ref2, shares, price);
   }
 
+  void SystemEvent(uint64_t seqno, const char *buf) {
+    using M = itch50::SystemEvent;
+    char code = M::EventCode::Read(buf);
+    handler_.SystemEvent(seqno, code);
+  }
+
+  void StockDirectory(uint64_t seqno, const char *buf) {
+    using M = itch50::StockDirectory;
+    Locate locate = M::Locate::Read(buf);
+    Symbol stock = M::Stock::Read(buf);
+    Qty round_lot = M::RoundLotSize::Read(buf);
+    handler_.StockDirectory(seqno, locate, stock, round_lot);
+  }
+
+  void TradingAction(uint64_t seqno, const char *buf) {
+    using M = itch50::StockTradingAction;
+    Locate locate = M::Locate::Read(buf);
+    Symbol stock = M::Stock::Read(buf);
+    char state = M::TradingState::Read(buf);
+    handler_.TradingAction(seqno, locate, stock, state);
+  }
+
+  void Trade(uint64_t seqno, const char *buf) {
+    using M = itch50::Trade;
+    Qty shares = M::Shares::Read(buf);
+    Symbol stock = M::Stock::Read(buf);
+    Price price = M::Price::Read(buf);
+    handler_.Trade(seqno, shares, stock, price);
+  }
+
+  void CrossTrade(uint64_t seqno, const char *buf) {
+    using M = itch50::CrossTrade;
+    uint64_t shares = M::Shares::Read(buf);
+    Symbol stock = M::Stock::Read(buf);
+    Price price = M::Price::Read(buf);
+    char cross_type = M::CrossType::Read(buf);
+    handler_.CrossTrade(seqno, shares, stock, price, cross_type);
+  }
+
+  void BrokenTrade(uint64_t seqno, const char *buf) {
+    using M = itch50::BrokenTrade;
+    uint64_t match = M::Match::Read(buf);
+    handler_.BrokenTrade(seqno, match);
+  }
+
+  void Imbalance(uint64_t seqno, const char *buf) {
+    using M = itch50::NOII;
+    uint64_t paired = M::PairedShares::Read(buf);
+    uint64_t imbalance = M::ImbalanceShares::Read(buf);
+    char direction = M::Direction::Read(buf);
+    Symbol stock = M::Stock::Read(buf);
+    Price far = M::FarPrice::Read(buf);
+    Price near = M::NearPrice::Read(buf);
+    Price ref = M::RefPrice::Read(buf);
+    char cross_type = M::CrossType::Read(buf);
+    handler_.Imbalance(seqno, stock, paired, imbalance, direction, far, near,
+                       ref, cross_type);
+  }
+
   Handler &handler_;
+  Stats stats_;
+  uint64_t invalid_ = 0;
 };
@@ -0,0 +1,344 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "itch.hpp"
+#include "feed.hpp"
+#include "moldudp64.hpp"
+#include <cassert>
+#include <string>
+#include <vector>
+
+struct Handler {
+  void OnQuote(OrderBook *book, bool top) { bp = book->GetBestPrice(); }
+
+  void OnTrade(OrderBook *book, int64_t shares, int64_t price, bool top) {
+    lastq = shares;
+    lastp = price;
+    bp = book->GetBestPrice();
+  }
+
+  static constexpr bool kBrokenTrades = true;
+  static constexpr bool kImbalances = true;
+
+  void OnBrokenTrade(uint64_t match) { broken = match; }
+
+  void OnImbalance(OrderBook *book, int64_t paired, int64_t imbalance,
+                   char direction, int64_t far, int64_t near, int64_t ref,
+                   char cross_type) {
+    this->imbalance = direction == 'S' ? -imbalance : imbalance;
+    this->ref = ref;
+  }
+
+  BestPrice bp;
+  int lastq = 0;
+  int lastp = 0;
+  uint64_t broken = 0;
+  int64_t imbalance = 0;
+  int64_t ref = 0;
+};
+
+// Records every callback as its book's best price or the trade
+struct RecordingHandler {
+  void OnQuote(OrderBook *book, bool top) {
+    BestPrice bp = book->GetBestPrice();
+    events.push_back({bp.bidqty, bp.bid, bp.ask, bp.askqty});
+  }
+
+  void OnTrade(OrderBook *book, int64_t shares, int64_t price, bool top) {
+    events.push_back({shares, price, 0, 0});
+  }
+
+  std::vector<std::vector<int64_t>> events;
+};
+
+struct TimestampHandler : Handler {
+  static constexpr bool kTimestamps = true;
+  void OnTimestamp(uint64_t ns) { timestamp = ns; }
+  void OnQuote(OrderBook *book, bool top) {
+    Handler::OnQuote(book, top);
+    quote_timestamp = timestamp;
+  }
+  uint64_t timestamp = 0;
+  uint64_t quote_timestamp = 0;
+};
+
+// Big endian message builder
+struct Msg {
+  Msg(char type, uint16_t locate = 0, uint64_t timestamp = 0) {
+    put8(type);
+    put16(locate);
+    put16(0);         // tracking number
+    put(timestamp, 6);
+  }
+  Msg &put8(uint8_t v) { return put(v, 1); }
+  Msg &put16(uint16_t v) { return put(v, 2); }
+  Msg &put32(uint32_t v) { return put(v, 4); }
+  Msg &put64(uint64_t v) { return put(v, 8); }
+  Msg &put(uint64_t v, int n) {
+    for (int i = n - 1; i >= 0; --i) {
+      s.push_back(v >> (8 * i));
+    }
+    return *this;
+  }
+  Msg &sym(std::string sym) {
+    sym.resize(8, ' ');
+    s += sym;
+    return *this;
+  }
+  const char *data() const { return s.data(); }
+  std::string s;
+};
+
+static Msg Add(uint16_t locate, uint64_t ref, char side, uint32_t qty,
+               std::string stock, uint32_t price) {
+  return Msg('A', locate).put64(ref).put8(side).put32(qty).sym(stock).put32(
+      price);
+}
+
+static Msg Directory(uint16_t locate, std::string stock) {
+  return Msg('R', locate)
+      .sym(stock)
+      .put8('Q')      // market category
+      .put8('N')      // financial status
+      .put32(100)     // round lot size
+      .put(0, 14);    // remaining fields
+}
+
+int main(int argc, char *argv[]) {
+
+  {
+    // Test add, execute, cancel and delete
+    Handler handler;
+    Feed<Handler> feed(handler, 100, false, false);
+    Itch50Parser<Feed<Handler>> parser(feed);
+    feed.Subscribe("A");
+    parser.ParseMessage(0, Add(1, 1, 'B', 100, "A", 10).data());
+    parser.ParseMessage(0, Add(1, 2, 'S', 100, "A", 20).data());
+    assert(handler.bp.bid == 10);
+    assert(handler.bp.ask == 20);
+    parser.ParseMessage(0, Msg('E', 1).put64(1).put32(40).put64(1).data());
+    assert(handler.lastq == 40);
+    assert(handler.lastp == 10);
+    assert(handler.bp.bidqty == 60);
+    parser.ParseMessage(0, Msg('X', 1).put64(1).put32(10).data());
+    assert(handler.bp.bidqty == 50);
+    parser.ParseMessage(0, Msg('D', 1).put64(2).data());
+    assert(handler.bp.ask == 0);
+    assert(feed.Size() == 1);
+  }
+
+  {
+    // Test stock directory presizes books and order map
+    Handler handler;
+    Feed<Handler> feed(handler, 16, false, true);
+    Itch50Parser<Feed<Handler>> parser(feed);
+    feed.SetOrdersPerSymbol(1000);
+    parser.ParseMessage(0, Msg('S').put8('O').data());
+    parser.ParseMessage(0, Directory(1, "A").data());
+    parser.ParseMessage(0, Directory(2, "B").data());
+    assert(feed.Capacity() < 2000);
+    parser.ParseMessage(0, Msg('S').put8('S').data());
+    assert(feed.Capacity() >= 2000);
+    OrderBook *a = &feed.Subscribe("A");
+    OrderBook *b = &feed.Subscribe("B");
+    parser.ParseMessage(0, Add(1, 1, 'B', 100, "A", 10).data());
+    assert(handler.bp.bid == 10);
+    OrderBook *a2 = &feed.Subscribe("A");
+    OrderBook *b2 = &feed.Subscribe("B");
+    assert(a2 == a && b2 == b);
+  }
+
+  {
+    // Test trading action
+    Handler handler;
+    Feed<Handler> feed(handler, 100, false, false);
+    Itch50Parser<Feed<Handler>> parser(feed);
+    OrderBook &book = feed.Subscribe("A");
+    parser.ParseMessage(0, Directory(1, "A").data());
+    assert(book.GetTradingState() == 'T');
+    parser.ParseMessage(
+        0, Msg('H', 1).sym("A").put8('H').put8(' ').put32(0x20202020).data());
+    assert(book.GetTradingState() == 'H');
+    parser.ParseMessage(
+        0, Msg('H', 1).sym("A").put8('T').put8(' ').put32(0x20202020).data());
+    assert(book.GetTradingState() == 'T');
+  }
+
+  {
+    // Test trade, cross trade, broken trade and imbalance messages
+    Handler handler;
+    Feed<Handler> feed(handler, 100, false, false);
+    Itch50Parser<Feed<Handler>> parser(feed);
+    feed.Subscribe("A");
+    parser.ParseMessage(0, Msg('P', 1)
+                               .put64(0)
+                               .put8('B')
+                               .put32(300)
+                               .sym("A")
+                               .put32(15)
+                               .put64(7)
+                               .data());
+    assert(handler.lastq == 300);
+    assert(handler.lastp == 15);
+    parser.ParseMessage(
+        0, Msg('Q', 1).put64(5000).sym("A").put32(16).put64(8).put8('O').data());
+    assert(handler.lastq == 5000);
+    assert(handler.lastp == 16);
+    parser.ParseMessage(0, Msg('B', 1).put64(7).data());
+    assert(handler.broken == 7);
+    parser.ParseMessage(0, Msg('I', 1)
+                               .put64(1000)
+                               .put64(200)
+                               .put8('S')
+                               .sym("A")
+                               .put32(14)
+                               .put32(15)
+                               .put32(16)
+                               .put8('C')
+                               .put8(' ')
+                               .data());
+    assert(handler.imbalance == -200);
+    assert(handler.ref == 16);
+  }
+
+  {
+    // Test exchange timestamps are decoded only for handlers that want them
+    static_assert(!Feed<Handler>::kTimestamps, "");
+    static_assert(Feed<TimestampHandler>::kTimestamps, "");
+    TimestampHandler handler;
+    Feed<TimestampHandler> feed(handler, 100, false, false);
+    Itch50Parser<Feed<TimestampHandler>> parser(feed);
+    feed.Subscribe("A");
+    uint64_t ts = 34200ull * 1000000000 + 123456789; // 09:30:00.123456789
+    parser.ParseMessage(0, Msg('A', 1, ts)
+                               .put64(1)
+                               .put8('B')
+                               .put32(100)
+                               .sym("A")
+                               .put32(10)
+                               .data());
+    assert(handler.quote_timestamp == ts);
+    assert(feed.Timestamp() == ts);
+    parser.ParseMessage(0, Msg('D', 1, ts + 1).put64(1).data());
+    assert(handler.quote_timestamp == ts + 1);
+  }
+
+  {
+    // Test message layouts and length validation
+    using Parser = Itch50Parser<Feed<Handler>>;
+    static_assert(itch50::kLengths.length['A'] == 36, "");
+    static_assert(itch50::kLengths.length['I'] == 50, "");
+    static_assert(itch50::kLengths.length['Z'] == 0, "");
+    static_assert(itch50::OrderReplace::Price::kOffset == 31, "");
+    Msg add = Add(1, 1, 'B', 100, "A", 10);
+    assert(Parser::Valid(add.data(), add.s.size()));
+    assert(!Parser::Valid(add.data(), add.s.size() - 1));
+    Msg dir = Directory(1, "A");
+    assert(Parser::Valid(dir.data(), dir.s.size()));
+    assert(!Parser::Valid(Msg('Z').data(), 11));
+    assert(itch50::AddOrder::Stock::Read(add.data()) ==
+           itch50::AddOrder::Stock::type(0x4120202020202020));
+  }
+
+  {
+    // Test truncated and unknown messages are skipped and counted, in a
+    // stream and in a MoldUDP64 packet
+    using Parser = Itch50Parser<Feed<Handler>>;
+    std::string msgs[] = {Add(1, 1, 'B', 100, "A", 10).s,
+                          Add(1, 2, 'B', 100, "A", 11).s.substr(0, 30),
+                          Msg('Z').s, Add(1, 3, 'B', 100, "A", 12).s};
+    std::string stream, packet = "SESSION001";
+    packet += std::string(7, 0) + '\x01' + '\x00' + '\x04';
+    for (const auto &m : msgs) {
+      std::string len = {char(m.size() >> 8), char(m.size())};
+      stream += len + m;
+      packet += len + m;
+    }
+
+    Handler handler;
+    Feed<Handler> feed(handler, 100, false, false);
+    Parser parser(feed);
+    feed.Subscribe("A");
+    size_t used = parser.ParseMany(stream.data(), stream.size());
+    assert(used == stream.size());
+    assert(parser.Invalid() == 2 && feed.Size() == 2);
+
+    Handler handler2;
+    Feed<Handler> feed2(handler2, 100, false, false);
+    Parser parser2(feed2);
+    feed2.Subscribe("A");
+    MoldUDP64<Parser> mold(parser2);
+    size_t n = mold.ParsePacket(packet.data(), packet.size());
+    assert(n == 2 && mold.Invalid() == 2 && mold.NextSeqno() == 5);
+    assert(feed2.Size() == 2 && handler2.bp.bid == 12);
+  }
+
+  {
+    // Test ParseBatch matches ParseMany across batch boundaries and with a
+    // truncated message at the end
+    std::string stream;
+    auto append = [&stream](const Msg &m) {
+      stream.push_back(m.s.size() >> 8);
+      stream.push_back(m.s.size());
+      stream += m.s;
+    };
+    for (uint64_t i = 1; i <= 100; ++i) {
+      uint16_t locate = 1 + i % 2;
+      append(Add(locate, i, i % 3 ? 'B' : 'S', 100, locate == 1 ? "A" : "B",
+                 i % 3 ? 100 - i : 100 + i));
+      if (i % 5 == 0) {
+        append(Msg('E', locate).put64(i - 2).put32(10).put64(i));
+      }
+      if (i % 7 == 0) {
+        append(Msg('D', locate).put64(i - 4));
+      }
+    }
+    append(Msg('Z'));
+    Msg last = Add(1, 1000, 'B', 100, "A", 99);
+    append(last);
+    stream.resize(stream.size() - 5);
+
+    size_t used[2];
+    std::vector<std::vector<int64_t>> events[2];
+    size_t orders[2];
+    uint64_t invalid[2];
+    for (int batch = 0; batch < 2; ++batch) {
+      RecordingHandler handler;
+      Feed<RecordingHandler> feed(handler, 100, false, false);
+      Itch50Parser<Feed<RecordingHandler>> parser(feed);
+      feed.Subscribe("A");
+      feed.Subscribe("B");
+      used[batch] = batch ? parser.ParseBatch(stream.data(), stream.size())
+                          : parser.ParseMany(stream.data(), stream.size());
+      events[batch] = handler.events;
+      orders[batch] = feed.Size();
+      invalid[batch] = parser.Invalid();
+    }
+    assert(used[0] == stream.size() + 5 - last.s.size() - 2);
+    assert(used[1] == used[0]);
+    assert(events[0].size() > 100 && events[1] == events[0]);
+    assert(orders[1] == orders[0] && orders[0] == 100 - 100 / 7);
+    assert(invalid[0] == 1 && invalid[1] == 1);
+  }
+
+  return 0;
+}
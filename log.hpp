@@ -22,168 +22,1392 @@ SOFTWARE.
 
 #pragma once
 
+#include "format.hpp"
+#include "tsc.hpp"
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <fcntl.h>
 #include <fstream>
+#include <initializer_list>
 #include <iostream>
+#include <linux/futex.h>
 #include <memory>
 #include <mutex>
+#include <pthread.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <thread>
 #include <tuple>
 #include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
-class Formatter {
+// Storage of log arguments. Producers copy arguments into their queue
+// and the writer formats them from there or encodes them for a binary log.
+//
+// Arithmetic values are stored as raw bytes and strings inline with a
+// 32-bit length prefix, the same encoding binary logs use. Other types are
+// copy constructed into the queue and are stored as the text they format
+// to in binary logs, unless the queue may copy or discard records, see
+// LogValue. Each type has a signature character for the decoder.
+template <typename T, typename Enable = void> struct LogCodec;
+
+inline char *AlignLogArg(char *p, size_t align) {
+  return reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(p) + align - 1) &
+                                  ~uintptr_t(align - 1));
+}
+
+inline const char *AlignLogArg(const char *p, size_t align) {
+  return AlignLogArg(const_cast<char *>(p), align);
+}
+
+template <> struct LogCodec<std::string> {
+  static constexpr char kSignature = 'S';
+  static constexpr bool kRaw = true;
+
+  static size_t Size(size_t n, const std::string &s) {
+    return n + sizeof(uint32_t) + s.size();
+  }
+
+  static char *Store(char *p, const std::string &s) {
+    return Store(p, s.data(), s.size());
+  }
+
+  static char *Store(char *p, const char *s, size_t len) {
+    uint32_t n = len;
+    std::memcpy(p, &n, sizeof(n));
+    std::memcpy(p + sizeof(n), s, len);
+    return p + sizeof(n) + len;
+  }
+
+  static const char *Format(std::string &out, const char *p,
+                            const FormatSpec &spec) {
+    uint32_t n;
+    std::memcpy(&n, p, sizeof(n));
+    FormatString(out, p + sizeof(n), n, spec);
+    return p + sizeof(n) + n;
+  }
+
+  static char *Encode(char *out, char *end, const char *&p) {
+    uint32_t n;
+    std::memcpy(&n, p, sizeof(n));
+    if (size_t(end - out) < sizeof(n) + n) {
+      return nullptr;
+    }
+    std::memcpy(out, p, sizeof(n) + n);
+    p += sizeof(n) + n;
+    return out + sizeof(n) + n;
+  }
+
+  static const char *Destroy(const char *p) {
+    uint32_t n;
+    std::memcpy(&n, p, sizeof(n));
+    return p + sizeof(n) + n;
+  }
+};
+
+template <> struct LogCodec<const char *> : LogCodec<std::string> {
+  static size_t Size(size_t n, const char *s) {
+    return n + sizeof(uint32_t) + std::strlen(s);
+  }
+
+  static char *Store(char *p, const char *s) {
+    return LogCodec<std::string>::Store(p, s, std::strlen(s));
+  }
+};
+
+template <> struct LogCodec<char *> : LogCodec<const char *> {};
+
+template <typename T>
+struct LogCodec<T,
+                typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+  static constexpr char kSignature =
+      std::is_same<T, bool>::value
+          ? 'b'
+          : std::is_floating_point<T>::value
+                ? (sizeof(T) == 4 ? 'f' : sizeof(T) == 8 ? 'd' : 'e')
+                : std::is_same<T, char>::value
+                      ? 'c'
+                      : sizeof(T) == 1
+                            ? (std::is_signed<T>::value ? 'a' : 'A')
+                            : sizeof(T) == 2
+                                  ? (std::is_signed<T>::value ? 'h' : 'H')
+                                  : sizeof(T) == 4
+                                        ? (std::is_signed<T>::value ? 'i'
+                                                                    : 'I')
+                                        : (std::is_signed<T>::value ? 'l'
+                                                                    : 'L');
+  static constexpr bool kRaw = true;
+
+  static size_t Size(size_t n, T) { return n + sizeof(T); }
+
+  static char *Store(char *p, T t) {
+    std::memcpy(p, &t, sizeof(T));
+    return p + sizeof(T);
+  }
+
+  static const char *Format(std::string &out, const char *p,
+                            const FormatSpec &spec) {
+    T t;
+    std::memcpy(&t, p, sizeof(T));
+    FormatArg(out, t, spec);
+    return p + sizeof(T);
+  }
+
+  static char *Encode(char *out, char *end, const char *&p) {
+    if (size_t(end - out) < sizeof(T)) {
+      return nullptr;
+    }
+    std::memcpy(out, p, sizeof(T));
+    p += sizeof(T);
+    return out + sizeof(T);
+  }
+
+  static const char *Destroy(const char *p) { return p + sizeof(T); }
+};
+
+template <typename T, typename Enable> struct LogCodec {
+  static_assert(alignof(T) <= 8, "log argument alignment not supported");
+  static constexpr char kSignature = 'S';
+  static constexpr bool kRaw = false;
+
+  static size_t Size(size_t n, const T &) {
+    return ((n + alignof(T) - 1) & ~(alignof(T) - 1)) + sizeof(T);
+  }
+
+  template <typename U> static char *Store(char *p, U &&t) {
+    p = AlignLogArg(p, alignof(T));
+    new (p) T(std::forward<U>(t));
+    return p + sizeof(T);
+  }
+
+  static const char *Format(std::string &out, const char *p,
+                            const FormatSpec &spec) {
+    p = AlignLogArg(p, alignof(T));
+    FormatArg(out, *reinterpret_cast<const T *>(p), spec);
+    return p + sizeof(T);
+  }
+
+  static char *Encode(char *out, char *end, const char *&p) {
+    p = AlignLogArg(p, alignof(T));
+    std::ostringstream os;
+    os << *reinterpret_cast<const T *>(p);
+    p += sizeof(T);
+    std::string s = os.str();
+    if (size_t(end - out) < sizeof(uint32_t) + s.size()) {
+      return nullptr;
+    }
+    return LogCodec<std::string>::Store(out, s);
+  }
+
+  static const char *Destroy(const char *p) {
+    p = AlignLogArg(p, alignof(T));
+    reinterpret_cast<const T *>(p)->~T();
+    return p + sizeof(T);
+  }
+};
+
+// Arguments a queue that may copy or discard records can't hold as they
+// are, formatted to a string by the producer when logging with
+// Overflow::Overwrite
+template <typename T>
+struct LogAsText
+    : std::integral_constant<
+          bool, !std::is_arithmetic<typename std::decay<T>::type>::value &&
+                    !std::is_convertible<T, const char *>::value &&
+                    !std::is_same<typename std::decay<T>::type,
+                                  std::string>::value &&
+                    !std::is_trivially_copyable<
+                        typename std::decay<T>::type>::value> {};
+
+template <typename T>
+typename std::enable_if<!LogAsText<T>::value, T &&>::type LogValue(T &&t) {
+  return std::forward<T>(t);
+}
+
+template <typename T>
+typename std::enable_if<LogAsText<T>::value, std::string>::type
+LogValue(T &&t) {
+  std::ostringstream os;
+  os << t;
+  return os.str();
+}
+
+// Operations on the arguments of a record, one instance per format string
+// and argument type list
+struct MessageType {
+  void (*format)(std::string &, const char *);
+  char *(*encode)(char *, char *, const char *);
+  void (*destroy)(const char *); // nullptr if nothing to destroy
+  const char *signature;
+  const char *fmt;
+  bool raw; // stored exactly as in a binary log
+};
+
+constexpr bool LogAllOf(std::initializer_list<bool> l) {
+  for (bool b : l) {
+    if (!b) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Log record layout and operations for the format string Fmt::Str() and
+// argument types Args. A record is a MessageType pointer and a TSC
+// timestamp followed by the stored arguments.
+template <typename Fmt, typename... Args> struct LogRecord {
+  using Table = FormatTable<Fmt>;
+  static_assert(Table::kArgs == sizeof...(Args),
+                "format argument count mismatch");
+
+  static constexpr size_t kHeaderSize =
+      sizeof(const MessageType *) + sizeof(uint64_t);
+
+  // Size of the record storing args
+  template <typename... Ts> static size_t Size(const Ts &... args) {
+    size_t n = kHeaderSize;
+    int expand[] = {0, (n = LogCodec<Args>::Size(n, args), 0)...};
+    (void)expand;
+    return n;
+  }
+
+  // Store the record logged at TSC time at p, 8 byte aligned and
+  // Size(args...) long
+  template <typename... Ts>
+  static void Store(char *p, uint64_t time, Ts &&... args) {
+    const MessageType *type = &kType;
+    std::memcpy(p, &type, sizeof(type));
+    std::memcpy(p + sizeof(type), &time, sizeof(time));
+    p += kHeaderSize;
+    int expand[] = {
+        0, (p = LogCodec<Args>::Store(p, std::forward<Ts>(args)), 0)...};
+    (void)expand;
+  }
+
+  // The tokens were parsed at compile time, literals and arguments are
+  // appended in turn
+  static void Format(std::string &out, const char *p) {
+    const char *fmt = Fmt::Str();
+    const FormatToken *t = Table::kTable.tokens;
+    int expand[] = {0, (t = FormatLiterals(out, fmt, t),
+                        p = LogCodec<Args>::Format(out, p, t->spec), ++t,
+                        0)...};
+    (void)expand;
+    FormatLiterals(out, fmt, t);
+    out += '\n';
+  }
+
+  static char *Encode(char *out, char *end, const char *p) {
+    int expand[] = {
+        0, (out = out ? LogCodec<Args>::Encode(out, end, p) : nullptr, 0)...};
+    (void)expand;
+    return out;
+  }
+
+  static void Destroy(const char *p) {
+    int expand[] = {0, (p = LogCodec<Args>::Destroy(p), 0)...};
+    (void)expand;
+  }
+
+  static constexpr bool kRaw = LogAllOf({true, LogCodec<Args>::kRaw...});
+  static constexpr bool kTrivial =
+      LogAllOf({true, std::is_trivially_destructible<Args>::value...});
+  static constexpr char kSignature[] = {LogCodec<Args>::kSignature..., 0};
+  static constexpr MessageType kType = {
+      &Format, &Encode, kTrivial ? nullptr : &Destroy, kSignature, Fmt::Str(),
+      kRaw};
+};
+
+template <typename Fmt, typename... Args>
+constexpr char LogRecord<Fmt, Args...>::kSignature[];
+
+template <typename Fmt, typename... Args>
+constexpr MessageType LogRecord<Fmt, Args...>::kType;
+
+// Formats the timestamp starting each log line, nanoseconds since the
+// epoch as UTC "YYYY-MM-DD HH:MM:SS.nnnnnnnnn ". The date and time are
+// formatted once per second.
+class LogTime {
+public:
+  void Format(std::string &out, uint64_t ns) {
+    uint64_t sec = ns / 1000000000;
+    if (sec != sec_) {
+      time_t t = sec;
+      tm tm;
+      gmtime_r(&t, &tm);
+      strftime(date_, sizeof(date_), "%Y-%m-%d %H:%M:%S.", &tm);
+      sec_ = sec;
+    }
+    out += date_;
+    char frac[10];
+    uint32_t n = ns % 1000000000;
+    for (int i = 8; i >= 0; --i) {
+      frac[i] = '0' + n % 10;
+      n /= 10;
+    }
+    frac[9] = ' ';
+    out.append(frac, sizeof(frac));
+  }
+
+private:
+  uint64_t sec_ = UINT64_MAX;
+  char date_[32] = {};
+};
+
+/*
+ByteQueue
+
+Single producer single consumer queue of variable length records in a
+ring of bytes. Every record is contiguous and 8 byte aligned, a record
+that would wrap around the end of the ring is placed at the start and
+the rest of the ring is skipped. Records up to half the capacity always
+fit once the queue drains.
+
+The consumer reads records in place and releases them by advancing the
+tail. When full the producer may instead discard the oldest records to
+make room, see ReserveOverwrite. Both sides then advance the tail, so once
+overwriting is enabled the consumer copies a record out and claims it by
+compare and swap of the tail, the copy is discarded if the producer got
+there first.
+ */
+class ByteQueue {
 public:
-  static void format(std::ostream &o) { o << "\n"; }
+  ByteQueue(size_t capacity) {
+    capacity_ = 64;
+    while (capacity_ < capacity) {
+      capacity_ *= 2;
+    }
+    mask_ = capacity_ - 1;
+    if (posix_memalign(reinterpret_cast<void **>(&buffer_), 64, capacity_) !=
+        0) {
+      throw std::bad_alloc();
+    }
+    if (posix_memalign(reinterpret_cast<void **>(&record_), 64,
+                       MaxSize()) != 0) {
+      std::free(buffer_);
+      throw std::bad_alloc();
+    }
+  }
 
-  template <typename T, typename... Args>
-  static void format(std::ostream &o, T &&t, Args &&... args) {
-    o << t << " ";
-    format(o, std::forward<Args>(args)...);
+  ~ByteQueue() {
+    std::free(record_);
+    std::free(buffer_);
   }
+
+  // Largest record
+  size_t MaxSize() const { return capacity_ / 2 - kHeaderSize; }
+
+  // Space for a record of len bytes, or nullptr if the queue is too full
+  // or the record too large. The record is published by Commit.
+  char *Reserve(size_t len) {
+    if (len > MaxSize()) {
+      return nullptr;
+    }
+    size_t stride = Stride(len);
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    size_t pos = head & mask_;
+    size_t skip = capacity_ - pos < stride ? capacity_ - pos : 0;
+    if (head + skip + stride - tail_cache_ > capacity_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head + skip + stride - tail_cache_ > capacity_) {
+        return nullptr;
+      }
+    }
+    if (skip > 0) {
+      SetLength(pos, kSkip);
+      head += skip;
+      pos = 0;
+    }
+    SetLength(pos, len);
+    reserved_ = head + stride;
+    return buffer_ + pos + kHeaderSize;
+  }
+
+  // Allow ReserveOverwrite from now on. Waits for the consumer to release
+  // the records it may be reading in place.
+  void EnableOverwrite() {
+    // Records committed from now on are seen with the flag set
+    overwrite_.store(true, std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    while (tail_.load(std::memory_order_acquire) != head) {
+      std::this_thread::yield();
+    }
+  }
+
+  // True once EnableOverwrite was called
+  bool Overwriting() const {
+    return overwrite_.load(std::memory_order_relaxed);
+  }
+
+  // Like Reserve but makes room by discarding the oldest records, calling
+  // discard(record, len) for each. Returns nullptr only if the record is
+  // too large. Requires EnableOverwrite.
+  template <typename F> char *ReserveOverwrite(size_t len, F &&discard) {
+    if (len > MaxSize()) {
+      return nullptr;
+    }
+    for (;;) {
+      if (char *p = Reserve(len)) {
+        return p;
+      }
+      // Records between tail and head are committed, only the producer
+      // writes them so their lengths are stable
+      uint64_t tail = tail_.load(std::memory_order_acquire);
+      tail_cache_ = tail;
+      if (tail == head_.load(std::memory_order_relaxed)) {
+        continue;
+      }
+      size_t pos = tail & mask_;
+      uint32_t n = Length(pos);
+      size_t stride = n == kSkip ? capacity_ - pos : Stride(n);
+      if (tail_.compare_exchange_strong(tail, tail + stride,
+                                        std::memory_order_acq_rel) &&
+          n != kSkip) {
+        // Not written to until the next Reserve
+        discard(const_cast<const char *>(buffer_ + pos + kHeaderSize),
+                size_t(n));
+      }
+    }
+  }
+
+  void Commit() { head_.store(reserved_, std::memory_order_release); }
+
+  bool Empty() const {
+    return tail_.load(std::memory_order_acquire) ==
+           head_.load(std::memory_order_acquire);
+  }
+
+  // Oldest record and its length, or nullptr if empty. The record is valid
+  // until released by Pop, once overwriting it's a copy already removed.
+  const char *Front(size_t &len) {
+    for (;;) {
+      uint64_t tail = tail_.load(std::memory_order_acquire);
+      // Overwriting may move the tail past the cached head
+      if (tail >= head_cache_) {
+        head_cache_ = head_.load(std::memory_order_acquire);
+        if (tail == head_cache_) {
+          return nullptr;
+        }
+      }
+      size_t pos = tail & mask_;
+      uint32_t n = Length(pos);
+      if (!overwrite_.load(std::memory_order_relaxed)) {
+        if (n == kSkip) {
+          tail_.store(tail + capacity_ - pos, std::memory_order_release);
+          continue;
+        }
+        len = n;
+        release_ = tail + Stride(n);
+        return buffer_ + pos + kHeaderSize;
+      }
+      // Read while the producer may be overwriting, only used if the tail
+      // hasn't moved meanwhile
+      size_t stride;
+      if (n == kSkip) {
+        stride = capacity_ - pos;
+      } else if (n <= MaxSize() && pos + Stride(n) <= capacity_) {
+        stride = Stride(n);
+        std::memcpy(record_, buffer_ + pos + kHeaderSize, n);
+      } else {
+        continue;
+      }
+      if (tail_.compare_exchange_strong(tail, tail + stride,
+                                        std::memory_order_acq_rel) &&
+          n != kSkip) {
+        len = n;
+        release_ = 0;
+        return record_;
+      }
+    }
+  }
+
+  // Release the record returned by Front
+  void Pop() {
+    if (release_ != 0) {
+      tail_.store(release_, std::memory_order_release);
+    }
+  }
+
+private:
+  ByteQueue(const ByteQueue &) = delete;
+  ByteQueue &operator=(const ByteQueue &) = delete;
+
+  static constexpr size_t kHeaderSize = 8;
+  static constexpr uint32_t kSkip = UINT32_MAX;
+
+  static size_t Stride(size_t len) { return (kHeaderSize + len + 7) & ~7; }
+
+  uint32_t Length(size_t pos) const {
+    return *reinterpret_cast<const uint32_t *>(buffer_ + pos);
+  }
+
+  void SetLength(size_t pos, uint32_t len) {
+    *reinterpret_cast<uint32_t *>(buffer_ + pos) = len;
+  }
+
+  size_t capacity_;
+  size_t mask_;
+  char *buffer_ = nullptr;
+  char *record_ = nullptr; // consumer copy of the record being read
+  std::atomic<bool> overwrite_{false}; // set once by the producer
+  // Producer and consumer indices on separate cache lines, each side
+  // caches the other's index and reads it again only when it has to
+  char pad0_[64];
+  std::atomic<uint64_t> head_{0};
+  uint64_t reserved_ = 0;
+  uint64_t tail_cache_ = 0;
+  char pad1_[64];
+  std::atomic<uint64_t> tail_{0};
+  uint64_t head_cache_ = 0;
+  uint64_t release_ = 0; // tail after the record read in place, if any
+  char pad2_[64];
 };
 
-class Message {
+/*
+Binary log file
+
+An append only file written through a memory mapping. Space is reserved
+with fallocate and mapped a chunk at a time, so writing a record is a
+plain memory copy. The file is truncated to the data written when closed.
+
+The file starts with kMagic followed by records, each starting with a
+16-bit message type id. Id 0 defines a message type:
+
+  uint16_t 0
+  uint32_t length of the rest
+  uint16_t id
+  char signature[], nul terminated
+  char fmt[], up to the end of the definition
+
+Any other id is a message of that type, followed by its timestamp and
+encoded arguments in signature order, see LogCodec. The timestamp is in
+nanoseconds since the epoch, stored as the difference from the previous
+message as a zigzag varint, usually 3 or 4 bytes. The argument sizes
+follow from the signature. An empty definition marks the end of data in
+a file that was not closed.
+ */
+class LogFile {
 public:
-  template <typename... Args> Message(Args &&... args) {
-    fp = pack(&data, std::forward<Args>(args)...);
+  static constexpr char kMagic[8] = {'S', 'P', 'L', 'O', 'G', '0', '0', '2'};
+  static constexpr size_t kChunkSize = 64 << 20;
+  static constexpr uint32_t kMaxTypes = 65535;
+
+  LogFile(const std::string &fname, size_t chunk_size = kChunkSize)
+      : chunk_size_(chunk_size) {
+    fd_ = open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ == -1) {
+      throw std::system_error(errno, std::system_category(), "open " + fname);
+    }
+    Map(0);
+    std::memcpy(pos_, kMagic, sizeof(kMagic));
+    pos_ += sizeof(kMagic);
+  }
+
+  ~LogFile() {
+    size_t size = Size();
+    munmap(base_, end_ - base_);
+    if (ftruncate(fd_, size) == -1) {
+      // nothing to do, the end of data is still marked by a zero header
+    }
+    close(fd_);
+  }
+
+  // Append a definition of message type id, 1 to kMaxTypes. Ids can be
+  // defined again, a definition applies to the records following it.
+  void Define(uint16_t id, const char *signature, const char *fmt) {
+    size_t sig_len = std::strlen(signature) + 1;
+    size_t fmt_len = std::strlen(fmt);
+    uint32_t len = sizeof(id) + sig_len + fmt_len;
+    while (size_t(end_ - pos_) < kDefinitionSize + len) {
+      Grow();
+    }
+    char *p = pos_;
+    std::memset(p, 0, sizeof(uint16_t));
+    std::memcpy(p + 2, &len, sizeof(len));
+    std::memcpy(p + 6, &id, sizeof(id));
+    std::memcpy(p + 8, signature, sig_len);
+    std::memcpy(p + 8 + sig_len, fmt, fmt_len);
+    pos_ = p + kDefinitionSize + len;
   }
 
-  ~Message() {
-    // make sure destructors are called
-    fp(nullptr, &data);
+  // Append a message of type id logged at time ns with the stored
+  // arguments [p, p + len) of a record of the given type
+  void Write(uint16_t id, uint64_t time, const MessageType *type,
+             const char *p, size_t len) {
+    int64_t delta = time - time_;
+    uint64_t zigzag = (uint64_t(delta) << 1) ^ uint64_t(delta >> 63);
+    for (;;) {
+      char *end = nullptr;
+      if (size_t(end_ - pos_) >= sizeof(id) + kMaxVarint + len) {
+        end = PutVarint(pos_ + sizeof(id), zigzag);
+        if (type->raw) {
+          std::memcpy(end, p, len);
+          end += len;
+        } else {
+          end = type->encode(end, end_, p);
+        }
+      }
+      if (end) {
+        std::memcpy(pos_, &id, sizeof(id));
+        pos_ = end;
+        time_ = time;
+        return;
+      }
+      Grow();
+    }
   }
 
-  void Format(std::ostream &o) { fp(&o, &data); }
+  // Bytes written
+  size_t Size() const { return offset_ + (pos_ - base_); }
 
 private:
-  Message(Message &other) = delete;
-  Message &operator=(const Message &) = delete;
-  Message(Message &&other) = delete;
-  Message &operator=(Message &&) = delete;
-
-  template <typename Tup, std::size_t... index>
-  static void call_format_helper(std::ostream &o, Tup &&args,
-                                 std::index_sequence<index...>) {
-    Formatter::format(o, std::get<index>(std::forward<Tup>(args))...);
-  }
-
-  template <typename... Args>
-  static void call_format(std::ostream *o, void *p) {
-    typedef std::tuple<Args...> Tup;
-    Tup &args = *reinterpret_cast<Tup *>(p);
-    if (o) {
-      call_format_helper(*o, args, std::index_sequence_for<Args...>{});
-    } else {
-      // important to call destructor for complex types
-      args.~Tup();
+  LogFile(const LogFile &) = delete;
+  LogFile &operator=(const LogFile &) = delete;
+
+  static constexpr size_t kDefinitionSize = 6;
+  static constexpr size_t kMaxVarint = 10;
+
+  static char *PutVarint(char *p, uint64_t v) {
+    while (v >= 0x80) {
+      *p++ = char(v | 0x80);
+      v >>= 7;
     }
+    *p++ = char(v);
+    return p;
   }
 
-  template <typename T, typename... Args>
-  static decltype(auto) pack(T *p, Args &&... args) {
-    typedef std::tuple<typename std::decay<Args>::type...> Tup;
-    static_assert(alignof(Tup) <= alignof(T), "invalid alignment");
-    static_assert(sizeof(Tup) <= sizeof(T), "storage too small");
-    new (p) Tup(std::forward<Args>(args)...);
-    return &call_format<typename std::decay<Args>::type...>;
+  // Map a chunk starting at page aligned offset
+  void Map(size_t offset) {
+    int err = posix_fallocate(fd_, offset, chunk_size_);
+    if (err != 0 && ftruncate(fd_, offset + chunk_size_) == -1) {
+      throw std::system_error(err, std::system_category(), "fallocate");
+    }
+    void *p = mmap(nullptr, chunk_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd_, offset);
+    if (p == MAP_FAILED) {
+      throw std::system_error(errno, std::system_category(), "mmap");
+    }
+    offset_ = offset;
+    base_ = pos_ = static_cast<char *>(p);
+    end_ = base_ + chunk_size_;
   }
 
-  using FormatFun = void (*)(std::ostream *, void *);
-  using Storage = typename std::aligned_storage<56, 8>::type;
+  // Continue in a new chunk, the unfinished page is mapped again
+  void Grow() {
+    size_t size = Size();
+    size_t page = size & ~size_t(sysconf(_SC_PAGESIZE) - 1);
+    if (size == grown_at_) {
+      chunk_size_ *= 2; // record larger than a chunk
+    }
+    grown_at_ = size;
+    munmap(base_, end_ - base_);
+    Map(page);
+    pos_ = base_ + (size - page);
+  }
 
-  FormatFun fp;
-  Storage data;
+  int fd_ = -1;
+  size_t chunk_size_;
+  size_t offset_ = 0; // file offset of base_
+  size_t grown_at_ = 0;
+  uint64_t time_ = 0; // of the previous message
+  char *base_ = nullptr;
+  char *pos_ = nullptr;
+  char *end_ = nullptr;
 };
 
-static_assert(sizeof(Message) == 64, "message not a cache line in size");
+constexpr char LogFile::kMagic[8];
+
+/*
+Segmented log file
+
+Text log output written through memory mappings of fixed size segment
+files fname.0, fname.1 and so on. A background thread creates,
+fallocates and maps the next segment ahead of time, and closes full
+segments, truncating them to the data written and calling fdatasync. It
+also calls fdatasync on the current segment every sync interval. The
+writer only copies into mapped memory and waits for the background
+thread only if it's a whole segment ahead.
 
-template <typename T> class Queue {
-  // Ringbuffer, fixed size single producer single consumer lock-free queue
+Records are not split between segments unless larger than a segment.
+The current segment is truncated when closed, after a crash it ends
+with zeros.
+ */
+class LogSegments {
 public:
-  Queue(const size_t size)
-      : size_(size), buffer_(static_cast<T *>(std::malloc(sizeof(T) * size))),
-        head_(0), tail_(0) {
-    if (!buffer_) {
-      throw std::bad_alloc();
+  static constexpr size_t kSegmentSize = 256 << 20;
+
+  LogSegments(const std::string &fname, size_t segment_size = kSegmentSize,
+              std::chrono::milliseconds sync_interval = std::chrono::seconds(1))
+      : fname_(fname), segment_size_(segment_size),
+        sync_interval_(sync_interval) {
+    current_ = Open(0);
+    pos_ = current_.base;
+    end_ = pos_ + segment_size_;
+    active_fd_ = current_.fd;
+    next_index_ = 1;
+    thread_ = std::thread([this] { Run(); });
+  }
+
+  ~LogSegments() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (current_.fd != -1) {
+        current_.size = pos_ - current_.base;
+        full_.push_back(current_);
+      }
+      stop_ = true;
     }
+    cond_.notify_all();
+    thread_.join();
   }
 
-  ~Queue() {
-    while (front()) {
-      pop();
+  void Write(const char *data, size_t len) {
+    while (len > 0) {
+      size_t space = end_ - pos_;
+      if (space == 0 || (len > space && len <= segment_size_)) {
+        Rotate();
+        continue;
+      }
+      size_t n = std::min(len, space);
+      std::memcpy(pos_, data, n);
+      pos_ += n;
+      data += n;
+      len -= n;
     }
-    std::free(buffer_);
   }
 
-  template <typename... Args> void emplace(Args &&... args) {
-    auto const head = head_.load(std::memory_order_relaxed);
-    auto const next_head = (head + 1) % size_;
-    while (next_head == tail_.load(std::memory_order_acquire))
-      ;
-    new (&buffer_[head]) T(std::forward<Args>(args)...);
-    head_.store(next_head, std::memory_order_release);
+  // Have the background thread call fdatasync on the current segment
+  // without waiting for the sync interval
+  void Sync() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      sync_requested_ = true;
+    }
+    cond_.notify_all();
   }
 
-  T *front() {
-    auto tail = tail_.load(std::memory_order_relaxed);
-    if (head_.load(std::memory_order_acquire) == tail) {
-      return nullptr;
+  // Index of the current segment
+  size_t Index() const { return current_.index; }
+
+private:
+  LogSegments(const LogSegments &) = delete;
+  LogSegments &operator=(const LogSegments &) = delete;
+
+  struct Segment {
+    int fd = -1;
+    char *base = nullptr;
+    size_t index = 0;
+    size_t size = 0; // bytes written
+  };
+
+  Segment Open(size_t index) {
+    std::string name = fname_ + "." + std::to_string(index);
+    Segment s;
+    s.index = index;
+    s.fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (s.fd == -1) {
+      throw std::system_error(errno, std::system_category(), "open " + name);
     }
-    return &buffer_[tail];
+    int err = posix_fallocate(s.fd, 0, segment_size_);
+    if (err != 0 && ftruncate(s.fd, segment_size_) == -1) {
+      close(s.fd);
+      throw std::system_error(err, std::system_category(), "fallocate");
+    }
+    // Populated so the writer doesn't take page faults
+    void *p = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, s.fd, 0);
+    if (p == MAP_FAILED) {
+      int err = errno;
+      close(s.fd);
+      throw std::system_error(err, std::system_category(), "mmap");
+    }
+    s.base = static_cast<char *>(p);
+    return s;
   }
 
-  void pop() {
-    auto const tail = tail_.load(std::memory_order_relaxed);
-    if (head_.load(std::memory_order_acquire) == tail) {
-      return;
+  void Close(const Segment &s) {
+    munmap(s.base, segment_size_);
+    if (ftruncate(s.fd, s.size) == -1 || fdatasync(s.fd) == -1) {
+      // nothing to do, the data is in the page cache
+    }
+    close(s.fd);
+  }
+
+  // Continue in the segment prepared by the background thread
+  void Rotate() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (current_.fd != -1) {
+      current_.size = pos_ - current_.base;
+      full_.push_back(current_);
+      current_ = Segment();
+      pos_ = end_ = nullptr;
+      cond_.notify_all();
     }
-    auto const next_tail = (tail + 1) % size_;
-    buffer_[tail].~T();
-    tail_.store(next_tail, std::memory_order_release);
+    cond_.wait(lock, [this] { return next_.fd != -1 || error_; });
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      cond_.notify_all();
+      std::rethrow_exception(error);
+    }
+    current_ = next_;
+    next_ = Segment();
+    active_fd_ = current_.fd;
+    pos_ = current_.base;
+    end_ = pos_ + segment_size_;
+    cond_.notify_all();
+  }
+
+  void Run() {
+    auto sync_at = std::chrono::steady_clock::now() + sync_interval_;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      if (next_.fd == -1 && !error_ && !stop_) {
+        size_t index = next_index_;
+        lock.unlock();
+        Segment s;
+        std::exception_ptr error;
+        try {
+          s = Open(index);
+        } catch (...) {
+          error = std::current_exception();
+        }
+        lock.lock();
+        if (error) {
+          error_ = error;
+        } else {
+          next_ = s;
+          next_index_++;
+        }
+        cond_.notify_all();
+        continue;
+      }
+      if (!full_.empty()) {
+        Segment s = full_.back();
+        full_.pop_back();
+        lock.unlock();
+        Close(s);
+        lock.lock();
+        continue;
+      }
+      if (stop_) {
+        break;
+      }
+      if (sync_requested_ || std::chrono::steady_clock::now() >= sync_at) {
+        // Only this thread closes segments, the descriptor stays valid
+        int fd = active_fd_;
+        sync_requested_ = false;
+        lock.unlock();
+        if (fd != -1 && fdatasync(fd) == -1) {
+          // nothing to do, tried again next interval
+        }
+        lock.lock();
+        sync_at = std::chrono::steady_clock::now() + sync_interval_;
+        continue;
+      }
+      cond_.wait_until(lock, sync_at);
+    }
+    if (next_.fd != -1) {
+      // Prepared but never used
+      munmap(next_.base, segment_size_);
+      close(next_.fd);
+      unlink((fname_ + "." + std::to_string(next_.index)).c_str());
+    }
+  }
+
+  const std::string fname_;
+  const size_t segment_size_;
+  const std::chrono::milliseconds sync_interval_;
+
+  // Writer
+  Segment current_;
+  char *pos_ = nullptr;
+  char *end_ = nullptr;
+
+  // Shared with the background thread
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  Segment next_;
+  size_t next_index_ = 0;
+  std::vector<Segment> full_;
+  int active_fd_ = -1;
+  bool sync_requested_ = false;
+  bool stop_ = false;
+  std::exception_ptr error_;
+  std::thread thread_;
+};
+
+constexpr size_t LogSegments::kSegmentSize;
+
+// Turns a binary log back into the text the logger would have written
+class LogDecoder {
+public:
+  // Decode the log file in buf, returns number of messages
+  size_t Decode(const char *buf, size_t len, std::ostream &o) {
+    if (len < sizeof(LogFile::kMagic) ||
+        std::memcmp(buf, LogFile::kMagic, sizeof(LogFile::kMagic)) != 0) {
+      throw std::runtime_error("log: not a binary log");
+    }
+    size_t count = 0;
+    const char *p = buf + sizeof(LogFile::kMagic);
+    const char *end = buf + len;
+    while (end - p >= 2) {
+      uint16_t id = Read<uint16_t>(p, end);
+      if (id == 0) {
+        if (end - p < 4) {
+          break;
+        }
+        uint32_t size = Read<uint32_t>(p, end);
+        if (size == 0 || size_t(end - p) < size) {
+          break;
+        }
+        Define(p, size);
+        p += size;
+      } else {
+        p = Format(id, p, end, o);
+        count++;
+      }
+    }
+    return count;
   }
 
 private:
-  const size_t size_;
-  T *const buffer_;
-  std::atomic<size_t> head_, tail_;
+  struct Type {
+    std::string signature;
+    std::string fmt;
+    bool defined = false;
+  };
+
+  void Define(const char *p, size_t len) {
+    if (len < 3) {
+      throw std::runtime_error("log: bad definition");
+    }
+    uint16_t id;
+    std::memcpy(&id, p, sizeof(id));
+    Type type;
+    type.defined = true;
+    type.signature = std::string(p + 2, strnlen(p + 2, len - 2));
+    size_t fmt = std::min(len, 2 + type.signature.size() + 1);
+    type.fmt = std::string(p + fmt, len - fmt);
+    if (id >= types_.size()) {
+      types_.resize(id + 1);
+    }
+    types_[id] = type;
+  }
+
+  // Format the message of type id at p, returns its end
+  const char *Format(uint16_t id, const char *p, const char *end,
+                     std::ostream &o) {
+    if (id >= types_.size() || !types_[id].defined) {
+      throw std::runtime_error("log: undefined message type");
+    }
+    const Type &type = types_[id];
+    const char *fmt = type.fmt.c_str();
+    uint64_t zigzag = ReadVarint(p, end);
+    time_ += int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+    line_.clear();
+    log_time_.Format(line_, time_);
+    FormatToken t = Literals(fmt, NextFormatToken(fmt, 0));
+    for (char sig : type.signature) {
+      if (t.kind != FormatToken::kArg) {
+        throw std::runtime_error("log: format does not match arguments");
+      }
+      p = FormatValue(sig, p, end, t.spec);
+      t = Literals(fmt, NextFormatToken(fmt, t.next));
+    }
+    line_ += '\n';
+    o.write(line_.data(), line_.size());
+    return p;
+  }
+
+  // Append the literal tokens starting at t, returns the next placeholder
+  // or the end
+  FormatToken Literals(const char *fmt, FormatToken t) {
+    for (; t.kind == FormatToken::kLiteral; t = NextFormatToken(fmt, t.next)) {
+      line_.append(fmt + t.begin, t.len);
+    }
+    return t;
+  }
+
+  // Format the value with signature sig at p, returns its end
+  const char *FormatValue(char sig, const char *p, const char *end,
+                          const FormatSpec &spec) {
+    switch (sig) {
+    case 'b':
+      FormatArg(line_, Read<bool>(p, end), spec);
+      break;
+    case 'c':
+      FormatArg(line_, Read<char>(p, end), spec);
+      break;
+    case 'a':
+      FormatArg(line_, Read<int8_t>(p, end), spec);
+      break;
+    case 'A':
+      FormatArg(line_, Read<uint8_t>(p, end), spec);
+      break;
+    case 'h':
+      FormatArg(line_, Read<int16_t>(p, end), spec);
+      break;
+    case 'H':
+      FormatArg(line_, Read<uint16_t>(p, end), spec);
+      break;
+    case 'i':
+      FormatArg(line_, Read<int32_t>(p, end), spec);
+      break;
+    case 'I':
+      FormatArg(line_, Read<uint32_t>(p, end), spec);
+      break;
+    case 'l':
+      FormatArg(line_, Read<int64_t>(p, end), spec);
+      break;
+    case 'L':
+      FormatArg(line_, Read<uint64_t>(p, end), spec);
+      break;
+    case 'f':
+      FormatArg(line_, Read<float>(p, end), spec);
+      break;
+    case 'd':
+      FormatArg(line_, Read<double>(p, end), spec);
+      break;
+    case 'e':
+      FormatArg(line_, Read<long double>(p, end), spec);
+      break;
+    case 'S': {
+      uint32_t n = Read<uint32_t>(p, end);
+      if (size_t(end - p) < n) {
+        throw std::runtime_error("log: truncated message");
+      }
+      FormatString(line_, p, n, spec);
+      p += n;
+      break;
+    }
+    default:
+      throw std::runtime_error("log: unknown signature");
+    }
+    return p;
+  }
+
+  static uint64_t ReadVarint(const char *&p, const char *end) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p == end) {
+        break;
+      }
+      uint8_t b = *p++;
+      v |= uint64_t(b & 0x7f) << shift;
+      if (b < 0x80) {
+        return v;
+      }
+    }
+    throw std::runtime_error("log: bad timestamp");
+  }
+
+  template <typename T> static T Read(const char *&p, const char *end) {
+    if (size_t(end - p) < sizeof(T)) {
+      throw std::runtime_error("log: truncated message");
+    }
+    T t;
+    std::memcpy(&t, p, sizeof(T));
+    p += sizeof(T);
+    return t;
+  }
+
+  std::vector<Type> types_;
+  uint64_t time_ = 0; // of the previous message
+  LogTime log_time_;
+  std::string line_;
+};
+
+// Severity of LOG_DEBUG and friends, see SPARTAN_LOG_LEVEL for the levels
+// compiled in
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error, Off };
+
+// Runtime log levels. Each thread checks the level current points to, the
+// logger wide level unless the thread was given its own. Both are
+// constant initialized, so the check is two loads and a branch.
+template <typename T = void> struct LogLevels {
+  static std::atomic<LogLevel> global;
+  static thread_local std::atomic<LogLevel> own;
+  static thread_local const std::atomic<LogLevel> *current;
 };
 
+template <typename T>
+std::atomic<LogLevel> LogLevels<T>::global{LogLevel::Debug};
+
+template <typename T>
+thread_local std::atomic<LogLevel> LogLevels<T>::own{LogLevel::Debug};
+
+template <typename T>
+thread_local const std::atomic<LogLevel> *LogLevels<T>::current =
+    &LogLevels<T>::global;
+
+/*
+Logger
+
+Each thread logs into its own single producer single consumer queue, a
+background writer thread drains all queues and formats the messages.
+
+Threads register their queue on first use by pushing it onto a lock-free
+list, only the writer ever unlinks entries, once the owning thread has
+exited and its queue is drained. The writer waits for new messages
+according to the wait strategy, see SetWait.
+
+Records are stamped with the TSC when logged. The writer converts the
+readings to wall clock time, see TscClock, and merges the records of all
+queues in timestamp order. Before writing a record every other queue is
+checked for an older one, so records published in order are written in
+order, a record still being written can't be ordered with the rest.
+
+What a producer does when its queue is full is set by the overflow policy,
+see SetOverflow. Messages lost are counted and reported in the log by the
+thread's next message that fits. The first message a thread logs with
+Overflow::Overwrite waits for its queue to drain, from then on the writer
+copies records out of the queue and arguments that aren't trivially
+copyable are formatted by the producer, see LogValue.
+ */
 class Logger {
 public:
-  template <typename... Args>
-  static void Log(const char *fmt, Args &&... args) {
-    queue().emplace(fmt, std::forward<Args>(args)...);
+  // How the writer thread waits when all queues are empty
+  enum class Wait {
+    Spin,  // poll continuously, lowest latency, keeps a core busy
+    Yield, // poll, yielding the core after a while without messages
+    Block, // sleep on a futex woken by producers, at most timeout
+  };
+
+  // What a producer does when its queue is full
+  enum class Overflow {
+    Block,     // wait for the writer to make room
+    Drop,      // drop the new message
+    Overwrite, // drop the oldest messages
+  };
+
+  // Log a message with the format string Fmt::Str(), normally through the
+  // LOG macro. The arguments are copied into the thread's queue, strings
+  // inline, and formatted by the writer. Records larger than half the
+  // queue are dropped.
+  template <typename Fmt, typename... Args> static void Log(Args &&... args) {
+    LogWith<Fmt>(instance().overflow_.load(std::memory_order_relaxed),
+                 std::forward<Args>(args)...);
+  }
+
+  // Log with the given overflow policy, normally through LOG_OVERFLOW
+  template <typename Fmt, typename... Args>
+  static void LogWith(Overflow overflow, Args &&... args) {
+    uint64_t time = TscClock::Now();
+    Producer &producer = self();
+    if (overflow == Overflow::Overwrite && !producer.queue.Overwriting()) {
+      producer.queue.EnableOverwrite();
+    }
+    if (producer.queue.Overwriting()) {
+      Write<Fmt>(producer, overflow, time,
+                 LogValue(std::forward<Args>(args))...);
+    } else {
+      Write<Fmt>(producer, overflow, time, std::forward<Args>(args)...);
+    }
+    Local &local = Logger::local();
+    if (local.exited) {
+      // Logged from a thread_local destructor after the Handle's, nothing
+      // would close the queue at thread exit
+      local.producer->closed.store(true, std::memory_order_release);
+      local.producer = nullptr;
+    }
+  }
+
+  // Overflow policy of calls not specifying one, Overflow::Block by default
+  static void SetOverflow(Overflow overflow) {
+    instance().overflow_.store(overflow, std::memory_order_relaxed);
+  }
+
+  // Messages dropped so far by all threads
+  static uint64_t Dropped() {
+    return instance().dropped_.load(std::memory_order_relaxed);
+  }
+
+  // True if the calling thread logs messages of the level
+  static bool Enabled(LogLevel level) {
+    return level >= LogLevels<>::current->load(std::memory_order_relaxed);
+  }
+
+  // Lowest level logged by threads without a level of their own,
+  // LogLevel::Debug by default
+  static void SetLevel(LogLevel level) {
+    LogLevels<>::global.store(level, std::memory_order_relaxed);
+  }
+
+  // The calling thread's own level, starting out as the logger wide level.
+  // Other threads may change it while the thread lives, for example to
+  // turn on debug logging of a single feed.
+  static std::atomic<LogLevel> &ThreadLevel() {
+    if (LogLevels<>::current != &LogLevels<>::own) {
+      LogLevels<>::own.store(LogLevels<>::current->load());
+      LogLevels<>::current = &LogLevels<>::own;
+    }
+    return LogLevels<>::own;
   }
 
+  // Queue size in bytes for threads logging for the first time
   static void SetQueueSize(const size_t size) { instance().queue_size_ = size; }
 
+  // Write text to fname, to standard output if "-", or nowhere if empty.
+  // Like the other outputs it replaces the current one, the writer has
+  // switched to it when the call returns.
   static void SetOutput(const std::string &fname) {
+    auto sinks = std::make_unique<Sinks>();
+    if (fname == "-") {
+      sinks->cout = true;
+    } else if (fname != "") {
+      sinks->ostream = std::make_unique<std::ofstream>(fname);
+    }
+    instance().Replace(std::move(sinks));
+  }
+
+  // Write text to the segment files fname.0, fname.1 and so on, see
+  // LogSegments
+  static void SetSegmentedOutput(
+      const std::string &fname,
+      size_t segment_size = LogSegments::kSegmentSize,
+      std::chrono::milliseconds sync_interval = std::chrono::seconds(1)) {
+    auto sinks = std::make_unique<Sinks>();
+    sinks->segments =
+        std::make_unique<LogSegments>(fname, segment_size, sync_interval);
+    instance().Replace(std::move(sinks));
+  }
+
+  // Write messages in binary to fname, see LogFile. Use log_decode to turn
+  // the file into text.
+  static void SetBinaryOutput(const std::string &fname) {
+    auto sinks = std::make_unique<Sinks>();
+    sinks->binary = std::make_unique<LogFile>(fname);
+    instance().Replace(std::move(sinks));
+  }
+
+  // Set the writer wait strategy. With Wait::Block producers wake the
+  // writer and it never sleeps longer than timeout, with the others
+  // logging skips the wakeup check.
+  static void SetWait(Wait wait, std::chrono::microseconds timeout =
+                                     std::chrono::milliseconds(1)) {
     Logger &logger = instance();
-    std::lock_guard<std::mutex> lock(logger.mutex_);
-    if (fname == "") {
-      logger.ostream_.reset();
-      logger.cout_ = false;
-    } else if (fname == "-") {
-      logger.ostream_.reset();
-      logger.cout_ = true;
-    } else {
-      logger.ostream_ = std::make_unique<std::ofstream>(fname);
-      logger.cout_ = false;
+    logger.timeout_ = timeout.count();
+    logger.wait_ = wait;
+    logger.Wake();
+  }
+
+  // Pin the writer thread to cpu
+  static void SetWriterAffinity(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(instance().thread_.native_handle(),
+                                     sizeof(set), &set);
+    if (err != 0) {
+      throw std::system_error(err, std::system_category(),
+                              "pthread_setaffinity_np");
+    }
+  }
+
+  // Wait until everything logged before the call has been written and the
+  // output flushed
+  static void Flush() {
+    Logger &logger = instance();
+    uint64_t request = ++logger.flush_requested_;
+    logger.Wake();
+    while (logger.flushed_.load(std::memory_order_acquire) < request) {
+      std::this_thread::yield();
     }
   }
 
 private:
-  Logger() : active_(true), queues_size_(1), queue_size_(1024), cout_(true) {
+  using QueueType = ByteQueue;
+
+  struct Producer {
+    Producer(size_t size) : queue(size) {}
+
+    QueueType queue;
+    uint64_t unreported = 0; // dropped but not yet reported in the log
+    std::atomic<bool> closed{false};
+    bool closing = false; // closed when the writer started draining
+    bool merging = false; // oldest record is in the merge heap
+    Producer *next = nullptr; // written by the writer once published
+  };
+
+  struct DroppedFormat {
+    static constexpr const char *Str() { return "dropped {} messages"; }
+  };
+
+  using DroppedRecord = LogRecord<DroppedFormat, uint64_t>;
+
+  // Oldest record of a queue being merged
+  struct Head {
+    uint64_t time;
+    Producer *producer;
+    const char *record;
+    size_t len;
+
+    bool operator<(const Head &other) const { return time > other.time; }
+  };
+
+  // Where the writer writes, only one of them is normally set
+  struct Sinks {
+    bool cout = false;
+    std::unique_ptr<std::ostream> ostream;
+    std::unique_ptr<LogSegments> segments;
+    std::unique_ptr<LogFile> binary;
+  };
+
+  // The thread's queue, trivially destructible so it stays usable in the
+  // destructors of other thread_local objects
+  struct Local {
+    Producer *producer = nullptr;
+    bool exited = false; // Handle destroyed
+  };
+
+  // Marks the thread's queue for reclamation when the thread exits
+  struct Handle {
+    ~Handle() {
+      Local &local = Logger::local();
+      if (local.producer) {
+        local.producer->closed.store(true, std::memory_order_release);
+        local.producer = nullptr;
+      }
+      local.exited = true;
+    }
+  };
+
+  // Polls without messages before yielding or sleeping
+  static constexpr unsigned kSpins = 1000;
+  // TSC rate measurement when starting and how often it's refined
+  static constexpr std::chrono::milliseconds kCalibration{10};
+  static constexpr std::chrono::nanoseconds kCalibrationInterval{1000000000};
+
+  Logger() : active_(true), queue_size_(1 << 20) {
+    sinks_.cout = true;
     thread_ = std::thread([this] { Writer(); });
   }
 
   ~Logger() {
     active_ = false;
+    Wake();
     if (thread_.joinable()) {
       thread_.join();
     }
+    for (Producer *p = producers_.load(); p;) {
+      Producer *next = p->next;
+      delete p;
+      p = next;
+    }
   }
 
   Logger(Logger &other) = delete;
@@ -191,32 +1415,297 @@ private:
   Logger(Logger &&other) = delete;
   Logger &operator=(Logger &&) = delete;
 
-  void Writer() {
-    using namespace std::chrono_literals;
-    while (active_ || queues_size_) {
-      {
-        std::lock_guard<std::mutex> lock(instance().mutex_);
-        for (auto it = queues_.begin(); it != queues_.end();) {
-          auto &q = *it;
-          while (q->front()) {
-            if (ostream_) {
-              q->front()->Format(*ostream_);
-            }
-            if (cout_) {
-              q->front()->Format(std::cout);
-            }
-            q->pop();
-          }
-          if (q.unique() && !q->front()) {
-            it = queues_.erase(it);
-          } else {
-            ++it;
-          }
+  template <typename Fmt, typename... Args>
+  static void Write(Producer &producer, Overflow overflow, uint64_t time,
+                    Args &&... args) {
+    using Record = LogRecord<Fmt, typename std::decay<Args>::type...>;
+    if (producer.unreported > 0) {
+      Report(producer, overflow, time);
+    }
+    char *p = Reserve(producer, Record::Size(args...), overflow);
+    if (!p) {
+      Drop(producer, 1);
+      return;
+    }
+    Record::Store(p, time, std::forward<Args>(args)...);
+    producer.queue.Commit();
+    instance().Notify();
+  }
+
+  // Log the number of messages dropped since the last report
+  static void Report(Producer &producer, Overflow overflow, uint64_t time) {
+    uint64_t n = producer.unreported;
+    char *p = Reserve(producer, DroppedRecord::Size(n), overflow);
+    if (p) {
+      // Overwriting to make room is reported next time
+      producer.unreported -= n;
+      DroppedRecord::Store(p, time, n);
+      producer.queue.Commit();
+    }
+  }
+
+  static char *Reserve(Producer &producer, size_t len, Overflow overflow) {
+    QueueType &q = producer.queue;
+    switch (overflow) {
+    case Overflow::Block: {
+      if (len > q.MaxSize()) {
+        return nullptr;
+      }
+      char *p;
+      for (unsigned i = 0; !(p = q.Reserve(len)); ++i) {
+        if (i >= kSpins) {
+          std::this_thread::yield();
+        }
+      }
+      return p;
+    }
+    case Overflow::Drop:
+      return q.Reserve(len);
+    case Overflow::Overwrite:
+      return q.ReserveOverwrite(len, [&producer](const char *record, size_t) {
+        const MessageType *type;
+        std::memcpy(&type, record, sizeof(type));
+        if (type == &DroppedRecord::kType) {
+          // Report again the drops it reported
+          uint64_t n;
+          std::memcpy(&n, record + DroppedRecord::kHeaderSize, sizeof(n));
+          producer.unreported += n;
+        } else {
+          Drop(producer, 1);
         }
-        queues_size_ = queues_.size();
+      });
+    }
+    return nullptr;
+  }
+
+  static void Drop(Producer &producer, uint64_t n) {
+    producer.unreported += n;
+    instance().dropped_.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  void Writer() {
+    std::this_thread::sleep_for(kCalibration);
+    clock_.Calibrate();
+    unsigned idle = 0;
+    while (active_.load(std::memory_order_acquire)) {
+      if (Pass() > 0) {
+        idle = 0;
+        continue;
+      }
+      if (++idle < kSpins) {
+        continue;
+      }
+      switch (wait_.load(std::memory_order_relaxed)) {
+      case Wait::Spin:
+        break;
+      case Wait::Yield:
+        std::this_thread::yield();
+        break;
+      case Wait::Block:
+        Sleep();
+        break;
+      }
+    }
+    while (Pass(true) > 0) {
+    }
+  }
+
+  // Drain every queue once, merging the records by timestamp, returns
+  // number of messages written. The output is flushed when idle or when
+  // requested.
+  size_t Pass(bool flush = false) {
+    uint64_t request = flush_requested_.load();
+    flush |= request != flushed_.load(std::memory_order_relaxed);
+    if (TscClock::Now() - clock_.Calibrated() >
+        clock_.TicksPerNs() * kCalibrationInterval.count()) {
+      clock_.Calibrate();
+    }
+    std::unique_ptr<Sinks> pending;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending = std::move(pending_);
+    }
+    if (pending) {
+      // The old output is closed here, outside the lock
+      std::swap(sinks_, *pending);
+      ids_.clear();
+      pending.reset();
+    }
+    size_t count = 0;
+    for (Producer *p = producers_.load(std::memory_order_acquire); p;
+         p = p->next) {
+      // Closed before draining, so nothing is left behind when unlinking
+      p->closing = p->closed.load(std::memory_order_acquire);
+    }
+    // Records logged after this are left for the next pass, so the pass
+    // ends while producers keep logging
+    uint64_t end = TscClock::Now();
+    for (;;) {
+      // Poll until every idle queue is seen empty after the merged
+      // records were taken, then none of them holds an older record
+      // published earlier
+      while (PollHeads()) {
+      }
+      if (heads_.empty() || heads_.front().time > end) {
+        break;
+      }
+      std::pop_heap(heads_.begin(), heads_.end());
+      Head head = heads_.back();
+      heads_.pop_back();
+      Output(head);
+      head.producer->queue.Pop();
+      head.producer->merging = false;
+      count++;
+    }
+    Producer *prev = nullptr;
+    for (Producer *p = producers_.load(std::memory_order_acquire); p;) {
+      // The list head is left in place, producers push onto it
+      if (p->closing && prev && !p->merging && p->queue.Empty()) {
+        prev->next = p->next;
+        delete p;
+        p = prev->next;
+      } else {
+        prev = p;
+        p = p->next;
+      }
+    }
+    if (count > 0) {
+      dirty_ = true;
+    }
+    if (dirty_ && (count == 0 || flush)) {
+      if (sinks_.ostream) {
+        sinks_.ostream->flush();
+      }
+      std::cout.flush();
+      dirty_ = false;
+    }
+    flushed_.store(request, std::memory_order_release);
+    return count;
+  }
+
+  // Add the oldest record of each idle queue to the merge, returns true if
+  // any was added
+  bool PollHeads() {
+    bool added = false;
+    for (Producer *p = producers_.load(std::memory_order_acquire); p;
+         p = p->next) {
+      size_t len;
+      const char *record;
+      if (!p->merging && (record = p->queue.Front(len))) {
+        uint64_t time;
+        std::memcpy(&time, record + sizeof(const MessageType *),
+                    sizeof(time));
+        heads_.push_back({time, p, record, len});
+        std::push_heap(heads_.begin(), heads_.end());
+        p->merging = true;
+        added = true;
+      }
+    }
+    return added;
+  }
+
+  void Output(const Head &head) {
+    const MessageType *type;
+    std::memcpy(&type, head.record, sizeof(type));
+    const size_t header = sizeof(type) + sizeof(head.time);
+    const char *args = head.record + header;
+    uint64_t ns = clock_.ToNanos(head.time);
+    if (sinks_.binary) {
+      sinks_.binary->Write(Id(type), ns, type, args, head.len - header);
+    }
+    if (sinks_.ostream || sinks_.cout || sinks_.segments) {
+      line_.clear();
+      log_time_.Format(line_, ns);
+      type->format(line_, args);
+    }
+    if (sinks_.ostream) {
+      sinks_.ostream->write(line_.data(), line_.size());
+    }
+    if (sinks_.segments) {
+      sinks_.segments->Write(line_.data(), line_.size());
+    }
+    if (sinks_.cout) {
+      std::cout.write(line_.data(), line_.size());
+    }
+    if (type->destroy) {
+      type->destroy(args);
+    }
+  }
+
+  // Binary log message type id, defined on first use
+  uint16_t Id(const MessageType *key) {
+    auto it = ids_.find(key);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    if (ids_.size() == LogFile::kMaxTypes) {
+      // Start over, the ids are defined again as they are used
+      ids_.clear();
+    }
+    uint16_t id = ids_.size() + 1;
+    ids_.emplace(key, id);
+    sinks_.binary->Define(id, key->signature, key->fmt);
+    return id;
+  }
+
+  bool Pending() {
+    for (Producer *p = producers_.load(std::memory_order_acquire); p;
+         p = p->next) {
+      if (!p->queue.Empty()) {
+        return true;
       }
-      // std::this_thread::sleep_for(100ms);
     }
+    return false;
+  }
+
+  // Block until a producer calls Notify or the timeout expires
+  void Sleep() {
+    sleeping_.store(true);
+    uint32_t seq = futex_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!Pending() && active_.load() && flush_requested_.load() == flushed_) {
+      int64_t us = timeout_;
+      timespec ts = {time_t(us / 1000000), long(us % 1000000 * 1000)};
+      syscall(SYS_futex, &futex_, FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+    }
+    sleeping_.store(false, std::memory_order_relaxed);
+  }
+
+  // Called by producers after queueing, only the first producer to see
+  // the writer asleep makes the system call
+  void Notify() {
+    if (wait_.load(std::memory_order_relaxed) != Wait::Block) {
+      return; // the writer spins or yields, it never sleeps on the futex
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed) &&
+        sleeping_.exchange(false)) {
+      Wake();
+    }
+  }
+
+  void Wake() {
+    futex_.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, &futex_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+  }
+
+  // Hand the writer a new output and wait until it has switched to it
+  void Replace(std::unique_ptr<Sinks> sinks) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_ = std::move(sinks);
+    }
+    Flush();
+  }
+
+  Producer *Register() {
+    Producer *p = new Producer(queue_size_);
+    p->next = producers_.load(std::memory_order_relaxed);
+    while (!producers_.compare_exchange_weak(p->next, p,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+    }
+    return p;
   }
 
   static Logger &instance() {
@@ -224,24 +1713,121 @@ private:
     return instance;
   }
 
-  using QueueType = Queue<Message>;
+  static Local &local() {
+    static thread_local Local local;
+    return local;
+  }
 
-  static QueueType &queue() {
-    static thread_local std::shared_ptr<QueueType> queue;
-    if (queue == nullptr) {
-      queue = std::make_shared<QueueType>(instance().queue_size_);
-      std::lock_guard<std::mutex> lock(instance().mutex_);
-      instance().queues_.push_back(queue);
+  static Producer &self() {
+    Local &local = Logger::local();
+    if (local.producer == nullptr) {
+      local.producer = instance().Register();
+      if (!local.exited) {
+        // Constructed here so it's destroyed before the thread_local
+        // objects constructed earlier that may still log
+        static thread_local Handle handle;
+      }
     }
-    return *queue;
+    return *local.producer;
   }
 
-  std::mutex mutex_;
-  std::vector<std::shared_ptr<QueueType>> queues_;
+  std::atomic<Producer *> producers_{nullptr};
   std::thread thread_;
-  bool active_;
-  size_t queues_size_;
+  std::atomic<bool> active_;
   size_t queue_size_;
-  bool cout_;
-  std::unique_ptr<std::ostream> ostream_;
+  std::atomic<Overflow> overflow_{Overflow::Block};
+  std::atomic<uint64_t> dropped_{0};
+
+  std::atomic<Wait> wait_{Wait::Block};
+  std::atomic<int64_t> timeout_{1000}; // us
+  std::atomic<bool> sleeping_{false};
+  std::atomic<uint32_t> futex_{0};
+  std::atomic<uint64_t> flush_requested_{0};
+  std::atomic<uint64_t> flushed_{0};
+
+  std::mutex mutex_;               // protects pending_
+  std::unique_ptr<Sinks> pending_; // output to switch to
+  Sinks sinks_;                    // writer only after construction
+  bool dirty_ = false;
+  std::unordered_map<const MessageType *, uint16_t> ids_;
+  TscClock clock_; // writer only after construction
+  LogTime log_time_;
+  std::vector<Head> heads_;
+  std::string line_; // formatting buffer
 };
+
+constexpr std::chrono::milliseconds Logger::kCalibration;
+constexpr std::chrono::nanoseconds Logger::kCalibrationInterval;
+
+// Log a message, fmt must be a string literal with one {} placeholder per
+// argument, see format.hpp. The format string is parsed and checked at
+// compile time.
+#define LOG(fmt, ...)                                                          \
+  do {                                                                         \
+    struct LogFormat {                                                         \
+      static constexpr const char *Str() { return fmt; }                       \
+    };                                                                         \
+    Logger::Log<LogFormat>(__VA_ARGS__);                                       \
+  } while (0)
+
+// Log a message with the overflow policy Logger::Overflow::overflow
+#define LOG_OVERFLOW(overflow, fmt, ...)                                       \
+  do {                                                                         \
+    struct LogFormat {                                                         \
+      static constexpr const char *Str() { return fmt; }                       \
+    };                                                                         \
+    Logger::LogWith<LogFormat>(Logger::Overflow::overflow, ##__VA_ARGS__);     \
+  } while (0)
+
+// Levels for SPARTAN_LOG_LEVEL, calls below it compile to nothing and
+// their arguments are not evaluated
+#define SPARTAN_LOG_DEBUG 0
+#define SPARTAN_LOG_INFO 1
+#define SPARTAN_LOG_WARN 2
+#define SPARTAN_LOG_ERROR 3
+#define SPARTAN_LOG_OFF 4
+
+#ifndef SPARTAN_LOG_LEVEL
+#define SPARTAN_LOG_LEVEL SPARTAN_LOG_DEBUG
+#endif
+
+// Log a message of the given level if enabled for the thread, see
+// Logger::Enabled. The level name starts the message.
+#define LOG_LEVEL(level, name, fmt, ...)                                       \
+  do {                                                                         \
+    if (Logger::Enabled(LogLevel::level)) {                                    \
+      LOG(name " " fmt, ##__VA_ARGS__);                                        \
+    }                                                                          \
+  } while (0)
+
+#if SPARTAN_LOG_LEVEL <= SPARTAN_LOG_DEBUG
+#define LOG_DEBUG(fmt, ...) LOG_LEVEL(Debug, "DEBUG", fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...)                                                    \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#if SPARTAN_LOG_LEVEL <= SPARTAN_LOG_INFO
+#define LOG_INFO(fmt, ...) LOG_LEVEL(Info, "INFO", fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...)                                                     \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#if SPARTAN_LOG_LEVEL <= SPARTAN_LOG_WARN
+#define LOG_WARN(fmt, ...) LOG_LEVEL(Warn, "WARN", fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(fmt, ...)                                                     \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#if SPARTAN_LOG_LEVEL <= SPARTAN_LOG_ERROR
+#define LOG_ERROR(fmt, ...) LOG_LEVEL(Error, "ERROR", fmt, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(fmt, ...)                                                    \
+  do {                                                                         \
+  } while (0)
+#endif
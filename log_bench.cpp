@@ -1,23 +1,262 @@
-#include <thread>
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+// Measures the logger.
+//
+// Every producer thread times each log call with the TSC. Paced runs log
+// a message every -i nanoseconds per thread, for each output sink,
+// argument set and 1, 2, 4 up to -t threads, and show the call latency
+// when the writer keeps up. Flood runs log as fast as possible to a text
+// file with each overflow policy and show what happens when the queues
+// fill up. Both report the p50, p99, p99.9 and max call latency in ns,
+// messages per second from the first call until Logger::Flush returns,
+// and messages dropped.
+//
+// log_bench [-n MESSAGES] [-t THREADS] [-i NS] [-q QUEUE_BYTES] [-o FILE]
+
 #include "log.hpp"
+#include "tsc.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
-int main(int argc, char *argv[]) {
+struct Price {
+  int64_t value;
+};
 
-  Logger::SetOutput("");
+static std::ostream &operator<<(std::ostream &o, const Price &p) {
+  return o << p.value / 10000 << "." << p.value % 10000;
+}
 
-  int nthreads = 2;
-  std::vector<std::thread> threads;
+static const std::string kShort(16, 's');
+static const std::string kLong(256, 'l');
 
-  for (int i = 0; i < nthreads; ++i) {
-    threads.emplace_back([] {
-      for (int i = 0; i < 5; ++i) {
-        Logger::Log("test", i, i * i);
+// A message to log, i is the message number
+struct Args {
+  const char *name;
+  void (*log)(uint64_t i);
+};
+
+static const Args kArgs[] = {
+    {"int", [](uint64_t i) { LOG("int {}", i); }},
+    {"mixed",
+     [](uint64_t i) { LOG("mixed {} {:.2f} {}", i, i * 0.25, 'B'); }},
+    {"str16", [](uint64_t i) { LOG("str {} {}", kShort, i); }},
+    {"str256", [](uint64_t i) { LOG("str {} {}", kLong, i); }},
+    {"price", [](uint64_t i) { LOG("price {}", Price{int64_t(i)}); }},
+};
+
+struct Sink {
+  const char *name;
+  std::function<void(const std::string &fname)> set;
+};
+
+static const Sink kSinks[] = {
+    {"null", [](const std::string &) { Logger::SetOutput(""); }},
+    {"text", [](const std::string &fname) { Logger::SetOutput(fname); }},
+    {"segments",
+     [](const std::string &fname) {
+       Logger::SetSegmentedOutput(fname, 64 << 20);
+     }},
+    {"binary",
+     [](const std::string &fname) { Logger::SetBinaryOutput(fname); }},
+};
+
+struct Result {
+  std::vector<uint64_t> ticks; // of each call
+  double secs;
+  uint64_t dropped;
+};
+
+// Log count messages from each of threads threads, one every interval
+// ticks or as fast as possible if 0
+static Result Run(const Args &args, int threads, uint64_t count,
+                  uint64_t interval) {
+  std::vector<std::vector<uint64_t>> samples(threads);
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> producers;
+  for (int t = 0; t < threads; ++t) {
+    producers.emplace_back([&, t] {
+      std::vector<uint64_t> &ticks = samples[t];
+      ticks.reserve(count);
+      // Registers the thread's queue
+      args.log(0);
+      ready++;
+      while (!go) {
+        std::this_thread::yield();
+      }
+      uint64_t next = TscClock::Now();
+      for (uint64_t i = 0; i < count; ++i) {
+        if (interval) {
+          while (TscClock::Now() < next) {
+          }
+          next += interval;
+        }
+        uint64_t start = TscClock::Now();
+        args.log(i);
+        ticks.push_back(TscClock::Now() - start);
       }
     });
   }
-  for (auto &t : threads) {
+  while (ready < threads) {
+    std::this_thread::yield();
+  }
+  Logger::Flush();
+  uint64_t dropped = Logger::Dropped();
+  auto start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto &t : producers) {
     t.join();
   }
+  Logger::Flush();
+  Result result;
+  result.secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  result.dropped = Logger::Dropped() - dropped;
+  for (const auto &ticks : samples) {
+    result.ticks.insert(result.ticks.end(), ticks.begin(), ticks.end());
+  }
+  return result;
+}
+
+static void Report(const char *sink, const char *args, int threads,
+                   Result &result, double ticks_per_ns) {
+  std::vector<uint64_t> &ticks = result.ticks;
+  std::sort(ticks.begin(), ticks.end());
+  auto percentile = [&](double p) {
+    return ticks[std::min(ticks.size() - 1, size_t(p * ticks.size()))] /
+           ticks_per_ns;
+  };
+  printf("%-9s %-7s %7d %8.0f %8.0f %8.0f %10.0f %12.0f %10lu\n", sink,
+         args, threads, percentile(0.5), percentile(0.99), percentile(0.999),
+         ticks.back() / ticks_per_ns, ticks.size() / result.secs,
+         result.dropped);
+  fflush(stdout);
+}
+
+static void Header(const char *title) {
+  printf("\n%s\n%-9s %-7s %7s %8s %8s %8s %10s %12s %10s\n", title, "sink",
+         "args", "threads", "p50", "p99", "p99.9", "max", "msgs/s",
+         "dropped");
+}
 
+static void RemoveOutput(const std::string &fname) {
+  unlink(fname.c_str());
+  for (int i = 0;; ++i) {
+    if (unlink((fname + "." + std::to_string(i)).c_str()) != 0) {
+      break;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  uint64_t count = 100000;
+  int max_threads = 4;
+  uint64_t interval_ns = 1000;
+  size_t queue_size = 1 << 20;
+  std::string fname = "/tmp/log_bench.log";
+  while ((opt = getopt(argc, argv, "n:t:i:q:o:")) != -1) {
+    switch (opt) {
+    case 'n':
+      count = atol(optarg);
+      break;
+    case 't':
+      max_threads = atoi(optarg);
+      break;
+    case 'i':
+      interval_ns = atol(optarg);
+      break;
+    case 'q':
+      queue_size = atol(optarg);
+      break;
+    case 'o':
+      fname = optarg;
+      break;
+    default:
+      std::cerr << "usage: " << argv[0]
+                << " [-n MESSAGES] [-t THREADS] [-i NS] [-q QUEUE_BYTES]"
+                   " [-o FILE]"
+                << std::endl;
+      return 1;
+    }
+  }
+  if (count == 0 || max_threads < 1) {
+    std::cerr << "log_bench: need at least one message and thread"
+              << std::endl;
+    return 1;
+  }
+
+  TscClock clock;
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  clock.Calibrate();
+  const double ticks_per_ns = clock.TicksPerNs();
+  printf("%.3f ticks/ns, %lu messages per thread, %zu byte queues, latency "
+         "in ns\n",
+         ticks_per_ns, count, queue_size);
+  Logger::SetQueueSize(queue_size);
+
+  char title[64];
+  snprintf(title, sizeof(title), "Paced, one message every %lu ns",
+           interval_ns);
+  Header(title);
+  for (const Sink &sink : kSinks) {
+    for (const Args &args : kArgs) {
+      for (int threads = 1; threads <= max_threads; threads *= 2) {
+        sink.set(fname);
+        Result result = Run(args, threads, count, interval_ns * ticks_per_ns);
+        Logger::SetOutput("");
+        RemoveOutput(fname);
+        Report(sink.name, args.name, threads, result, ticks_per_ns);
+      }
+    }
+  }
+
+  const std::pair<const char *, Logger::Overflow> policies[] = {
+      {"Flood, overflow block", Logger::Overflow::Block},
+      {"Flood, overflow drop", Logger::Overflow::Drop},
+      {"Flood, overflow overwrite", Logger::Overflow::Overwrite},
+  };
+  for (const auto &policy : policies) {
+    Header(policy.first);
+    Logger::SetOverflow(policy.second);
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      kSinks[1].set(fname);
+      Result result = Run(kArgs[1], threads, count, 0);
+      Logger::SetOutput("");
+      RemoveOutput(fname);
+      Report(kSinks[1].name, kArgs[1].name, threads, result, ticks_per_ns);
+    }
+  }
+  Logger::SetOverflow(Logger::Overflow::Block);
   return 0;
 }
@@ -0,0 +1,706 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+// Debug logging compiled out
+#undef SPARTAN_LOG_LEVEL
+#define SPARTAN_LOG_LEVEL 1
+
+#include "log.hpp"
+#include <cassert>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static std::vector<std::string> ReadLines(const std::string &fname) {
+  std::ifstream in(fname);
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(in, line)) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+// Log lines without the timestamp, whose nanoseconds since the epoch are
+// added to times
+static std::vector<std::string>
+ReadMessages(const std::string &fname, std::vector<uint64_t> *times = nullptr) {
+  std::vector<std::string> messages;
+  for (const auto &line : ReadLines(fname)) {
+    // "YYYY-MM-DD HH:MM:SS.nnnnnnnnn "
+    assert(line.size() >= 30 && line[19] == '.' && line[29] == ' ');
+    if (times) {
+      tm tm = {};
+      const char *end = strptime(line.c_str(), "%Y-%m-%d %H:%M:%S", &tm);
+      assert(end);
+      times->push_back(uint64_t(timegm(&tm)) * 1000000000 +
+                       std::stoul(line.substr(20, 9)));
+    }
+    messages.push_back(line.substr(30));
+  }
+  return messages;
+}
+
+static uint64_t RealTime() {
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static std::string ReadFile(const std::string &fname) {
+  std::ifstream in(fname, std::ios::binary | std::ios::ate);
+  std::string data(in.tellg(), '\0');
+  in.seekg(0);
+  in.read(&data[0], data.size());
+  return data;
+}
+
+// Records of varying length wrap around the ring in order
+static void TestByteQueue() {
+  ByteQueue q(256);
+  assert(q.MaxSize() == 120);
+  char *big = q.Reserve(121);
+  assert(big == nullptr);
+  size_t pushed = 0, popped = 0;
+  for (int round = 0; round < 1000; ++round) {
+    for (;;) {
+      size_t len = 1 + (pushed * 37) % q.MaxSize();
+      char *p = q.Reserve(len);
+      if (!p) {
+        break;
+      }
+      assert((reinterpret_cast<uintptr_t>(p) & 7) == 0);
+      std::memset(p, char(pushed), len);
+      q.Commit();
+      pushed++;
+    }
+    size_t len;
+    for (int i = 0; i < 1 + round % 3; ++i) {
+      const char *p = q.Front(len);
+      if (!p) {
+        break;
+      }
+      assert(len == 1 + (popped * 37) % q.MaxSize());
+      assert(p[0] == char(popped) && p[len - 1] == char(popped));
+      q.Pop();
+      popped++;
+    }
+  }
+  size_t len;
+  while (q.Front(len)) {
+    q.Pop();
+    popped++;
+  }
+  assert(popped == pushed);
+  assert(q.Empty());
+}
+
+// Overwriting keeps the newest records in order
+static void TestByteQueueOverwrite() {
+  ByteQueue q(256);
+  int dropped = 0;
+  auto discard = [&](const char *p, size_t len) {
+    int i;
+    std::memcpy(&i, p, sizeof(i));
+    assert(i == dropped);
+    dropped++;
+    assert(len == 1 + (i * 37) % q.MaxSize());
+  };
+  q.EnableOverwrite();
+  char *big = q.ReserveOverwrite(121, discard);
+  assert(big == nullptr);
+  for (int i = 0; i < 1000; ++i) {
+    size_t len = 1 + (i * 37) % q.MaxSize();
+    char *p = q.ReserveOverwrite(len, discard);
+    std::memcpy(p, &i, sizeof(i));
+    q.Commit();
+  }
+  assert(dropped > 900);
+  size_t len;
+  int last = dropped - 1;
+  while (const char *p = q.Front(len)) {
+    int i;
+    std::memcpy(&i, p, sizeof(i));
+    assert(i == last + 1);
+    last = i;
+    assert(len == 1 + (i * 37) % q.MaxSize());
+    q.Pop();
+  }
+  assert(last == 999);
+}
+
+// Producers never wait with Drop and Overwrite, every message is either
+// written or counted in a report
+static void TestOverflow(const std::string &fname, Logger::Overflow overflow) {
+  Logger::SetOutput(fname);
+  uint64_t before = Logger::Dropped();
+  const int count = 100000;
+  // A small queue for the new thread, so it overflows
+  Logger::SetQueueSize(4096);
+  std::thread([overflow] {
+    for (int i = 0; i < count; ++i) {
+      if (overflow == Logger::Overflow::Drop) {
+        LOG_OVERFLOW(Drop, "msg {}", i);
+      } else {
+        LOG_OVERFLOW(Overwrite, "msg {}", i);
+      }
+    }
+    // Reports what is left
+    LOG_OVERFLOW(Block, "end");
+  }).join();
+  Logger::SetQueueSize(1 << 20);
+  Logger::Flush();
+
+  uint64_t dropped = Logger::Dropped() - before;
+  uint64_t reported = 0;
+  int written = 0, last = -1;
+  for (const auto &line : ReadMessages(fname)) {
+    std::istringstream is(line);
+    std::string word;
+    uint64_t n;
+    is >> word >> n;
+    if (word == "dropped") {
+      reported += n;
+    } else if (word == "msg") {
+      assert(int(n) > last);
+      last = n;
+      written++;
+    }
+  }
+  assert(reported == dropped);
+  assert(written + dropped == count);
+}
+
+// Log from several short lived threads and check every message arrives
+// in per thread order
+static void TestThreads(const std::string &fname, Logger::Wait wait) {
+  Logger::SetOutput(fname);
+  Logger::SetWait(wait, std::chrono::microseconds(100));
+  const int nthreads = 4, count = 2000;
+  uint64_t start = RealTime();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nthreads; ++t) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < count; ++i) {
+        LOG("msg {} {}", t, i);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  Logger::Flush();
+  uint64_t stop = RealTime();
+
+  std::vector<uint64_t> times;
+  std::vector<std::string> lines = ReadMessages(fname, &times);
+  assert(lines.size() == nthreads * count);
+  // Allow for the calibration error
+  for (uint64_t time : times) {
+    assert(time > start - 1000000 && time < stop + 1000000);
+  }
+  std::vector<int> next(nthreads, 0);
+  for (const auto &line : lines) {
+    std::istringstream is(line);
+    std::string fmt;
+    int t, i;
+    is >> fmt >> t >> i;
+    assert(fmt == "msg");
+    assert(t >= 0 && t < nthreads);
+    assert(i == next[t]);
+    next[t]++;
+  }
+}
+
+// Logs from the destructor of a thread_local, which may run after the
+// logger's own thread_local state is torn down
+struct Goodbye {
+  ~Goodbye() { LOG("exit {}", id); }
+  int id = -1;
+};
+
+// Messages logged while a thread exits arrive and its queues are reclaimed
+static void TestThreadExit(const std::string &fname) {
+  Logger::SetOutput(fname);
+  const int nthreads = 20;
+  for (int t = 0; t < nthreads; ++t) {
+    std::thread([t] {
+      static thread_local Goodbye before;
+      before.id = t;
+      LOG("start {}", t);
+      static thread_local Goodbye after;
+      after.id = t;
+    }).join();
+  }
+  Logger::Flush();
+
+  std::vector<std::string> lines = ReadMessages(fname);
+  assert(lines.size() == nthreads * 3);
+  for (int t = 0; t < nthreads; ++t) {
+    assert(lines[t * 3] == "start " + std::to_string(t));
+    assert(lines[t * 3 + 1] == "exit " + std::to_string(t));
+    assert(lines[t * 3 + 2] == "exit " + std::to_string(t));
+  }
+}
+
+// Flush and switching the output return while other threads keep
+// logging, and the output switched to gets the rest in order
+static void TestBusy(const std::string &fname) {
+  Logger::SetOutput("/dev/null");
+  std::atomic<bool> stop(false);
+  std::atomic<int> logged(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; ++t) {
+    threads.emplace_back([t, &stop, &logged] {
+      for (int i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+        LOG("busy {} {}", t, i);
+        logged.fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+  }
+  while (logged.load() < 10000) {
+    std::this_thread::yield();
+  }
+  for (int i = 0; i < 10; ++i) {
+    Logger::Flush();
+  }
+  Logger::SetOutput(fname);
+  Logger::Flush();
+  stop.store(true);
+  for (auto &t : threads) {
+    t.join();
+  }
+  Logger::Flush();
+
+  std::vector<int> next(2, -1);
+  for (const auto &line : ReadMessages(fname)) {
+    std::istringstream is(line);
+    std::string fmt;
+    int t, i;
+    is >> fmt >> t >> i;
+    assert(fmt == "busy" && t >= 0 && t < 2);
+    assert(next[t] == -1 || i == next[t]);
+    next[t] = i + 1;
+  }
+}
+
+// Threads taking turns to log, their records are merged in the order
+// logged
+static void TestMerge(const std::string &fname) {
+  Logger::SetOutput(fname);
+  const int nthreads = 4, count = 500;
+  std::atomic<int> turn(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nthreads; ++t) {
+    threads.emplace_back([t, &turn] {
+      for (int i = t; i < nthreads * count; i += nthreads) {
+        while (turn.load(std::memory_order_acquire) != i) {
+          std::this_thread::yield();
+        }
+        LOG("turn {}", i);
+        turn.store(i + 1, std::memory_order_release);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  Logger::Flush();
+
+  std::vector<std::string> lines = ReadMessages(fname);
+  assert(lines.size() == nthreads * count);
+  for (int i = 0; i < nthreads * count; ++i) {
+    assert(lines[i] == "turn " + std::to_string(i));
+  }
+}
+
+// Levels below the compile time level are compiled out, the runtime
+// level applies to threads without their own
+static void TestLevels(const std::string &fname) {
+  Logger::SetOutput(fname);
+  int evaluated = 0;
+  LOG_DEBUG("debug {}", ++evaluated);
+  assert(evaluated == 0);
+  LOG_INFO("info {}", 1);
+  Logger::SetLevel(LogLevel::Warn);
+  assert(!Logger::Enabled(LogLevel::Info) && Logger::Enabled(LogLevel::Warn));
+  LOG_INFO("info {}", 2);
+  LOG_WARN("warn {}", 3);
+  std::atomic<std::atomic<LogLevel> *> level(nullptr);
+  std::atomic<bool> changed(false);
+  std::thread thread([&] {
+    level = &Logger::ThreadLevel();
+    assert(level.load()->load() == LogLevel::Warn);
+    LOG_INFO("info {}", 4);
+    while (!changed) {
+      std::this_thread::yield();
+    }
+    LOG_INFO("info {}", 5);
+  });
+  while (!level) {
+    std::this_thread::yield();
+  }
+  level.load()->store(LogLevel::Info);
+  changed = true;
+  thread.join();
+  LOG_INFO("info {}", 6);
+  LOG_ERROR("error {}", 7);
+  Logger::SetLevel(LogLevel::Debug);
+  Logger::Flush();
+
+  std::vector<std::string> lines = ReadMessages(fname);
+  std::vector<std::string> expect = {"INFO info 1", "WARN warn 3",
+                                     "INFO info 5", "ERROR error 7"};
+  assert(lines == expect);
+}
+
+// A sleeping writer is woken by a producer well before the timeout
+static void TestWakeup(const std::string &fname) {
+  Logger::SetOutput(fname);
+  Logger::SetWait(Logger::Wait::Block, std::chrono::seconds(10));
+  Logger::Flush();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  auto start = std::chrono::steady_clock::now();
+  LOG("wake");
+  while (ReadLines(fname).empty()) {
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+template <typename Fmt, typename... Args>
+static std::string Format(Fmt, Args &&... args) {
+  using Record = LogRecord<Fmt, typename std::decay<Args>::type...>;
+  std::vector<char> buf(Record::Size(args...));
+  Record::Store(buf.data(), 0, std::forward<Args>(args)...);
+  const char *p = buf.data() + Record::kHeaderSize;
+  const MessageType *type = &Record::kType;
+  std::string out;
+  type->format(out, p);
+  return out.substr(0, out.size() - 1); // without the newline
+}
+
+#define FORMAT(fmt, ...)                                                       \
+  Format(                                                                      \
+      [] {                                                                     \
+        struct F {                                                             \
+          static constexpr const char *Str() { return fmt; }                   \
+        };                                                                     \
+        return F();                                                            \
+      }(),                                                                     \
+      ##__VA_ARGS__)
+
+static_assert(CountFormatArgs("a {} b {:x} {{}}") == 2, "");
+static_assert(CountFormatTokens("a {} b") == 3, "");
+static_assert(CountFormatArgs("{") == -1, "");
+static_assert(CountFormatArgs("}") == -1, "");
+static_assert(CountFormatArgs("{0}") == -1, "");
+static_assert(CountFormatArgs("{:.}") == -1, "");
+static_assert(NextFormatToken("{:*^+012.3f}", 0).spec.width == 12, "");
+
+static void TestFormat() {
+  assert(FORMAT("a {} b {}", 1, "x") == "a 1 b x");
+  assert(FORMAT("{{{}}}", 5) == "{5}");
+  assert(FORMAT("{:5}|{:<5}|{:^5}|{:*>5}", 1, 2, 3, 4) ==
+         "    1|2    |  3  |****4");
+  assert(FORMAT("{:5}|{:>5}", "ab", "cd") == "ab   |   cd");
+  assert(FORMAT("{:05} {:+} {:+05}", -42, 7, 7) == "-0042 +7 +0007");
+  assert(FORMAT("{:x} {:X} {:o} {:b} {:#>6x}", 255, 255, 8, 5, 255) ==
+         "ff FF 10 101 ####ff");
+  assert(FORMAT("{} {}", INT64_MIN, UINT64_MAX) ==
+         "-9223372036854775808 18446744073709551615");
+  assert(FORMAT("{} {:.2f} {:.1e} {:8.3f}", 0.5, 3.14159, 1234.5, -2.0) ==
+         "0.5 3.14 1.2e+03   -2.000");
+  assert(FORMAT("{} {:d} {} {:d}", true, false, 'c', 'c') == "true 0 c 99");
+  assert(FORMAT("{:.3} {}", std::string("abcdef"), "x") ==
+         "abc x");
+  assert(FORMAT("no args") == "no args");
+}
+
+struct Price {
+  int64_t value;
+};
+
+static std::ostream &operator<<(std::ostream &o, const Price &p) {
+  return o << p.value / 10000 << "." << p.value % 10000;
+}
+
+// Not trivially copyable, formatted by the producer
+struct Order {
+  std::string id;
+  Price price;
+};
+
+static std::ostream &operator<<(std::ostream &o, const Order &order) {
+  return o << order.id << "@" << order.price;
+}
+
+static void LogTypes() {
+  std::string symbol = "SPY";
+  for (int i = 0; i < 250; ++i) {
+    LOG("types {} {} {} {:x} {:+} {:08} {} {} {:.3f} {:e}", true, 'x',
+        int16_t(-i), uint16_t(i), -i, unsigned(i), int64_t(-i) << 40,
+        uint64_t(i) << 40, 0.5f * i, 1.0 / (i + 1));
+    LOG("strings {:>6} {:.3} {{{}}}", symbol, "literal", Price{i * 12345});
+    LOG("order {:>12}", Order{std::to_string(i), Price{i}});
+  }
+  LOG("long {} {}", std::string(3000, 'y'), symbol);
+}
+
+// Not trivially copyable, records the thread formatting it
+struct Probe {
+  std::string name;
+};
+
+static std::thread::id probe_thread;
+
+static std::ostream &operator<<(std::ostream &o, const Probe &probe) {
+  probe_thread = std::this_thread::get_id();
+  return o << probe.name;
+}
+
+// The writer formats arguments unless the queue may be overwritten
+static void TestDeferred(const std::string &fname) {
+  Logger::SetOutput(fname);
+  std::thread::id self;
+  std::thread([&self] {
+    self = std::this_thread::get_id();
+    LOG_OVERFLOW(Block, "probe {}", Probe{"block"});
+    Logger::Flush();
+  }).join();
+  assert(probe_thread != self);
+  std::thread([&self] {
+    self = std::this_thread::get_id();
+    LOG_OVERFLOW(Drop, "probe {}", Probe{"drop"});
+    Logger::Flush();
+    assert(probe_thread != self);
+    LOG_OVERFLOW(Overwrite, "probe {}", Probe{"overwrite"});
+    assert(probe_thread == self);
+    // The queue stays in overwrite mode
+    LOG_OVERFLOW(Block, "probe {}", Probe{"after"});
+    assert(probe_thread == self);
+    probe_thread = std::thread::id();
+  }).join();
+  Logger::Flush();
+  assert(probe_thread == std::thread::id());
+  std::vector<std::string> messages = ReadMessages(fname);
+  assert((messages == std::vector<std::string>{"probe block", "probe drop",
+                                               "probe overwrite",
+                                               "probe after"}));
+}
+
+// The decoded binary log matches the text log
+static void TestBinary(const std::string &fname) {
+  Logger::SetOutput(fname);
+  LogTypes();
+  Logger::Flush();
+  std::vector<std::string> text = ReadMessages(fname);
+  assert(text.size() == 751);
+
+  Logger::SetBinaryOutput(fname);
+  LogTypes();
+  Logger::Flush();
+  std::string data = ReadFile(fname);
+  std::ostringstream os;
+  LogDecoder decoder;
+  size_t decoded_count = decoder.Decode(data.data(), data.size(), os);
+  assert(decoded_count == 751);
+  std::istringstream is(os.str());
+  std::vector<std::string> decoded;
+  std::string line;
+  while (std::getline(is, line)) {
+    // Each log line starts with a timestamp
+    decoded.push_back(line.substr(30));
+  }
+  assert(decoded == text);
+  Logger::SetOutput("");
+}
+
+// Contents of the segment files fname.0, fname.1 and so on, which are
+// removed
+static std::vector<std::string> ReadSegments(const std::string &fname) {
+  std::vector<std::string> segments;
+  for (int i = 0;; ++i) {
+    std::string name = fname + "." + std::to_string(i);
+    if (access(name.c_str(), F_OK) != 0) {
+      break;
+    }
+    segments.push_back(ReadFile(name));
+    unlink(name.c_str());
+  }
+  return segments;
+}
+
+// Lines are kept whole in segments unless larger than a segment
+static void TestSegments(const std::string &fname) {
+  std::string expect;
+  {
+    LogSegments segments(fname, 4096, std::chrono::milliseconds(1));
+    for (int i = 0; i < 1000; ++i) {
+      std::string line = std::string(10 + i * 7 % 200, 'a' + i % 26) + "\n";
+      if (i == 500) {
+        line = std::string(10000, 'x') + "\n";
+      }
+      segments.Write(line.data(), line.size());
+      expect += line;
+      if (i % 100 == 0) {
+        segments.Sync();
+      }
+    }
+  }
+  std::vector<std::string> segments = ReadSegments(fname);
+  assert(segments.size() > expect.size() / 4096);
+  std::string data;
+  for (const auto &segment : segments) {
+    assert(segment.size() <= 4096);
+    assert(segment.back() == '\n' || segment.back() == 'x');
+    data += segment;
+  }
+  assert(data == expect);
+
+  Logger::SetSegmentedOutput(fname, 4096);
+  for (int i = 0; i < 500; ++i) {
+    LOG("segment {}", i);
+  }
+  Logger::Flush();
+  Logger::SetOutput("");
+  std::ofstream out(fname);
+  for (const auto &segment : ReadSegments(fname)) {
+    out << segment;
+  }
+  out.close();
+  std::vector<std::string> lines = ReadMessages(fname);
+  assert(lines.size() == 500);
+  for (int i = 0; i < 500; ++i) {
+    assert(lines[i] == "segment " + std::to_string(i));
+  }
+}
+
+struct BigFormat {
+  static constexpr const char *Str() { return "big {} {}"; }
+};
+
+// Records larger than the file chunk size
+static void TestLargeRecords(const std::string &fname) {
+  {
+    LogFile file(fname, 4096);
+    using Record = LogRecord<BigFormat, std::string, int>;
+    const MessageType *type = &Record::kType;
+    std::string big(10000, 'x');
+    std::string arg = "x";
+    for (int i = 0; i < 100; ++i) {
+      const std::string &s = i % 10 == 0 ? big : arg;
+      std::vector<char> buf(Record::Size(s, i));
+      Record::Store(buf.data(), 0, s, i);
+      file.Define(i + 1, type->signature, type->fmt);
+      // Timestamps going backwards and forwards
+      uint64_t time = 1500000000000000000 + (i % 7) * 100000000000;
+      file.Write(i + 1, time, type, buf.data() + Record::kHeaderSize,
+                 buf.size() - Record::kHeaderSize);
+    }
+  }
+  std::string data = ReadFile(fname);
+  std::ostringstream os;
+  LogDecoder decoder;
+  size_t n = decoder.Decode(data.data(), data.size(), os);
+  assert(n == 100);
+  assert(os.str().size() > 100000);
+  std::istringstream is(os.str());
+  std::string line;
+  for (int i = 0; std::getline(is, line); ++i) {
+    time_t t = 1500000000 + i % 7 * 100;
+    tm tm;
+    gmtime_r(&t, &tm);
+    char expect[64];
+    strftime(expect, sizeof(expect), "%Y-%m-%d %H:%M:%S.000000000 big ", &tm);
+    assert(line.compare(0, std::strlen(expect), expect) == 0);
+  }
+}
+
+struct ByteFormat {
+  static constexpr const char *Str() { return "bytes {} {} {} {:x}"; }
+};
+
+// Single byte integers decode as integers and char as a character
+static void TestByteTypes(const std::string &fname) {
+  using Record = LogRecord<ByteFormat, int8_t, uint8_t, char, uint8_t>;
+  const MessageType *type = &Record::kType;
+  assert(std::string(type->signature) == "aAcA");
+  int8_t a = -5;
+  uint8_t b = 200, c = 255;
+  std::vector<char> buf(Record::Size(a, b, 'x', c));
+  Record::Store(buf.data(), 0, a, b, 'x', c);
+  std::string text;
+  type->format(text, buf.data() + Record::kHeaderSize);
+  assert(text == "bytes -5 200 x ff\n");
+  {
+    LogFile file(fname, 4096);
+    file.Define(1, type->signature, type->fmt);
+    file.Write(1, 0, type, buf.data() + Record::kHeaderSize,
+               buf.size() - Record::kHeaderSize);
+  }
+  std::string data = ReadFile(fname);
+  std::ostringstream os;
+  LogDecoder decoder;
+  size_t n = decoder.Decode(data.data(), data.size(), os);
+  assert(n == 1);
+  assert(os.str().substr(30) == text);
+}
+
+int main(int argc, char *argv[]) {
+  char fname[] = "/tmp/log_testXXXXXX";
+  int fd = mkstemp(fname);
+  assert(fd != -1);
+  close(fd);
+
+  TestFormat();
+  TestByteQueue();
+  TestByteQueueOverwrite();
+  Logger::SetWriterAffinity(0);
+  TestThreads(fname, Logger::Wait::Spin);
+  TestThreads(fname, Logger::Wait::Yield);
+  TestThreads(fname, Logger::Wait::Block);
+  TestMerge(fname);
+  TestThreadExit(fname);
+  TestBusy(fname);
+  TestLevels(fname);
+  TestWakeup(fname);
+  TestOverflow(fname, Logger::Overflow::Drop);
+  TestOverflow(fname, Logger::Overflow::Overwrite);
+  TestDeferred(fname);
+  TestBinary(fname);
+  TestLargeRecords(fname);
+  TestByteTypes(fname);
+  TestSegments(fname);
+
+  Logger::SetOutput("");
+  unlink(fname);
+  return 0;
+}
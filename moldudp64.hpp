@@ -0,0 +1,141 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+MoldUDP64 downstream packet decoder
+
+Packet layout, all integers big endian:
+
+  Session          10 bytes
+  Sequence Number   8 bytes, sequence number of the first message
+  Message Count     2 bytes, 0 is a heartbeat and 0xFFFF end of session
+  Messages          2 byte length followed by the message
+
+Messages are passed to Parser::ParseMessage as pointers into the packet
+buffer together with their sequence number. Messages already seen are
+dropped, sequence gaps are counted but otherwise skipped. Messages that
+Parser::Valid rejects, truncated or of unknown type, use up their
+sequence number but are counted instead of parsed. ParsePacket returns
+the number of messages passed on.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+template <typename Parser> class MoldUDP64 {
+
+public:
+  static constexpr size_t kHeaderSize = 20;
+  static constexpr size_t kSessionSize = 10;
+
+  MoldUDP64(Parser &parser) : parser_(parser) {}
+
+  size_t ParsePacket(const char *buf, size_t len) {
+    if (len < kHeaderSize) {
+      return 0;
+    }
+    uint64_t seqno = read64(buf + 10);
+    uint32_t count = read16(buf + 18);
+    if (next_ == 0) {
+      std::memcpy(session_, buf, kSessionSize);
+      next_ = seqno;
+    }
+    if (count == 0xFFFF) {
+      end_of_session_ = true;
+      count = 0;
+    }
+    if (seqno > next_) {
+      gaps_ += seqno - next_;
+      next_ = seqno;
+    }
+
+    const char *end = buf + len;
+    uint64_t first = next_ - invalid_;
+    buf += kHeaderSize;
+    for (uint32_t i = 0; i < count; ++i) {
+      if (buf + 2 > end) {
+        break;
+      }
+      uint32_t msg_len = read16(buf);
+      if (buf + 2 + msg_len > end) {
+        break;
+      }
+      if (seqno + i == next_) {
+        if (Parser::Valid(buf + 2, msg_len)) {
+          parser_.ParseMessage(next_, buf + 2);
+        } else {
+          invalid_++;
+        }
+        next_++;
+      }
+      buf += 2 + msg_len;
+    }
+    return next_ - invalid_ - first;
+  }
+
+  // Identifies a packet and its copy on the redundant line
+  static uint64_t PacketId(const char *buf) {
+    // The count tells a heartbeat from the packet that follows it
+    return read64(buf + 10) ^ uint64_t(read16(buf + 18)) << 48;
+  }
+
+  // Every packet is sequenced
+  static bool Sequenced(const char *buf) { return true; }
+
+  // Sequence number of the packet's first message relative to the next
+  // expected, negative if already seen and positive after a gap. 0 before
+  // the first packet.
+  int64_t Offset(const char *buf) const {
+    return next_ == 0 ? 0 : int64_t(read64(buf + 10) - next_);
+  }
+
+  // Sequence number of the next expected message
+  uint64_t NextSeqno() const { return next_; }
+
+  // Number of messages lost to sequence gaps
+  uint64_t Gaps() const { return gaps_; }
+
+  // Number of messages skipped as truncated or of unknown type
+  uint64_t Invalid() const { return invalid_; }
+
+  bool EndOfSession() const { return end_of_session_; }
+
+  const char *Session() const { return session_; }
+
+private:
+  static uint32_t read16(const void *buf) {
+    return __builtin_bswap16(*static_cast<const uint16_t *>(buf));
+  }
+
+  static uint64_t read64(const void *buf) {
+    return __builtin_bswap64(*static_cast<const uint64_t *>(buf));
+  }
+
+  Parser &parser_;
+  uint64_t next_ = 0;
+  uint64_t gaps_ = 0;
+  uint64_t invalid_ = 0;
+  bool end_of_session_ = false;
+  char session_[kSessionSize] = {};
+};
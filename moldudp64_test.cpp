@@ -0,0 +1,164 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "moldudp64.hpp"
+#include <arpa/inet.h>
+#include <cassert>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+struct Parser {
+  static bool Valid(const char *buf, size_t len) { return len > 0; }
+
+  void ParseMessage(uint64_t seqno, const char *buf) {
+    msgs.emplace_back(seqno, buf);
+  }
+
+  std::vector<std::pair<uint64_t, const char *>> msgs;
+};
+
+static std::string Packet(uint64_t seqno, std::vector<std::string> msgs,
+                          uint16_t count = 0) {
+  std::string s = "SESSION001";
+  for (int i = 7; i >= 0; --i) {
+    s.push_back(seqno >> (8 * i));
+  }
+  count = count ? count : msgs.size();
+  s.push_back(count >> 8);
+  s.push_back(count);
+  for (auto &m : msgs) {
+    s.push_back(m.size() >> 8);
+    s.push_back(m.size());
+    s += m;
+  }
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+
+  {
+    // Test sequencing, duplicates and gaps
+    Parser parser;
+    MoldUDP64<Parser> mold(parser);
+    std::string p1 = Packet(1, {"A1", "A2"});
+    mold.ParsePacket(p1.data(), p1.size());
+    assert(parser.msgs.size() == 2);
+    assert(parser.msgs[0].first == 1);
+    assert(parser.msgs[1].first == 2);
+    // messages point into the packet buffer
+    assert(parser.msgs[0].second == p1.data() + 22);
+    assert(parser.msgs[1].second == p1.data() + 26);
+    assert(std::string(mold.Session(), 10) == "SESSION001");
+
+    // duplicate and partially overlapping packets
+    mold.ParsePacket(p1.data(), p1.size());
+    assert(parser.msgs.size() == 2);
+    std::string p2 = Packet(2, {"A2", "A3"});
+    mold.ParsePacket(p2.data(), p2.size());
+    assert(parser.msgs.size() == 3);
+    assert(parser.msgs[2].first == 3);
+    assert(*parser.msgs[2].second == 'A');
+    assert(mold.NextSeqno() == 4);
+
+    // gap
+    std::string p3 = Packet(6, {"A6"});
+    mold.ParsePacket(p3.data(), p3.size());
+    assert(parser.msgs.size() == 4);
+    assert(parser.msgs[3].first == 6);
+    assert(mold.Gaps() == 2);
+
+    // heartbeat announcing a gap, end of session
+    std::string hb = Packet(8, {});
+    mold.ParsePacket(hb.data(), hb.size());
+    assert(mold.Gaps() == 3);
+    assert(mold.NextSeqno() == 8);
+    std::string eos = Packet(8, {}, 0xFFFF);
+    mold.ParsePacket(eos.data(), eos.size());
+    assert(mold.EndOfSession());
+
+    // truncated packet
+    std::string p4 = Packet(8, {"A8", "A9"});
+    mold.ParsePacket(p4.data(), p4.size() - 1);
+    assert(parser.msgs.size() == 5);
+    assert(mold.NextSeqno() == 9);
+
+    // packet ending inside a message length
+    std::string p5 = Packet(9, {"A9"});
+    std::vector<char> short5(p5.begin(), p5.begin() + 21);
+    size_t count = mold.ParsePacket(short5.data(), short5.size());
+    assert(count == 0);
+    assert(mold.NextSeqno() == 9);
+
+    // empty message, skipped and counted but its sequence number used
+    std::string p6 = Packet(9, {"", "A10"});
+    count = mold.ParsePacket(p6.data(), p6.size());
+    assert(count == 1 && mold.Invalid() == 1);
+    assert(parser.msgs.back().first == 10);
+    assert(mold.NextSeqno() == 11);
+  }
+
+  {
+    // Test receiving over loopback UDP
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(rx != -1 && tx != -1);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int err = bind(rx, (sockaddr *)&addr, sizeof(addr));
+    assert(err == 0);
+    socklen_t addrlen = sizeof(addr);
+    err = getsockname(rx, (sockaddr *)&addr, &addrlen);
+    assert(err == 0);
+
+    for (uint64_t seqno = 1; seqno <= 30; seqno += 3) {
+      std::string p = Packet(seqno, {"X1", "X22", "X333"});
+      ssize_t n =
+          sendto(tx, p.data(), p.size(), 0, (sockaddr *)&addr, sizeof(addr));
+      assert(n == (ssize_t)p.size());
+    }
+
+    Parser parser;
+    MoldUDP64<Parser> mold(parser);
+    char buf[1500];
+    for (int i = 0; i < 10; ++i) {
+      ssize_t n = recv(rx, buf, sizeof(buf), 0);
+      assert(n > 0);
+      size_t first = parser.msgs.size();
+      mold.ParsePacket(buf, n);
+      assert(parser.msgs.size() == first + 3);
+      assert(parser.msgs[first + 2].second == buf + 20 + 4 + 5 + 2);
+    }
+    for (size_t i = 0; i < parser.msgs.size(); ++i) {
+      assert(parser.msgs[i].first == i + 1);
+    }
+    assert(mold.Gaps() == 0);
+    close(rx);
+    close(tx);
+  }
+
+  return 0;
+}
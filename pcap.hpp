@@ -0,0 +1,280 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+PCAP capture reader
+
+Reads pcap and pcapng captures from memory, normally a memory mapped
+file, and decodes Ethernet, VLAN, Linux cooked capture, IPv4 and UDP
+headers. UDP payloads matching the multicast group and port filter are
+passed to Handler::ParsePacket(const char *, size_t) as pointers into the
+capture, typically MoldUDP64 or PitchParser.
+
+IPv4 fragments and non UDP traffic are skipped.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+template <typename Handler> class PcapReader {
+
+public:
+  // Link types
+  static constexpr uint32_t kEthernet = 1;
+  static constexpr uint32_t kRaw = 101;
+  static constexpr uint32_t kLinuxSll = 113;
+
+  PcapReader(Handler &handler) : handler_(handler) {}
+
+  // Only pass UDP datagrams sent to group:port, addresses in host byte
+  // order. Port 0 matches any port. Without filters all datagrams pass.
+  void AddFilter(uint32_t group, uint16_t port) {
+    filters_.push_back(Filter{group, port});
+  }
+
+  // Parse a complete pcap or pcapng capture, returns number of UDP
+  // datagrams passed to the handler
+  size_t Parse(const char *buf, size_t len) {
+    if (len < 4) {
+      throw std::runtime_error("pcap: truncated file");
+    }
+    uint32_t magic = read32(buf);
+    if (magic == 0x0A0D0D0A) {
+      return ParsePcapNg(buf, len);
+    }
+    return ParsePcap(buf, len);
+  }
+
+  // Number of captured packets seen by the last Parse call
+  size_t Packets() const { return packets_; }
+
+private:
+  struct Filter {
+    uint32_t group;
+    uint16_t port;
+  };
+
+  size_t ParsePcap(const char *buf, size_t len) {
+    if (len < 24) {
+      throw std::runtime_error("pcap: truncated file");
+    }
+    uint32_t magic = read32(buf);
+    switch (magic) {
+    case 0xa1b2c3d4:
+    case 0xa1b23c4d:
+      swap_ = false;
+      break;
+    case 0xd4c3b2a1:
+    case 0x4d3cb2a1:
+      swap_ = true;
+      break;
+    default:
+      throw std::runtime_error("pcap: unknown file format");
+    }
+    uint32_t linktype = get32(buf + 20) & 0xffff;
+
+    packets_ = 0;
+    size_t count = 0;
+    size_t i = 24;
+    while (i + 16 <= len) {
+      uint32_t caplen = get32(buf + i + 8);
+      if (i + 16 + caplen > len) {
+        break;
+      }
+      packets_++;
+      count += ParseFrame(linktype, buf + i + 16, caplen);
+      i += 16 + caplen;
+    }
+    return count;
+  }
+
+  size_t ParsePcapNg(const char *buf, size_t len) {
+    std::vector<uint32_t> linktypes;
+    packets_ = 0;
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 12 <= len) {
+      uint32_t type = read32(buf + i);
+      if (type == 0x0A0D0D0A) {
+        // Section header, establishes byte order for the section
+        uint32_t bom = read32(buf + i + 8);
+        if (bom == 0x1A2B3C4D) {
+          swap_ = false;
+        } else if (bom == 0x4D3C2B1A) {
+          swap_ = true;
+        } else {
+          throw std::runtime_error("pcapng: bad byte order magic");
+        }
+        linktypes.clear();
+      } else if (swap_) {
+        type = __builtin_bswap32(type);
+      }
+      uint32_t block_len = get32(buf + i + 4);
+      if (block_len < MinBlockLength(type) || i + block_len > len) {
+        break;
+      }
+      const char *body = buf + i + 8;
+      switch (type) {
+      case 1: // Interface description
+        linktypes.push_back(get16(body));
+        break;
+      case 6: { // Enhanced packet
+        uint32_t ifid = get32(body);
+        uint32_t caplen = get32(body + 12);
+        if (ifid < linktypes.size() && 32 + uint64_t(caplen) <= block_len) {
+          packets_++;
+          count += ParseFrame(linktypes[ifid], body + 20, caplen);
+        }
+        break;
+      }
+      case 3: { // Simple packet
+        uint32_t caplen = std::min(get32(body), block_len - 16);
+        if (!linktypes.empty()) {
+          packets_++;
+          count += ParseFrame(linktypes[0], body + 4, caplen);
+        }
+        break;
+      }
+      }
+      i += block_len;
+    }
+    return count;
+  }
+
+  // Block header, fixed fields and trailing length
+  static uint32_t MinBlockLength(uint32_t type) {
+    switch (type) {
+    case 0x0A0D0D0A:
+      return 28;
+    case 1:
+      return 20;
+    case 6:
+      return 32;
+    case 3:
+      return 16;
+    default:
+      return 12;
+    }
+  }
+
+  size_t ParseFrame(uint32_t linktype, const char *buf, size_t len) {
+    uint16_t ethertype;
+    switch (linktype) {
+    case kEthernet:
+      if (len < 14) {
+        return 0;
+      }
+      ethertype = read16be(buf + 12);
+      buf += 14;
+      len -= 14;
+      break;
+    case kLinuxSll:
+      if (len < 16) {
+        return 0;
+      }
+      ethertype = read16be(buf + 14);
+      buf += 16;
+      len -= 16;
+      break;
+    case kRaw:
+      ethertype = 0x0800;
+      break;
+    default:
+      return 0;
+    }
+    // 802.1Q and 802.1ad tags, possibly stacked
+    while ((ethertype == 0x8100 || ethertype == 0x88A8) && len >= 4) {
+      ethertype = read16be(buf + 2);
+      buf += 4;
+      len -= 4;
+    }
+    if (ethertype != 0x0800) {
+      return 0;
+    }
+    return ParseIPv4(buf, len);
+  }
+
+  size_t ParseIPv4(const char *buf, size_t len) {
+    if (len < 20 || (buf[0] & 0xf0) != 0x40) {
+      return 0;
+    }
+    size_t ihl = (buf[0] & 0x0f) * 4;
+    uint16_t frag = read16be(buf + 6);
+    if (ihl < 20 || buf[9] != 17 || (frag & 0x3fff) != 0 || len < ihl + 8) {
+      // Bad header, not UDP or fragmented
+      return 0;
+    }
+    uint32_t dst = read32be(buf + 16);
+    const char *udp = buf + ihl;
+    uint16_t port = read16be(udp + 2);
+    size_t udp_len = read16be(udp + 4);
+    if (!Match(dst, port) || udp_len < 8) {
+      return 0;
+    }
+    size_t payload_len = std::min(udp_len, len - ihl) - 8;
+    handler_.ParsePacket(udp + 8, payload_len);
+    return 1;
+  }
+
+  bool Match(uint32_t group, uint16_t port) const {
+    if (filters_.empty()) {
+      return true;
+    }
+    for (const auto &f : filters_) {
+      if (f.group == group && (f.port == 0 || f.port == port)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  uint32_t read32(const void *buf) {
+    return *static_cast<const uint32_t *>(buf);
+  }
+
+  uint32_t get16(const void *buf) {
+    uint16_t v = *static_cast<const uint16_t *>(buf);
+    return swap_ ? __builtin_bswap16(v) : v;
+  }
+
+  uint32_t get32(const void *buf) {
+    uint32_t v = *static_cast<const uint32_t *>(buf);
+    return swap_ ? __builtin_bswap32(v) : v;
+  }
+
+  uint16_t read16be(const void *buf) {
+    return __builtin_bswap16(*static_cast<const uint16_t *>(buf));
+  }
+
+  uint32_t read32be(const void *buf) {
+    return __builtin_bswap32(*static_cast<const uint32_t *>(buf));
+  }
+
+  Handler &handler_;
+  std::vector<Filter> filters_;
+  bool swap_ = false;
+  size_t packets_ = 0;
+};
@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+// Replay a pcap or pcapng capture through the ITCH or PITCH feed
+
+#include "feed.hpp"
+#include "itch.hpp"
+#include "moldudp64.hpp"
+#include "pcap.hpp"
+#include "pitch.hpp"
+#include "pitch_suh.hpp"
+#include <arpa/inet.h>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+class Handler {
+public:
+  void OnQuote(OrderBook *book, bool top) { count++; }
+
+  void OnTrade(OrderBook *book, int64_t shares, int64_t price, bool top) {
+    count++;
+  }
+
+  size_t count = 0;
+};
+
+// Measures the capture reader alone
+struct NullFraming {
+  void ParsePacket(const char *buf, size_t len) { bytes += len; }
+  size_t bytes = 0;
+};
+
+template <typename Framing>
+static void replay(Framing &framing,
+                   const boost::iostreams::mapped_file_source &file, int argc,
+                   char *argv[]) {
+  PcapReader<Framing> reader(framing);
+  for (int i = 3; i < argc; ++i) {
+    string arg = argv[i];
+    auto colon = arg.find(':');
+    in_addr addr;
+    if (inet_aton(arg.substr(0, colon).c_str(), &addr) == 0) {
+      throw runtime_error("invalid filter " + arg);
+    }
+    uint16_t port = colon == string::npos ? 0 : stoi(arg.substr(colon + 1));
+    reader.AddFilter(ntohl(addr.s_addr), port);
+  }
+
+  auto start = chrono::steady_clock::now();
+  size_t count = reader.Parse(file.data(), file.size());
+  auto stop = chrono::steady_clock::now();
+  double secs = chrono::duration<double>(stop - start).count();
+
+  cout << reader.Packets() << " packets, " << count << " datagrams in "
+       << secs << " s, " << file.size() / secs / 1e9 << " GB/s" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    cerr << "usage: " << argv[0]
+         << " itch|pitch|none FILE [GROUP[:PORT]]..." << endl;
+    return 1;
+  }
+
+  try {
+    string proto = argv[1];
+    boost::iostreams::mapped_file_source file(argv[2]);
+
+    Handler handler;
+    Feed<Handler> feed(handler, 1000000, true, true);
+    if (proto == "itch") {
+      Itch50Parser<Feed<Handler>> parser(feed);
+      MoldUDP64<Itch50Parser<Feed<Handler>>> mold(parser);
+      replay(mold, file, argc, argv);
+      cout << "gaps " << mold.Gaps() << endl;
+    } else if (proto == "pitch") {
+      PitchParser<Feed<Handler>> parser(feed);
+      PitchSUH<PitchParser<Feed<Handler>>> suh(parser);
+      replay(suh, file, argc, argv);
+      uint64_t gaps = 0;
+      for (size_t unit = 0; unit < suh.kUnits; ++unit) {
+        gaps += suh.Gaps(unit);
+      }
+      cout << "gaps " << gaps << endl;
+    } else {
+      NullFraming framing;
+      replay(framing, file, argc, argv);
+    }
+    cout << "callbacks " << handler.count << " orders " << feed.Size() << endl;
+  } catch (const std::exception &e) {
+    cerr << argv[0] << ": " << e.what() << endl;
+    return 1;
+  }
+
+  return 0;
+}
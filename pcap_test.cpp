@@ -0,0 +1,262 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "pcap.hpp"
+#include "feed.hpp"
+#include "itch.hpp"
+#include "moldudp64.hpp"
+#include "pitch.hpp"
+#include <cassert>
+#include <string>
+#include <vector>
+
+struct Framing {
+  void ParsePacket(const char *buf, size_t len) {
+    packets.emplace_back(buf, len);
+  }
+
+  std::vector<std::string> packets;
+};
+
+struct Handler {
+  void OnQuote(OrderBook *book, bool top) { bp = book->GetBestPrice(); }
+
+  void OnTrade(OrderBook *book, int64_t shares, int64_t price, bool top) {
+    bp = book->GetBestPrice();
+  }
+
+  BestPrice bp;
+};
+
+// Little endian
+static void le(std::string &s, uint64_t v, int n) {
+  for (int i = 0; i < n; ++i) {
+    s.push_back(v >> (8 * i));
+  }
+}
+
+// Big endian
+static void be(std::string &s, uint64_t v, int n) {
+  for (int i = n - 1; i >= 0; --i) {
+    s.push_back(v >> (8 * i));
+  }
+}
+
+static std::string Frame(uint32_t dst, uint16_t port,
+                         const std::string &payload, int vlans = 0,
+                         uint8_t proto = 17) {
+  std::string s(12, '\x01'); // MAC addresses
+  for (int i = 0; i < vlans; ++i) {
+    be(s, 0x8100, 2);
+    be(s, 100 + i, 2);
+  }
+  be(s, 0x0800, 2);
+  // IPv4
+  s.push_back(0x45);
+  s.push_back(0);
+  be(s, 20 + 8 + payload.size(), 2);
+  be(s, 0, 4); // id, flags, fragment offset
+  s.push_back(64);
+  s.push_back(proto);
+  be(s, 0, 2);
+  be(s, 0x0a000001, 4);
+  be(s, dst, 4);
+  // UDP
+  be(s, 12345, 2);
+  be(s, port, 2);
+  be(s, 8 + payload.size(), 2);
+  be(s, 0, 2);
+  return s + payload;
+}
+
+static std::string Pcap(const std::vector<std::string> &frames) {
+  std::string s;
+  le(s, 0xa1b2c3d4, 4);
+  le(s, 2, 2);
+  le(s, 4, 2);
+  le(s, 0, 8);
+  le(s, 65535, 4);
+  le(s, 1, 4); // Ethernet
+  for (auto &f : frames) {
+    le(s, 0, 8);
+    le(s, f.size(), 4);
+    le(s, f.size(), 4);
+    s += f;
+  }
+  return s;
+}
+
+static std::string PcapNg(const std::vector<std::string> &frames) {
+  std::string s;
+  // Section header block
+  le(s, 0x0A0D0D0A, 4);
+  le(s, 28, 4);
+  le(s, 0x1A2B3C4D, 4);
+  le(s, 1, 2);
+  le(s, 0, 2);
+  le(s, -1, 8);
+  le(s, 28, 4);
+  // Interface description block
+  le(s, 1, 4);
+  le(s, 20, 4);
+  le(s, 1, 2);
+  le(s, 0, 2);
+  le(s, 65535, 4);
+  le(s, 20, 4);
+  for (auto &f : frames) {
+    // Enhanced packet block
+    size_t padded = (f.size() + 3) & ~3;
+    le(s, 6, 4);
+    le(s, 32 + padded, 4);
+    le(s, 0, 4);
+    le(s, 0, 8);
+    le(s, f.size(), 4);
+    le(s, f.size(), 4);
+    s += f;
+    s.append(padded - f.size(), '\0');
+    le(s, 32 + padded, 4);
+  }
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+
+  {
+    // Test pcap decoding and filtering
+    std::vector<std::string> frames = {
+        Frame(0xe0000001, 1000, "one"),
+        Frame(0xe0000001, 1001, "two", 1),
+        Frame(0xe0000002, 1000, "three", 2),
+        Frame(0xe0000001, 1000, "tcp", 0, 6),
+    };
+    std::string pcap = Pcap(frames);
+
+    Framing framing;
+    PcapReader<Framing> reader(framing);
+    size_t n = reader.Parse(pcap.data(), pcap.size());
+    assert(n == 3);
+    assert(reader.Packets() == 4);
+    assert(framing.packets.size() == 3);
+    assert(framing.packets[0] == "one");
+    assert(framing.packets[1] == "two");
+    assert(framing.packets[2] == "three");
+
+    Framing filtered;
+    PcapReader<Framing> reader2(filtered);
+    reader2.AddFilter(0xe0000001, 1000);
+    reader2.AddFilter(0xe0000002, 0);
+    n = reader2.Parse(pcap.data(), pcap.size());
+    assert(n == 2);
+    assert(filtered.packets[0] == "one");
+    assert(filtered.packets[1] == "three");
+  }
+
+  {
+    // Test pcapng decoding
+    std::string pcap = PcapNg({Frame(0xe0000001, 1000, "one"),
+                               Frame(0xe0000001, 1000, "three", 1)});
+    Framing framing;
+    PcapReader<Framing> reader(framing);
+    size_t n = reader.Parse(pcap.data(), pcap.size());
+    assert(n == 2);
+    assert(framing.packets[0] == "one");
+    assert(framing.packets[1] == "three");
+  }
+
+  {
+    // Test malformed blocks and headers are rejected
+    std::string pcap = PcapNg({Frame(0xe0000001, 1000, "one")});
+    // Enhanced packet captured length overflowing the block length
+    std::string epb = pcap;
+    epb.replace(68, 4, std::string("\xf0\xff\xff\xff", 4));
+    Framing framing;
+    PcapReader<Framing> reader(framing);
+    size_t n = reader.Parse(epb.data(), epb.size());
+    assert(n == 0 && reader.Packets() == 0);
+    // Simple packet block shorter than its fixed fields
+    std::string spb = PcapNg({});
+    le(spb, 3, 4);
+    le(spb, 12, 4);
+    le(spb, 12, 4);
+    n = reader.Parse(spb.data(), spb.size());
+    assert(n == 0 && reader.Packets() == 0);
+    // IPv4 header length below the minimum
+    std::string frame = Frame(0xe0000001, 1000, "one");
+    frame[14] = 0x44;
+    std::string ihl = PcapNg({frame});
+    n = reader.Parse(ihl.data(), ihl.size());
+    assert(n == 0 && reader.Packets() == 1);
+    assert(framing.packets.empty());
+  }
+
+  {
+    // Test MoldUDP64 ITCH replay
+    std::string add;
+    add.push_back('A');
+    be(add, 1, 2);  // locate
+    be(add, 0, 8);  // tracking, timestamp
+    be(add, 1, 8);  // ref
+    add.push_back('B');
+    be(add, 100, 4);
+    add += "A       ";
+    be(add, 10, 4);
+    std::string mold = "SESSION001";
+    be(mold, 1, 8);
+    be(mold, 1, 2);
+    be(mold, add.size(), 2);
+    mold += add;
+    std::string pcap = Pcap({Frame(0xe0000001, 1000, mold)});
+
+    Handler handler;
+    Feed<Handler> feed(handler, 100, false, false);
+    Itch50Parser<Feed<Handler>> parser(feed);
+    MoldUDP64<Itch50Parser<Feed<Handler>>> framing(parser);
+    PcapReader<MoldUDP64<Itch50Parser<Feed<Handler>>>> reader(framing);
+    feed.Subscribe("A");
+    size_t n = reader.Parse(pcap.data(), pcap.size());
+    assert(n == 1);
+    assert(handler.bp.bid == 10);
+    assert(handler.bp.bidqty == 100);
+  }
+
+  {
+    // Test PITCH sequenced unit replay
+    char addl[] = {34,  0x21, 0,   0,   0, 0, 1, 0,   0,   0,   0,   0,
+                   0,   0,    'B', 100, 0, 0, 0, 'A', ' ', ' ', ' ', ' ',
+                   ' ', 1,    0,   0,   0, 0, 0, 0,   0,   0};
+    std::string suh = {42, 0, 1, 1, 1, 0, 0, 0};
+    suh += std::string(addl, sizeof(addl));
+    std::string pcap = Pcap({Frame(0xe0000001, 1000, suh)});
+
+    Handler handler;
+    Feed<Handler> feed(handler, 100, false, false);
+    PitchParser<Feed<Handler>> parser(feed);
+    PcapReader<PitchParser<Feed<Handler>>> reader(parser);
+    feed.Subscribe("A");
+    size_t n = reader.Parse(pcap.data(), pcap.size());
+    assert(n == 1);
+    assert(handler.bp.bid == 1);
+    assert(handler.bp.bidqty == 100);
+  }
+
+  return 0;
+}
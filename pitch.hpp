@@ -22,66 +22,215 @@ SOFTWARE.
 
 #pragma once
 
+#include "schema.hpp"
+#include "stats.hpp"
+#include "timestamp.hpp"
+#include <algorithm>
 #include <cstdint>
-#include <cstring>
 
-template <typename Handler> class PitchParser {
+// BATS PITCH message layouts, all integers little endian
+namespace pitch {
+
+// Header common to all messages but Time
+template <typename M, uint8_t Type, size_t Length>
+struct Header : Message<Type, Length> {
+  using MessageLength = LittleEndian<M, 0, uint8_t>;
+  using TimeOffset = LittleEndian<M, 2, uint32_t>;
+};
+
+struct Time : Message<0x20, 6> {
+  using Seconds = LittleEndian<Time, 2, uint32_t>;
+};
+
+struct AddOrderLong : Header<AddOrderLong, 0x21, 34> {
+  using OrderId = LittleEndian<AddOrderLong, 6, uint64_t>;
+  using Side = Char<AddOrderLong, 14>;
+  using Quantity = LittleEndian<AddOrderLong, 15, uint32_t>;
+  using Symbol = Alpha<AddOrderLong, 19, 6>;
+  using Price = LittleEndian<AddOrderLong, 25, uint64_t>;
+  using Flags = Char<AddOrderLong, 33>;
+};
+
+struct AddOrderShort : Header<AddOrderShort, 0x22, 26> {
+  using OrderId = LittleEndian<AddOrderShort, 6, uint64_t>;
+  using Side = Char<AddOrderShort, 14>;
+  using Quantity = LittleEndian<AddOrderShort, 15, uint16_t>;
+  using Symbol = Alpha<AddOrderShort, 17, 6>;
+  using Price = LittleEndian<AddOrderShort, 23, uint16_t>; // 2 decimals
+  using Flags = Char<AddOrderShort, 25>;
+};
+
+struct AddOrderExpanded : Header<AddOrderExpanded, 0x2F, 40> {
+  using OrderId = LittleEndian<AddOrderExpanded, 6, uint64_t>;
+  using Side = Char<AddOrderExpanded, 14>;
+  using Quantity = LittleEndian<AddOrderExpanded, 15, uint32_t>;
+  using Symbol = Alpha<AddOrderExpanded, 19, 8>;
+  using Price = LittleEndian<AddOrderExpanded, 27, uint64_t>;
+  using Flags = Char<AddOrderExpanded, 35>;
+  using ParticipantId = Alpha<AddOrderExpanded, 36, 4>;
+};
+
+struct OrderExecuted : Header<OrderExecuted, 0x23, 26> {
+  using OrderId = LittleEndian<OrderExecuted, 6, uint64_t>;
+  using ExecutedQuantity = LittleEndian<OrderExecuted, 14, uint32_t>;
+  using ExecutionId = LittleEndian<OrderExecuted, 18, uint64_t>;
+};
+
+struct OrderExecutedAtPriceSize
+    : Header<OrderExecutedAtPriceSize, 0x24, 38> {
+  using OrderId = LittleEndian<OrderExecutedAtPriceSize, 6, uint64_t>;
+  using ExecutedQuantity =
+      LittleEndian<OrderExecutedAtPriceSize, 14, uint32_t>;
+  using RemainingQuantity =
+      LittleEndian<OrderExecutedAtPriceSize, 18, uint32_t>;
+  using ExecutionId = LittleEndian<OrderExecutedAtPriceSize, 22, uint64_t>;
+  using Price = LittleEndian<OrderExecutedAtPriceSize, 30, uint64_t>;
+};
+
+struct ReduceSizeLong : Header<ReduceSizeLong, 0x25, 18> {
+  using OrderId = LittleEndian<ReduceSizeLong, 6, uint64_t>;
+  using CanceledQuantity = LittleEndian<ReduceSizeLong, 14, uint32_t>;
+};
+
+struct ReduceSizeShort : Header<ReduceSizeShort, 0x26, 16> {
+  using OrderId = LittleEndian<ReduceSizeShort, 6, uint64_t>;
+  using CanceledQuantity = LittleEndian<ReduceSizeShort, 14, uint16_t>;
+};
+
+struct ModifyOrderLong : Header<ModifyOrderLong, 0x27, 27> {
+  using OrderId = LittleEndian<ModifyOrderLong, 6, uint64_t>;
+  using Quantity = LittleEndian<ModifyOrderLong, 14, uint32_t>;
+  using Price = LittleEndian<ModifyOrderLong, 18, uint64_t>;
+  using Flags = Char<ModifyOrderLong, 26>;
+};
+
+struct ModifyOrderShort : Header<ModifyOrderShort, 0x28, 19> {
+  using OrderId = LittleEndian<ModifyOrderShort, 6, uint64_t>;
+  using Quantity = LittleEndian<ModifyOrderShort, 14, uint16_t>;
+  using Price = LittleEndian<ModifyOrderShort, 16, uint16_t>; // 2 decimals
+  using Flags = Char<ModifyOrderShort, 18>;
+};
+
+struct DeleteOrder : Header<DeleteOrder, 0x29, 14> {
+  using OrderId = LittleEndian<DeleteOrder, 6, uint64_t>;
+};
+
+struct TradeLong : Header<TradeLong, 0x2A, 41> {
+  using OrderId = LittleEndian<TradeLong, 6, uint64_t>;
+  using Side = Char<TradeLong, 14>;
+  using Quantity = LittleEndian<TradeLong, 15, uint32_t>;
+  using Symbol = Alpha<TradeLong, 19, 6>;
+  using Price = LittleEndian<TradeLong, 25, uint64_t>;
+  using ExecutionId = LittleEndian<TradeLong, 33, uint64_t>;
+};
+
+struct TradeShort : Header<TradeShort, 0x2B, 33> {
+  using OrderId = LittleEndian<TradeShort, 6, uint64_t>;
+  using Side = Char<TradeShort, 14>;
+  using Quantity = LittleEndian<TradeShort, 15, uint16_t>;
+  using Symbol = Alpha<TradeShort, 17, 6>;
+  using Price = LittleEndian<TradeShort, 23, uint16_t>; // 2 decimals
+  using ExecutionId = LittleEndian<TradeShort, 25, uint64_t>;
+};
+
+struct TradeExpanded : Header<TradeExpanded, 0x30, 43> {
+  using OrderId = LittleEndian<TradeExpanded, 6, uint64_t>;
+  using Side = Char<TradeExpanded, 14>;
+  using Quantity = LittleEndian<TradeExpanded, 15, uint32_t>;
+  using Symbol = Alpha<TradeExpanded, 19, 8>;
+  using Price = LittleEndian<TradeExpanded, 27, uint64_t>;
+  using ExecutionId = LittleEndian<TradeExpanded, 35, uint64_t>;
+};
+
+struct TradeBreak : Header<TradeBreak, 0x2C, 14> {
+  using ExecutionId = LittleEndian<TradeBreak, 6, uint64_t>;
+};
+
+struct EndOfSession : Header<EndOfSession, 0x2D, 6> {};
+
+struct TradingStatus : Header<TradingStatus, 0x31, 22> {
+  using Symbol = Alpha<TradingStatus, 6, 8>;
+  using HaltStatus = Char<TradingStatus, 14>;
+  using RegSHOAction = Char<TradingStatus, 15>;
+};
+
+struct AuctionUpdate : Header<AuctionUpdate, 0x95, 47> {
+  using Symbol = Alpha<AuctionUpdate, 6, 8>;
+  using AuctionType = Char<AuctionUpdate, 14>;
+  using ReferencePrice = LittleEndian<AuctionUpdate, 15, uint64_t>;
+  using BuyShares = LittleEndian<AuctionUpdate, 23, uint32_t>;
+  using SellShares = LittleEndian<AuctionUpdate, 27, uint32_t>;
+  using IndicativePrice = LittleEndian<AuctionUpdate, 31, uint64_t>;
+  using AuctionOnlyPrice = LittleEndian<AuctionUpdate, 39, uint64_t>;
+};
+
+struct AuctionSummary : Header<AuctionSummary, 0x96, 27> {
+  using Symbol = Alpha<AuctionSummary, 6, 8>;
+  using AuctionType = Char<AuctionSummary, 14>;
+  using Price = LittleEndian<AuctionSummary, 15, uint64_t>;
+  using Shares = LittleEndian<AuctionSummary, 23, uint32_t>;
+};
+
+struct RetailPriceImprovement : Header<RetailPriceImprovement, 0x98, 15> {
+  using Symbol = Alpha<RetailPriceImprovement, 6, 8>;
+  using Interest = Char<RetailPriceImprovement, 14>;
+};
+
+using Messages =
+    MessageSet<Time, AddOrderLong, AddOrderShort, AddOrderExpanded,
+               OrderExecuted, OrderExecutedAtPriceSize, ReduceSizeLong,
+               ReduceSizeShort, ModifyOrderLong, ModifyOrderShort,
+               DeleteOrder, TradeLong, TradeShort, TradeExpanded, TradeBreak,
+               EndOfSession, TradingStatus, AuctionUpdate, AuctionSummary,
+               RetailPriceImprovement>;
+
+constexpr LengthTable<Messages> kLengths;
+
+} // namespace pitch
+
+template <typename Handler, typename Stats = NullStats> class PitchParser {
 
 public:
-  PitchParser(Handler &handler) : handler_(handler) {}
+  PitchParser(Handler &handler, Stats stats = Stats())
+      : handler_(handler), stats_(stats) {}
 
   void ParseMessage(uint64_t seqno, const char *buf) {
-    switch (buf[1]) {
-    case 0x21:
-      return AddLong(seqno, buf);
-    case 0x22:
-      return AddShort(seqno, buf);
-    case 0x2F:
-      return AddExpanded(seqno, buf);
-    case 0x23:
-      return Executed(seqno, buf);
-    case 0x24:
-      return ExecutedAtPriceSize(seqno, buf);
-    case 0x25:
-      return ReduceLong(seqno, buf);
-    case 0x26:
-      return ReduceShort(seqno, buf);
-    case 0x27:
-      return ModifyLong(seqno, buf);
-    case 0x28:
-      return ModifyShort(seqno, buf);
-    case 0x29:
-      return Delete(seqno, buf);
-    case 0x2A:
-      return TradeLong(seqno, buf);
-    case 0x2B:
-      return TradeShort(seqno, buf);
-    case 0x30:
-      return TradeExpanded(seqno, buf);
-    }
+    uint64_t start = stats_.Start();
+    Timestamp(buf, WantsTimestamps<Handler>());
+    Dispatch(seqno, buf);
+    stats_.Message(buf[1], start);
   }
 
   size_t ParseStream(const char *buf, size_t len) {
     size_t i = 0;
     while (i < len) {
       int msg_len = read8(buf + i);
-      if (i + msg_len > len) {
+      if (msg_len < 2 || i + msg_len > len) {
         break;
       }
-      ParseMessage(0, buf + i);
+      Parse(0, buf + i, msg_len);
       i += msg_len;
     }
     return i;
   }
 
+  // Parse a Sequenced Unit Header packet, without the sequence tracking
+  // of PitchSUH
   void ParsePacket(const char *buf, size_t len) {
-    // uint16_t hdr_len = read16(buf);
+    if (len < 8 || read16(buf) < 8) {
+      return;
+    }
+    len = std::min<size_t>(len, read16(buf));
+    const char *end = buf + len;
     int count = read8(buf + 2);
     uint32_t seqno = read32(buf + 4);
     buf += 8;
-    for (int i = 0; i < count; ++i) {
+    for (int i = 0; i < count && buf < end; ++i) {
       uint8_t msg_len = read8(buf);
-      ParseMessage(seqno + i, buf);
+      if (msg_len < 2 || buf + msg_len > end) {
+        break;
+      }
+      Parse(seqno + i, buf, msg_len);
       buf += msg_len;
     }
   }
@@ -90,8 +239,74 @@ public:
   using Qty = int32_t;
   using Price = int64_t;
   using Symbol = uint64_t;
+  using Participant = uint32_t;
+
+  // Known message type of at least the length its layout requires
+  static bool Valid(const char *buf, size_t len) {
+    return len > 1 && pitch::kLengths.Valid(buf[1], len);
+  }
+
+  // Number of messages ParseStream and ParsePacket skipped as truncated or
+  // of unknown type
+  uint64_t Invalid() const { return invalid_; }
+
+  static constexpr Participant kNoParticipant = 0x20202020; // "    "
 
 private:
+  void Parse(uint64_t seqno, const char *buf, size_t len) {
+    if (Valid(buf, len)) {
+      ParseMessage(seqno, buf);
+    } else {
+      invalid_++;
+    }
+  }
+
+  // One switch over all message types, compiled to a single jump table
+  void Dispatch(uint64_t seqno, const char *buf) {
+    switch (read8(buf + 1)) {
+    case pitch::Time::kType:
+      return Time(seqno, buf);
+    case pitch::AddOrderLong::kType:
+      return Add<pitch::AddOrderLong>(seqno, buf);
+    case pitch::AddOrderShort::kType:
+      return Add<pitch::AddOrderShort>(seqno, buf);
+    case pitch::AddOrderExpanded::kType:
+      return AddExpanded(seqno, buf);
+    case pitch::OrderExecuted::kType:
+      return Executed(seqno, buf);
+    case pitch::OrderExecutedAtPriceSize::kType:
+      return ExecutedAtPriceSize(seqno, buf);
+    case pitch::ReduceSizeLong::kType:
+      return Reduce<pitch::ReduceSizeLong>(seqno, buf);
+    case pitch::ReduceSizeShort::kType:
+      return Reduce<pitch::ReduceSizeShort>(seqno, buf);
+    case pitch::ModifyOrderLong::kType:
+      return Modify<pitch::ModifyOrderLong>(seqno, buf);
+    case pitch::ModifyOrderShort::kType:
+      return Modify<pitch::ModifyOrderShort>(seqno, buf);
+    case pitch::DeleteOrder::kType:
+      return Delete(seqno, buf);
+    case pitch::TradeLong::kType:
+      return Trade<pitch::TradeLong>(seqno, buf);
+    case pitch::TradeShort::kType:
+      return Trade<pitch::TradeShort>(seqno, buf);
+    case pitch::TradeExpanded::kType:
+      return Trade<pitch::TradeExpanded>(seqno, buf);
+    case pitch::TradeBreak::kType:
+      return TradeBreak(seqno, buf);
+    case pitch::EndOfSession::kType:
+      return EndOfSession(seqno, buf);
+    case pitch::TradingStatus::kType:
+      return TradingStatus(seqno, buf);
+    case pitch::AuctionUpdate::kType:
+      return AuctionUpdate(seqno, buf);
+    case pitch::AuctionSummary::kType:
+      return AuctionSummary(seqno, buf);
+    case pitch::RetailPriceImprovement::kType:
+      return RetailPriceImprovement(seqno, buf);
+    }
+  }
+
   uint8_t read8(const void *buf) { return *static_cast<const uint8_t *>(buf); }
 
   uint32_t read16(const void *buf) {
@@ -102,113 +317,140 @@ private:
     return *static_cast<const uint32_t *>(buf);
   }
 
-  uint64_t read64(const void *buf) {
-    return *static_cast<const uint64_t *>(buf);
+  // Short messages carry 2 decimal prices, long ones 4
+  template <typename F> static Price ReadPrice(const char *buf) {
+    return sizeof(typename F::type) == 2 ? Price(F::Read(buf)) * 100
+                                         : Price(F::Read(buf));
   }
 
-  Symbol readsym6(const void *buf) {
-    uint64_t v = 0;
-    std::memset(&v, ' ', 8);
-    std::memcpy(&v, buf, 6);
-    return __builtin_bswap64(v);
+  // Every message but Time carries a nanosecond offset from the last Time
+  void Timestamp(const char *buf, std::true_type) {
+    if (read8(buf + 1) != pitch::Time::kType) {
+      handler_.OnTimestamp(seconds_ * 1000000000ull +
+                           pitch::DeleteOrder::TimeOffset::Read(buf));
+    }
   }
 
-  uint64_t readsym8(const void *buf) {
-    return __builtin_bswap64(*static_cast<const uint64_t *>(buf));
-  }
+  void Timestamp(const char *buf, std::false_type) {}
 
-  void AddLong(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
-    bool bs = buf[14] == 'B' ? true : false;
-    Qty qty = read32(buf + 15);
-    Symbol symbol = readsym6(buf + 19);
-    Price price = read64(buf + 25);
-    handler_.Add(seqno, id, bs, qty, symbol, price);
+  void Time(uint64_t seqno, const char *buf) {
+    seconds_ = pitch::Time::Seconds::Read(buf);
   }
 
-  void AddShort(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
-    bool bs = buf[14] == 'B' ? true : false;
-    Qty qty = read16(buf + 15);
-    Symbol symbol = readsym6(buf + 17);
-    Price price = read16(buf + 23) * 100;
+  template <typename M> void Add(uint64_t seqno, const char *buf) {
+    Id id = M::OrderId::Read(buf);
+    bool bs = M::Side::Read(buf) == 'B' ? true : false;
+    Qty qty = M::Quantity::Read(buf);
+    Symbol symbol = M::Symbol::Read(buf);
+    Price price = ReadPrice<typename M::Price>(buf);
     handler_.Add(seqno, id, bs, qty, symbol, price);
   }
 
   void AddExpanded(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
-    bool bs = buf[14] == 'B' ? true : false;
-    Qty qty = read32(buf + 15);
-    Symbol symbol = readsym8(buf + 19);
-    Price price = read64(buf + 27);
-    handler_.Add(seqno, id, bs, qty, symbol, price);
+    using M = pitch::AddOrderExpanded;
+    Participant participant = M::ParticipantId::Read(buf);
+    if (participant == kNoParticipant) {
+      return Add<M>(seqno, buf);
+    }
+    Id id = M::OrderId::Read(buf);
+    bool bs = M::Side::Read(buf) == 'B' ? true : false;
+    Qty qty = M::Quantity::Read(buf);
+    Symbol symbol = M::Symbol::Read(buf);
+    Price price = M::Price::Read(buf);
+    handler_.AddAttributed(seqno, id, bs, qty, symbol, price, participant);
   }
 
   void Executed(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
-    Qty qty = read32(buf + 14);
+    using M = pitch::OrderExecuted;
+    Id id = M::OrderId::Read(buf);
+    Qty qty = M::ExecutedQuantity::Read(buf);
     handler_.Executed(seqno, id, qty);
   }
 
   void ExecutedAtPriceSize(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
-    Qty qty = read32(buf + 14);
-    Qty leaves_qty = read32(buf + 18);
-    Price price = read64(buf + 30);
+    using M = pitch::OrderExecutedAtPriceSize;
+    Id id = M::OrderId::Read(buf);
+    Qty qty = M::ExecutedQuantity::Read(buf);
+    Qty leaves_qty = M::RemainingQuantity::Read(buf);
+    Price price = M::Price::Read(buf);
     handler_.ExecutedAtPriceSize(seqno, id, qty, leaves_qty, price);
   }
 
-  void ReduceLong(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
-    Qty qty = read32(buf + 14);
+  template <typename M> void Reduce(uint64_t seqno, const char *buf) {
+    Id id = M::OrderId::Read(buf);
+    Qty qty = M::CanceledQuantity::Read(buf);
     handler_.Reduce(seqno, id, qty);
   }
 
-  void ReduceShort(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
-    Qty qty = read16(buf + 14);
-    handler_.Reduce(seqno, id, qty);
-  }
-
-  void ModifyLong(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
-    Qty qty = read32(buf + 14);
-    Price price = read64(buf + 18);
-    handler_.Modify(seqno, id, qty, price);
-  }
-
-  void ModifyShort(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
-    Qty qty = read16(buf + 14);
-    Price price = read16(buf + 16) * 100;
+  template <typename M> void Modify(uint64_t seqno, const char *buf) {
+    Id id = M::OrderId::Read(buf);
+    Qty qty = M::Quantity::Read(buf);
+    Price price = ReadPrice<typename M::Price>(buf);
     handler_.Modify(seqno, id, qty, price);
   }
 
   void Delete(uint64_t seqno, const char *buf) {
-    Id id = read64(buf + 6);
+    Id id = pitch::DeleteOrder::OrderId::Read(buf);
     handler_.Delete(seqno, id);
   }
 
-  void TradeLong(uint64_t seqno, const char *buf) {
-    Qty qty = read32(buf + 15);
-    Symbol symbol = readsym6(buf + 19);
-    Price price = read64(buf + 25);
+  template <typename M> void Trade(uint64_t seqno, const char *buf) {
+    Qty qty = M::Quantity::Read(buf);
+    Symbol symbol = M::Symbol::Read(buf);
+    Price price = ReadPrice<typename M::Price>(buf);
     handler_.Trade(seqno, qty, symbol, price);
   }
 
-  void TradeShort(uint64_t seqno, const char *buf) {
-    Qty qty = read16(buf + 15);
-    Symbol symbol = readsym6(buf + 17);
-    Price price = read16(buf + 23) * 100;
-    handler_.Trade(seqno, qty, symbol, price);
+  void TradeBreak(uint64_t seqno, const char *buf) {
+    uint64_t execution = pitch::TradeBreak::ExecutionId::Read(buf);
+    handler_.BrokenTrade(seqno, execution);
   }
 
-  void TradeExpanded(uint64_t seqno, const char *buf) {
-    Qty qty = read32(buf + 15);
-    Symbol symbol = readsym8(buf + 19);
-    Price price = read64(buf + 27);
-    handler_.Trade(seqno, qty, symbol, price);
+  void EndOfSession(uint64_t seqno, const char *buf) {
+    // Same meaning as the ITCH end of messages system event
+    handler_.SystemEvent(seqno, 'C');
+  }
+
+  void TradingStatus(uint64_t seqno, const char *buf) {
+    using M = pitch::TradingStatus;
+    Symbol symbol = M::Symbol::Read(buf);
+    char status = M::HaltStatus::Read(buf);
+    handler_.TradingAction(seqno, 0, symbol, status);
+  }
+
+  void AuctionUpdate(uint64_t seqno, const char *buf) {
+    using M = pitch::AuctionUpdate;
+    Symbol symbol = M::Symbol::Read(buf);
+    char auction_type = M::AuctionType::Read(buf);
+    Price ref = M::ReferencePrice::Read(buf);
+    int64_t buy = M::BuyShares::Read(buf);
+    int64_t sell = M::SellShares::Read(buf);
+    Price indicative = M::IndicativePrice::Read(buf);
+    Price auction_only = M::AuctionOnlyPrice::Read(buf);
+    char direction = buy > sell ? 'B' : sell > buy ? 'S' : 'N';
+    handler_.Imbalance(seqno, symbol, std::min(buy, sell),
+                       buy > sell ? buy - sell : sell - buy, direction,
+                       auction_only, indicative, ref, auction_type);
+  }
+
+  void AuctionSummary(uint64_t seqno, const char *buf) {
+    using M = pitch::AuctionSummary;
+    Symbol symbol = M::Symbol::Read(buf);
+    char auction_type = M::AuctionType::Read(buf);
+    Price price = M::Price::Read(buf);
+    Qty qty = M::Shares::Read(buf);
+    handler_.CrossTrade(seqno, qty, symbol, price, auction_type);
+  }
+
+  void RetailPriceImprovement(uint64_t seqno, const char *buf) {
+    using M = pitch::RetailPriceImprovement;
+    Symbol symbol = M::Symbol::Read(buf);
+    char interest = M::Interest::Read(buf);
+    handler_.RetailInterest(seqno, symbol, interest);
   }
 
   Handler &handler_;
+  Stats stats_;
+  uint64_t invalid_ = 0;
+  uint64_t seconds_ = 0; // since midnight, from the last Time message
 };
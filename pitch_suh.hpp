@@ -0,0 +1,180 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+BATS PITCH Sequenced Unit Header decoder
+
+Packet layout, all integers little endian:
+
+  Hdr Length    2 bytes, including the header
+  Hdr Count     1 byte, number of messages, 0 is a heartbeat
+  Hdr Unit      1 byte, unit number, 0 for unsequenced messages
+  Hdr Sequence  4 bytes, sequence number of the first message
+  Messages      1 byte length followed by the message
+
+Each unit is sequenced independently. Expected sequence numbers are kept
+in a flat array indexed by unit, messages already seen are dropped with a
+single compare and gaps are counted but otherwise skipped. A heartbeat
+carries the next sequence number of its unit and reveals gaps too.
+Messages that Parser::Valid rejects, truncated or of unknown type, use up
+their sequence number but are counted instead of parsed.
+
+By default every unit goes to the same parser. SetUnitParser routes a unit
+to its own parser, typically a PitchParser with its own Feed, so units
+received on separate sockets can be processed on separate cores.
+
+ParsePacket returns the number of messages passed on.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+template <typename Parser> class PitchSUH {
+
+public:
+  static constexpr size_t kHeaderSize = 8;
+  static constexpr size_t kUnits = 256;
+
+  PitchSUH(Parser &parser) {
+    for (auto &p : parsers_) {
+      p = &parser;
+    }
+  }
+
+  // Route messages of unit to parser
+  void SetUnitParser(uint8_t unit, Parser &parser) { parsers_[unit] = &parser; }
+
+  size_t ParsePacket(const char *buf, size_t len) {
+    if (len < kHeaderSize) {
+      return 0;
+    }
+    size_t hdr_len = read16(buf);
+    uint32_t count = read8(buf + 2);
+    uint8_t unit = read8(buf + 3);
+    uint32_t seqno = read32(buf + 4);
+    if (hdr_len < kHeaderSize) {
+      return 0;
+    }
+    if (hdr_len < len) {
+      len = hdr_len;
+    }
+    const char *end = buf + len;
+    buf += kHeaderSize;
+
+    Parser &parser = *parsers_[unit];
+    uint64_t invalid = invalid_;
+    if (unit == 0) {
+      // Unsequenced
+      uint32_t i = 0;
+      for (; i < count && buf < end; ++i) {
+        uint32_t msg_len = read8(buf);
+        if (msg_len < 2 || buf + msg_len > end) {
+          break;
+        }
+        Parse(parser, 0, buf, msg_len);
+        buf += msg_len;
+      }
+      return i - (invalid_ - invalid);
+    }
+
+    uint32_t &next = next_[unit];
+    if (next == 0) {
+      next = seqno;
+    }
+    if (seqno + count <= next) {
+      // Duplicate or heartbeat without gap
+      return 0;
+    }
+    if (seqno > next) {
+      gaps_[unit] += seqno - next;
+      next = seqno;
+    }
+    uint32_t first = next;
+    for (uint32_t i = 0; i < count && buf < end; ++i) {
+      uint32_t msg_len = read8(buf);
+      if (msg_len < 2 || buf + msg_len > end) {
+        break;
+      }
+      if (seqno + i == next) {
+        Parse(parser, next++, buf, msg_len);
+      }
+      buf += msg_len;
+    }
+    return next - first - (invalid_ - invalid);
+  }
+
+  // Identifies a packet and its copy on the redundant line
+  static uint64_t PacketId(const char *buf) {
+    // The count tells a heartbeat from the packet that follows it
+    return uint64_t(read8(buf + 2)) << 40 | uint64_t(read8(buf + 3)) << 32 |
+           read32(buf + 4);
+  }
+
+  // Unit 0 carries unsequenced messages
+  static bool Sequenced(const char *buf) { return read8(buf + 3) != 0; }
+
+  // Sequence number of the packet's first message relative to the next
+  // expected on its unit, negative if already seen and positive after a
+  // gap. 0 for unsequenced messages and before the unit's first packet.
+  int64_t Offset(const char *buf) const {
+    uint8_t unit = read8(buf + 3);
+    uint32_t next = next_[unit];
+    return unit == 0 || next == 0 ? 0 : int64_t(read32(buf + 4)) - next;
+  }
+
+  // Sequence number of the next expected message on unit
+  uint32_t NextSeqno(uint8_t unit) const { return next_[unit]; }
+
+  // Number of messages lost to sequence gaps on unit
+  uint64_t Gaps(uint8_t unit) const { return gaps_[unit]; }
+
+  // Number of messages skipped as truncated or of unknown type
+  uint64_t Invalid() const { return invalid_; }
+
+private:
+  void Parse(Parser &parser, uint64_t seqno, const char *buf, size_t len) {
+    if (Parser::Valid(buf, len)) {
+      parser.ParseMessage(seqno, buf);
+    } else {
+      invalid_++;
+    }
+  }
+
+  static uint32_t read8(const void *buf) {
+    return *static_cast<const uint8_t *>(buf);
+  }
+
+  static uint32_t read16(const void *buf) {
+    return *static_cast<const uint16_t *>(buf);
+  }
+
+  static uint32_t read32(const void *buf) {
+    return *static_cast<const uint32_t *>(buf);
+  }
+
+  Parser *parsers_[kUnits];
+  uint32_t next_[kUnits] = {};
+  uint64_t gaps_[kUnits] = {};
+  uint64_t invalid_ = 0;
+};
@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "pitch_suh.hpp"
+#include <cassert>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct Parser {
+  static bool Valid(const char *buf, size_t len) { return len >= 2; }
+
+  void ParseMessage(uint64_t seqno, const char *buf) {
+    msgs.emplace_back(seqno, buf);
+  }
+
+  std::vector<std::pair<uint64_t, const char *>> msgs;
+};
+
+static std::string Packet(uint8_t unit, uint32_t seqno,
+                          std::vector<std::string> msgs) {
+  std::string s(8, 0);
+  s[2] = msgs.size();
+  s[3] = unit;
+  for (int i = 0; i < 4; ++i) {
+    s[4 + i] = seqno >> (8 * i);
+  }
+  for (auto &m : msgs) {
+    s.push_back(m.size() + 1);
+    s += m;
+  }
+  s[0] = s.size();
+  s[1] = s.size() >> 8;
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+
+  {
+    // Test per unit sequencing, duplicates and gaps
+    Parser parser;
+    PitchSUH<Parser> suh(parser);
+    std::string p1 = Packet(1, 1, {"\x21", "\x22"});
+    suh.ParsePacket(p1.data(), p1.size());
+    assert(parser.msgs.size() == 2);
+    assert(parser.msgs[0].first == 1);
+    assert(parser.msgs[1].first == 2);
+    // messages point into the packet buffer
+    assert(parser.msgs[0].second == p1.data() + 8);
+    assert(parser.msgs[1].second == p1.data() + 10);
+
+    // other units are sequenced independently
+    std::string p2 = Packet(2, 100, {"\x21"});
+    suh.ParsePacket(p2.data(), p2.size());
+    assert(parser.msgs.size() == 3);
+    assert(parser.msgs[2].first == 100);
+    assert(suh.NextSeqno(1) == 3);
+    assert(suh.NextSeqno(2) == 101);
+
+    // duplicate and partially overlapping packets
+    suh.ParsePacket(p1.data(), p1.size());
+    assert(parser.msgs.size() == 3);
+    std::string p3 = Packet(1, 2, {"\x22", "\x23"});
+    suh.ParsePacket(p3.data(), p3.size());
+    assert(parser.msgs.size() == 4);
+    assert(parser.msgs[3].first == 3);
+
+    // gap
+    std::string p4 = Packet(1, 10, {"\x21"});
+    suh.ParsePacket(p4.data(), p4.size());
+    assert(parser.msgs.size() == 5);
+    assert(suh.Gaps(1) == 6);
+    assert(suh.Gaps(2) == 0);
+    assert(suh.NextSeqno(1) == 11);
+
+    // heartbeats carry the next sequence number
+    std::string hb = Packet(2, 101, {});
+    suh.ParsePacket(hb.data(), hb.size());
+    assert(suh.Gaps(2) == 0);
+    hb = Packet(2, 105, {});
+    suh.ParsePacket(hb.data(), hb.size());
+    assert(suh.Gaps(2) == 4);
+    assert(suh.NextSeqno(2) == 105);
+    assert(parser.msgs.size() == 5);
+
+    // unsequenced messages on unit 0
+    std::string p5 = Packet(0, 0, {"\x97"});
+    suh.ParsePacket(p5.data(), p5.size());
+    suh.ParsePacket(p5.data(), p5.size());
+    assert(parser.msgs.size() == 7);
+    assert(parser.msgs[6].first == 0);
+  }
+
+  {
+    // Test routing units to shards
+    Parser parser, shard;
+    PitchSUH<Parser> suh(parser);
+    suh.SetUnitParser(3, shard);
+    std::string p1 = Packet(1, 1, {"\x21"});
+    std::string p2 = Packet(3, 1, {"\x21", "\x22"});
+    suh.ParsePacket(p1.data(), p1.size());
+    suh.ParsePacket(p2.data(), p2.size());
+    assert(parser.msgs.size() == 1);
+    assert(shard.msgs.size() == 2);
+  }
+
+  {
+    // Test truncated packets
+    Parser parser;
+    PitchSUH<Parser> suh(parser);
+    std::string p1 = Packet(1, 1, {"\x21", "\x22"});
+    suh.ParsePacket(p1.data(), p1.size() - 1);
+    assert(parser.msgs.size() == 1);
+    suh.ParsePacket(p1.data(), 4);
+    assert(parser.msgs.size() == 1);
+
+    // a count beyond the last message stops at the packet end
+    std::string p2 = Packet(1, 2, {"\x22", "\x23"});
+    p2[2] = 3;
+    std::vector<char> exact(p2.begin(), p2.end());
+    size_t n = suh.ParsePacket(exact.data(), exact.size());
+    assert(n == 2 && parser.msgs.size() == 3);
+
+    // a header length shorter than the header is rejected
+    std::string p3 = Packet(1, 4, {"\x21"});
+    p3[0] = 4;
+    n = suh.ParsePacket(p3.data(), p3.size());
+    assert(n == 0 && parser.msgs.size() == 3 && suh.NextSeqno(1) == 4);
+  }
+
+  return 0;
+}
@@ -22,6 +22,8 @@ SOFTWARE.
 
 #include "pitch.hpp"
 #include "feed.hpp"
+#include <cassert>
+#include <string>
 
 struct Handler {
   void OnQuote(OrderBook *book, bool top) { bp = book->GetBestPrice(); }
@@ -32,9 +34,72 @@ struct Handler {
     bp = book->GetBestPrice();
   }
 
+  static constexpr bool kBrokenTrades = true;
+  static constexpr bool kImbalances = true;
+  static constexpr bool kRetailInterest = true;
+  static constexpr bool kAttributions = true;
+
+  void OnBrokenTrade(uint64_t match) { broken = match; }
+
+  void OnImbalance(OrderBook *book, int64_t paired, int64_t imbalance,
+                   char direction, int64_t far, int64_t near, int64_t ref,
+                   char cross_type) {
+    this->paired = paired;
+    this->imbalance = direction == 'S' ? -imbalance : imbalance;
+    this->near = near;
+  }
+
+  void OnRetailInterest(OrderBook *book, char interest) {
+    this->interest = interest;
+  }
+
+  void OnAttribution(OrderBook *book, uint64_t ref, bool buy_sell, int64_t qty,
+                     int64_t price, uint32_t participant) {
+    this->participant = participant;
+  }
+
   BestPrice bp;
   int lastq = 0;
   int lastp = 0;
+  uint64_t broken = 0;
+  int64_t paired = 0;
+  int64_t imbalance = 0;
+  int64_t near = 0;
+  char interest = 0;
+  uint32_t participant = 0;
+};
+
+// Little endian message builder, fills in the length
+struct Msg {
+  Msg(uint8_t type) {
+    put8(0);
+    put8(type);
+    put32(0); // time offset
+  }
+  Msg &put8(uint8_t v) { return put(v, 1); }
+  Msg &put32(uint32_t v) { return put(v, 4); }
+  Msg &put64(uint64_t v) { return put(v, 8); }
+  Msg &put(uint64_t v, int n) {
+    for (int i = 0; i < n; ++i) {
+      s.push_back(v >> (8 * i));
+    }
+    s[0] = s.size();
+    return *this;
+  }
+  Msg &sym(std::string sym, size_t n = 8) {
+    sym.resize(n, ' ');
+    s += sym;
+    s[0] = s.size();
+    return *this;
+  }
+  const char *data() const { return s.data(); }
+  std::string s;
+};
+
+struct TimestampHandler : Handler {
+  static constexpr bool kTimestamps = true;
+  void OnTimestamp(uint64_t ns) { timestamp = ns; }
+  uint64_t timestamp = 0;
 };
 
 int main(int argc, char *argv[]) {
@@ -223,5 +288,133 @@ int main(int argc, char *argv[]) {
     assert(handler.lastp == 1);
   }
 
+  {
+    // Test timestamps from time messages and time offsets
+    TimestampHandler handler;
+    Feed<TimestampHandler> feed(handler, 100, false, false);
+    PitchParser<Feed<TimestampHandler>> parser(feed);
+    feed.Subscribe("A");
+    char time[] = {6, 0x20, char(0x98), char(0x85), 0, 0}; // 34200 s
+    parser.ParseMessage(0, time);
+    assert(handler.timestamp == 0);
+    char addl[] = {34,  0x21, 0x15, char(0xCD), 0x5B, 0x07, 1, 0,   0,   0,
+                   0,   0,    0,    0,          'B',  100,  0, 0,   0,   'A',
+                   ' ', ' ',  ' ',  ' ',        ' ',  1,    0, 0,   0,   0,
+                   0,   0,    0,    0};
+    parser.ParseMessage(0, addl);
+    assert(handler.timestamp == 34200ull * 1000000000 + 123456789);
+    assert(feed.Timestamp() == handler.timestamp);
+  }
+
+  {
+    // Test trade break, trading status, auctions and retail interest
+    Handler handler;
+    Feed<Handler> feed(handler, 100, false, false);
+    PitchParser<Feed<Handler>> parser(feed);
+    OrderBook &book = feed.Subscribe("A");
+    parser.ParseMessage(0, Msg(0x2C).put64(77).data());
+    assert(handler.broken == 77);
+    parser.ParseMessage(
+        0, Msg(0x31).sym("A").put8('H').put8('0').put(0, 6).data());
+    assert(book.GetTradingState() == 'H');
+    parser.ParseMessage(0, Msg(0x95)
+                               .sym("A")
+                               .put8('O')
+                               .put64(100000) // reference price
+                               .put32(300)    // buy shares
+                               .put32(500)    // sell shares
+                               .put64(101000) // indicative price
+                               .put64(102000) // auction only price
+                               .data());
+    assert(handler.paired == 300);
+    assert(handler.imbalance == -200);
+    assert(handler.near == 101000);
+    parser.ParseMessage(
+        0, Msg(0x96).sym("A").put8('O').put64(101000).put32(300).data());
+    assert(handler.lastq == 300);
+    assert(handler.lastp == 101000);
+    parser.ParseMessage(0, Msg(0x98).sym("A").put8('B').data());
+    assert(handler.interest == 'B');
+    parser.ParseMessage(0, Msg(0x2D).data());
+  }
+
+  {
+    // Test add order expanded with attribution
+    Handler handler;
+    Feed<Handler> feed(handler, 100, false, false);
+    PitchParser<Feed<Handler>> parser(feed);
+    feed.Subscribe("A");
+    parser.ParseMessage(0, Msg(0x2F)
+                               .put64(1)
+                               .put8('B')
+                               .put32(100)
+                               .sym("A")
+                               .put64(10)
+                               .put8(0)
+                               .sym("    ", 4)
+                               .data());
+    assert(handler.bp.bid == 10);
+    assert(handler.participant == 0);
+    parser.ParseMessage(0, Msg(0x2F)
+                               .put64(2)
+                               .put8('B')
+                               .put32(100)
+                               .sym("A")
+                               .put64(11)
+                               .put8(0)
+                               .sym("BATS", 4)
+                               .data());
+    assert(handler.bp.bid == 11);
+    assert(handler.participant == 0x42415453);
+    // no attribution for a rejected duplicate
+    parser.ParseMessage(0, Msg(0x2F)
+                               .put64(2)
+                               .put8('B')
+                               .put32(100)
+                               .sym("A")
+                               .put64(12)
+                               .put8(0)
+                               .sym("XXXX", 4)
+                               .data());
+    assert(handler.bp.bid == 11);
+    assert(handler.participant == 0x42415453);
+  }
+
+  {
+    // Test message layouts and length validation
+    using Parser = PitchParser<Feed<Handler>>;
+    static_assert(pitch::kLengths.length[0x21] == 34, "");
+    static_assert(pitch::kLengths.length[0x95] == 47, "");
+    static_assert(pitch::kLengths.length[0x99] == 0, "");
+    Msg update = Msg(0x98).sym("A").put8('B');
+    assert(Parser::Valid(update.data(), update.s.size()));
+    assert(!Parser::Valid(update.data(), update.s.size() - 1));
+    Msg status = Msg(0x31).sym("A").put8('H');
+    assert(!Parser::Valid(status.data(), status.s.size()));
+    assert(pitch::AddOrderShort::Symbol::Read(
+               Msg(0x22).put64(1).put8('B').put(1, 2).sym("AB", 6).data()) ==
+           0x4142202020202020);
+  }
+
+  {
+    // Test truncated messages in a packet are skipped and counted, and an
+    // over-counted packet ends at its length
+    Handler handler;
+    Feed<Handler> feed(handler, 100, false, false);
+    PitchParser<Feed<Handler>> parser(feed);
+    feed.Subscribe("A");
+    Msg add1 = Msg(0x21).put64(1).put8('B').put32(100).sym("A", 6).put64(10);
+    Msg add2 = Msg(0x21).put64(2).put8('B').put32(100);
+    Msg add3 = Msg(0x21).put64(3).put8('B').put32(100).sym("A", 6).put64(11);
+    std::string msgs = add1.put8(0).s + add2.s + add3.put8(0).s;
+    std::string packet(8, 0);
+    packet[0] = 8 + msgs.size();
+    packet[2] = 5; // count beyond the messages
+    packet += msgs;
+    parser.ParsePacket(packet.data(), packet.size());
+    assert(parser.Invalid() == 1 && feed.Size() == 2);
+    assert(handler.bp.bid == 11);
+  }
+
   return 0;
 }
@@ -0,0 +1,241 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+Parallel ITCH replay
+
+Every ITCH 5.0 message carries a stock locate and all per symbol state,
+including orders, is independent between locates. ParallelReplay splits
+a length prefixed ITCH stream by locate over a set of workers, each
+normally an Itch50Parser with its own Feed, and runs every worker on its
+own thread.
+
+A counting pass first assigns locates to workers, largest message count
+first to the least loaded worker. The splitting pass then runs on the
+calling thread and streams chunks of (seqno, offset) index entries to the
+workers through bounded SPSCQueues, so memory use does not grow with the
+file. A side finding its queue full or empty yields, the splitter and the
+workers may outnumber the cores. Messages with locate 0, the system
+events, go to every worker. Both passes stop at a message too short to
+hold a locate or running past the end of the stream.
+
+Sequence numbers are message positions in the stream, starting at 1.
+Worker output tagged with them can be put back in stream order with
+MergeBySeqno.
+ */
+
+#pragma once
+
+#include "spsc_queue.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <thread>
+#include <vector>
+
+template <typename Worker> class ParallelReplay {
+
+public:
+  static constexpr size_t kLocates = 65536;
+  static constexpr size_t kChunkSize = 4096;
+  static constexpr size_t kMaxChunks = 64;
+
+  ParallelReplay(const std::vector<Worker *> &workers)
+      : workers_(workers), parts_(kLocates, 0) {
+    for (size_t i = 0; i < workers.size(); ++i) {
+      queues_.emplace_back(new Queue(kMaxChunks));
+    }
+  }
+
+  // Assign locates to workers balancing message counts
+  void Balance(const char *buf, size_t len) {
+    std::vector<uint64_t> counts(kLocates, 0);
+    size_t i = 0, msg_len;
+    while ((msg_len = Length(buf, len, i)) != 0) {
+      counts[read16(buf + i + 3)]++;
+      i += msg_len + 2;
+    }
+    std::vector<uint32_t> locates(kLocates);
+    for (size_t i = 0; i < kLocates; ++i) {
+      locates[i] = i;
+    }
+    std::sort(locates.begin(), locates.end(),
+              [&](uint32_t a, uint32_t b) { return counts[a] > counts[b]; });
+    using Load = std::pair<uint64_t, size_t>;
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      loads.emplace(0, i);
+    }
+    for (uint32_t locate : locates) {
+      if (counts[locate] == 0) {
+        break;
+      }
+      Load load = loads.top();
+      loads.pop();
+      parts_[locate] = load.second;
+      load.first += counts[locate];
+      loads.push(load);
+    }
+  }
+
+  // Worker assigned to locate
+  size_t Partition(uint16_t locate) const { return parts_[locate]; }
+
+  // Replay the stream, returns number of messages
+  uint64_t Run(const char *buf, size_t len) {
+    Balance(buf, len);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      threads.emplace_back([this, buf, i] { Work(buf, i); });
+    }
+
+    std::vector<Chunk> chunks(workers_.size());
+    uint64_t seqno = 0;
+    size_t i = 0, msg_len;
+    while ((msg_len = Length(buf, len, i)) != 0) {
+      seqno++;
+      uint16_t locate = read16(buf + i + 3);
+      Entry entry{seqno, i + 2};
+      if (locate == 0) {
+        for (size_t j = 0; j < chunks.size(); ++j) {
+          Append(chunks, j, entry);
+        }
+      } else {
+        Append(chunks, parts_[locate], entry);
+      }
+      i += msg_len + 2;
+    }
+
+    for (size_t j = 0; j < chunks.size(); ++j) {
+      if (!chunks[j].empty()) {
+        Push(j, std::move(chunks[j]));
+      }
+      Push(j, Chunk()); // end of stream
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    return seqno;
+  }
+
+private:
+  struct Entry {
+    uint64_t seqno;
+    uint64_t offset;
+  };
+
+  using Chunk = std::vector<Entry>;
+
+  using Queue = SPSCQueue<Chunk>;
+
+  void Append(std::vector<Chunk> &chunks, size_t part, Entry entry) {
+    Chunk &chunk = chunks[part];
+    if (chunk.empty()) {
+      chunk.reserve(kChunkSize);
+    }
+    chunk.push_back(entry);
+    if (chunk.size() == kChunkSize) {
+      Push(part, std::move(chunk));
+      chunk = Chunk();
+    }
+  }
+
+  void Push(size_t part, Chunk &&chunk) {
+    Queue &q = *queues_[part];
+    while (!q.try_emplace(std::move(chunk))) {
+      std::this_thread::yield();
+    }
+  }
+
+  Chunk Pop(size_t part) {
+    Queue &q = *queues_[part];
+    Chunk *front;
+    while ((front = q.front()) == nullptr) {
+      std::this_thread::yield();
+    }
+    Chunk chunk = std::move(*front);
+    q.pop();
+    return chunk;
+  }
+
+  void Work(const char *buf, size_t part) {
+    Worker &worker = *workers_[part];
+    for (;;) {
+      Chunk chunk = Pop(part);
+      if (chunk.empty()) {
+        return;
+      }
+      for (const Entry &e : chunk) {
+        worker.ParseMessage(e.seqno, buf + e.offset);
+      }
+    }
+  }
+
+  // Length of the message at i, 0 if it runs past len or is too short to
+  // hold a locate
+  size_t Length(const char *buf, size_t len, size_t i) {
+    if (i + 2 > len) {
+      return 0;
+    }
+    size_t msg_len = read16(buf + i);
+    return msg_len < 3 || i + msg_len + 2 > len ? 0 : msg_len;
+  }
+
+  uint32_t read16(const void *buf) {
+    return __builtin_bswap16(*static_cast<const uint16_t *>(buf));
+  }
+
+  std::vector<Worker *> workers_;
+  std::vector<uint32_t> parts_;
+  std::vector<std::unique_ptr<Queue>> queues_;
+};
+
+// Merge per worker output, each sorted by its seqno member, into one
+// vector in sequence order
+template <typename T>
+std::vector<T> MergeBySeqno(const std::vector<std::vector<T>> &parts) {
+  using Head = std::pair<uint64_t, std::pair<size_t, size_t>>;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  size_t total = 0;
+  for (size_t i = 0; i < parts.size(); ++i) {
+    total += parts[i].size();
+    if (!parts[i].empty()) {
+      heads.emplace(parts[i][0].seqno, std::make_pair(i, 0));
+    }
+  }
+  std::vector<T> out;
+  out.reserve(total);
+  while (!heads.empty()) {
+    auto head = heads.top();
+    heads.pop();
+    size_t part = head.second.first;
+    size_t idx = head.second.second;
+    out.push_back(parts[part][idx]);
+    if (++idx < parts[part].size()) {
+      heads.emplace(parts[part][idx].seqno, std::make_pair(part, idx));
+    }
+  }
+  return out;
+}
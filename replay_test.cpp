@@ -0,0 +1,174 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "replay.hpp"
+#include "feed.hpp"
+#include "itch.hpp"
+#include <cassert>
+#include <memory>
+#include <random>
+#include <string>
+
+struct Event {
+  uint64_t seqno;
+  BestPrice bp;
+
+  bool operator==(const Event &other) const {
+    return seqno == other.seqno && bp.bid == other.bp.bid &&
+           bp.bidqty == other.bp.bidqty && bp.ask == other.bp.ask &&
+           bp.askqty == other.bp.askqty;
+  }
+};
+
+struct Handler {
+  void OnQuote(OrderBook *book, bool top) {
+    events.push_back(Event{seqno, book->GetBestPrice()});
+  }
+
+  void OnTrade(OrderBook *book, int64_t shares, int64_t price, bool top) {
+    OnQuote(book, top);
+  }
+
+  uint64_t seqno = 0;
+  std::vector<Event> events;
+};
+
+// Records the sequence number of the message being parsed for Handler
+struct Worker {
+  Worker() : feed(handler, 1024, true, true), parser(feed) {}
+
+  void ParseMessage(uint64_t seqno, const char *buf) {
+    handler.seqno = seqno;
+    parser.ParseMessage(seqno, buf);
+  }
+
+  Handler handler;
+  Feed<Handler> feed;
+  Itch50Parser<Feed<Handler>> parser;
+};
+
+static void put(std::string &s, uint64_t v, int n) {
+  for (int i = n - 1; i >= 0; --i) {
+    s.push_back(v >> (8 * i));
+  }
+}
+
+static void Append(std::string &s, const std::string &msg) {
+  put(s, msg.size(), 2);
+  s += msg;
+}
+
+static std::string Header(char type, uint16_t locate) {
+  std::string s(1, type);
+  put(s, locate, 2);
+  put(s, 0, 8);
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+
+  // Random add, execute and delete stream over 100 locates
+  std::mt19937 rng(1);
+  std::string stream;
+  std::vector<std::pair<uint64_t, uint16_t>> live;
+  std::string event = Header('S', 0);
+  event.push_back('O');
+  Append(stream, event);
+  for (uint64_t ref = 1; ref < 20000; ++ref) {
+    uint16_t locate = 1 + rng() % 100;
+    std::string add = Header('A', locate);
+    put(add, ref, 8);
+    add.push_back(rng() % 2 ? 'B' : 'S');
+    put(add, 1 + rng() % 100, 4);
+    add += "SYM" + std::to_string(1000 + locate) + " ";
+    put(add, 100 + rng() % 10, 4);
+    Append(stream, add);
+    live.emplace_back(ref, locate);
+    if (rng() % 2) {
+      size_t i = rng() % live.size();
+      std::string msg = Header(rng() % 2 ? 'D' : 'E', live[i].second);
+      put(msg, live[i].first, 8);
+      if (msg[0] == 'E') {
+        put(msg, 1, 4);
+        put(msg, ref, 8);
+      }
+      Append(stream, msg);
+      live[i] = live.back();
+      live.pop_back();
+    }
+  }
+
+  // Serial reference
+  Worker serial;
+  uint64_t seqno = 0;
+  for (size_t i = 0; i < stream.size();) {
+    size_t len = (uint8_t)stream[i] << 8 | (uint8_t)stream[i + 1];
+    serial.ParseMessage(++seqno, stream.data() + i + 2);
+    i += len + 2;
+  }
+  assert(serial.handler.events.size() > 20000);
+
+  for (size_t nthreads : {1, 2, 3, 8}) {
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<Worker *> ptrs;
+    for (size_t i = 0; i < nthreads; ++i) {
+      workers.emplace_back(new Worker());
+      ptrs.push_back(workers.back().get());
+    }
+    ParallelReplay<Worker> replay(ptrs);
+    uint64_t last = replay.Run(stream.data(), stream.size());
+    assert(last == seqno);
+
+    // every locate is owned by a single worker
+    std::vector<std::vector<Event>> parts;
+    size_t orders = 0;
+    for (size_t i = 0; i < nthreads; ++i) {
+      parts.push_back(workers[i]->handler.events);
+      orders += workers[i]->feed.Size();
+      if (nthreads > 1) {
+        assert(!parts.back().empty());
+      }
+    }
+    assert(orders == serial.feed.Size());
+    auto merged = MergeBySeqno(parts);
+    assert(merged == serial.handler.events);
+  }
+
+  {
+    // Both passes stop at a zero length message
+    std::string s;
+    for (uint16_t locate : {5, 5, 5, 6, 6}) {
+      Append(s, Header('S', locate) + "O");
+    }
+    s += std::string(2, 0);
+    for (int i = 0; i < 10; ++i) {
+      Append(s, Header('S', 9) + "O");
+    }
+    Worker w0, w1;
+    ParallelReplay<Worker> replay({&w0, &w1});
+    uint64_t n = replay.Run(s.data(), s.size());
+    assert(n == 5);
+    assert(replay.Partition(5) == 0 && replay.Partition(6) == 1);
+  }
+
+  return 0;
+}
@@ -0,0 +1,168 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+Message schemas
+
+Protocol message layouts are described once as types. A message derives
+from Message<Type, Length> and names each of its fields:
+
+  struct OrderDelete : Message<'D', 19> {
+    using Locate = BigEndian<OrderDelete, 1, uint16_t>;
+    using Ref = BigEndian<OrderDelete, 11, uint64_t>;
+  };
+
+  uint64_t ref = OrderDelete::Ref::Read(buf);
+
+Each field reads itself with a single load and byte swap and checks at
+compile time that it lies within its message. Fields that are not read
+cost nothing. MessageSet collects the messages of a protocol and builds a
+constexpr table of message lengths for validating input.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+template <uint8_t Type, size_t Length> struct Message {
+  static constexpr uint8_t kType = Type;
+  static constexpr size_t kLength = Length;
+};
+
+namespace schema {
+
+template <typename T> T Load(const char *buf) {
+  T v;
+  std::memcpy(&v, buf, sizeof(T));
+  return v;
+}
+
+inline uint8_t ByteSwap(uint8_t v) { return v; }
+inline uint16_t ByteSwap(uint16_t v) { return __builtin_bswap16(v); }
+inline uint32_t ByteSwap(uint32_t v) { return __builtin_bswap32(v); }
+inline uint64_t ByteSwap(uint64_t v) { return __builtin_bswap64(v); }
+
+template <typename M, size_t Offset, size_t Size> struct Field {
+  static_assert(Size > 0, "empty field");
+  static constexpr size_t kOffset = Offset;
+  static constexpr size_t kSize = Size;
+
+  // Called from Read, so it is checked once the message type is complete
+  static constexpr bool Check() {
+    static_assert(Offset + Size <= M::kLength, "field past end of message");
+    return true;
+  }
+};
+
+} // namespace schema
+
+// Integer stored big endian
+template <typename M, size_t Offset, typename T>
+struct BigEndian : schema::Field<M, Offset, sizeof(T)> {
+  using type = T;
+  static T Read(const char *msg) {
+    static_assert(BigEndian::Check(), "");
+    using U = typename std::make_unsigned<T>::type;
+    return T(schema::ByteSwap(schema::Load<U>(msg + Offset)));
+  }
+};
+
+// Integer stored little endian
+template <typename M, size_t Offset, typename T>
+struct LittleEndian : schema::Field<M, Offset, sizeof(T)> {
+  using type = T;
+  static T Read(const char *msg) {
+    static_assert(LittleEndian::Check(), "");
+    return schema::Load<T>(msg + Offset);
+  }
+};
+
+// 48 bit big endian integer, ITCH timestamps
+template <typename M, size_t Offset>
+struct BigEndian48 : schema::Field<M, Offset, 6> {
+  using type = uint64_t;
+  static uint64_t Read(const char *msg) {
+    static_assert(BigEndian48::Check(), "");
+    return uint64_t(schema::ByteSwap(schema::Load<uint16_t>(msg + Offset)))
+               << 32 |
+           schema::ByteSwap(schema::Load<uint32_t>(msg + Offset + 2));
+  }
+};
+
+template <typename M, size_t Offset> struct Char : schema::Field<M, Offset, 1> {
+  using type = char;
+  static char Read(const char *msg) {
+    static_assert(Char::Check(), "");
+    return msg[Offset];
+  }
+};
+
+// Space padded alphanumeric of up to 8 characters, read as a big endian
+// integer so that symbols compare like strings. Fields of up to 4
+// characters read as 32 bits.
+template <typename M, size_t Offset, size_t N>
+struct Alpha : schema::Field<M, Offset, N> {
+  static_assert(N <= 8, "alpha field longer than 8 characters");
+  using type = typename std::conditional<N <= 4, uint32_t, uint64_t>::type;
+  static type Read(const char *msg) {
+    static_assert(Alpha::Check(), "");
+    type v;
+    if (N < sizeof(type)) {
+      std::memset(&v, ' ', sizeof(type));
+    }
+    std::memcpy(&v, msg + Offset, N);
+    return schema::ByteSwap(v);
+  }
+};
+
+template <typename... Ms> struct MessageSet;
+
+template <> struct MessageSet<> {
+  static constexpr size_t Length(uint8_t type) { return 0; }
+};
+
+template <typename M, typename... Ms> struct MessageSet<M, Ms...> {
+  static_assert(MessageSet<Ms...>::Length(M::kType) == 0,
+                "duplicate message type");
+  static constexpr size_t Length(uint8_t type) {
+    return type == M::kType ? M::kLength : MessageSet<Ms...>::Length(type);
+  }
+};
+
+// Length of every message type in Set, 0 for unknown types
+template <typename Set> struct LengthTable {
+  constexpr LengthTable() : length() {
+    for (size_t i = 0; i < 256; ++i) {
+      length[i] = Set::Length(i);
+    }
+  }
+
+  // Known type and not truncated
+  constexpr bool Valid(uint8_t type, size_t len) const {
+    return length[type] != 0 && len >= length[type];
+  }
+
+  uint16_t length[256];
+};
@@ -0,0 +1,172 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+SoupBinTCP 3.0 client side decoder
+
+Each packet is a 2 byte big endian length, covering the type byte and the
+payload, followed by a 1 byte packet type. Sequenced data packets carry no
+sequence number, it is implied by the Login Accepted packet and counted
+from there.
+
+Messages are passed to Parser::ParseMessage as pointers into the receive
+buffer together with their sequence number. Messages that Parser::Valid
+rejects, truncated or of unknown type, use up their sequence number but
+are counted instead of parsed.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+template <typename Parser> class SoupBinTCP {
+
+public:
+  static constexpr size_t kSessionSize = 10;
+
+  SoupBinTCP(Parser &parser) : parser_(parser) {}
+
+  // Parse as many complete packets as possible, returns bytes consumed. The
+  // caller keeps the remainder and passes it again with more data.
+  size_t ParseStream(const char *buf, size_t len) {
+    size_t i = 0;
+    while (i + 2 <= len) {
+      size_t pkt_len = read16(buf + i);
+      if (i + 2 + pkt_len > len) {
+        break;
+      }
+      ParsePacket(buf + i + 2, pkt_len);
+      i += 2 + pkt_len;
+    }
+    return i;
+  }
+
+  // Parse a single packet, without the length field
+  void ParsePacket(const char *buf, size_t len) {
+    if (len == 0) {
+      return;
+    }
+    switch (buf[0]) {
+    case 'S':
+      if (Parser::Valid(buf + 1, len - 1)) {
+        parser_.ParseMessage(next_, buf + 1);
+      } else {
+        invalid_++;
+      }
+      next_++;
+      return;
+    case 'H':
+      return;
+    case 'A':
+      return LoginAccepted(buf, len);
+    case 'J':
+      reject_ = len > 1 ? buf[1] : '?';
+      return;
+    case 'Z':
+      end_of_session_ = true;
+      return;
+    }
+  }
+
+  // Sequence number of the next expected message
+  uint64_t NextSeqno() const { return next_; }
+
+  // Number of messages skipped as truncated or of unknown type
+  uint64_t Invalid() const { return invalid_; }
+
+  bool LoggedIn() const { return logged_in_; }
+
+  // Login reject reason code, 'A' not authorized or 'S' session not available
+  char Rejected() const { return reject_; }
+
+  bool EndOfSession() const { return end_of_session_; }
+
+  const char *Session() const { return session_; }
+
+  // Encode a Login Request packet into buf, returns its size. Session blank
+  // and seqno 0 requests the current session from its most recent message.
+  static size_t LoginRequest(char *buf, const std::string &username,
+                             const std::string &password,
+                             const std::string &session, uint64_t seqno) {
+    buf[0] = 0;
+    buf[1] = 47;
+    buf[2] = 'L';
+    pad(buf + 3, username, 6, false);
+    pad(buf + 9, password, 10, false);
+    pad(buf + 19, session, 10, true);
+    pad(buf + 29, std::to_string(seqno), 20, true);
+    return 49;
+  }
+
+  // Encode a Client Heartbeat packet into buf, returns its size
+  static size_t Heartbeat(char *buf) {
+    buf[0] = 0;
+    buf[1] = 1;
+    buf[2] = 'R';
+    return 3;
+  }
+
+  // Encode a Logout Request packet into buf, returns its size
+  static size_t LogoutRequest(char *buf) {
+    buf[0] = 0;
+    buf[1] = 1;
+    buf[2] = 'O';
+    return 3;
+  }
+
+private:
+  void LoginAccepted(const char *buf, size_t len) {
+    if (len < 1 + kSessionSize + 20) {
+      return;
+    }
+    std::memcpy(session_, buf + 1, kSessionSize);
+    uint64_t seqno = 0;
+    for (const char *p = buf + 11; p != buf + 31; ++p) {
+      if (*p >= '0' && *p <= '9') {
+        seqno = seqno * 10 + (*p - '0');
+      }
+    }
+    next_ = seqno;
+    logged_in_ = true;
+  }
+
+  static void pad(char *buf, const std::string &s, size_t n, bool right) {
+    size_t len = std::min(s.size(), n);
+    std::memset(buf, ' ', n);
+    std::memcpy(right ? buf + n - len : buf, s.data(), len);
+  }
+
+  uint32_t read16(const void *buf) {
+    return __builtin_bswap16(*static_cast<const uint16_t *>(buf));
+  }
+
+  Parser &parser_;
+  uint64_t next_ = 0;
+  uint64_t invalid_ = 0;
+  bool logged_in_ = false;
+  bool end_of_session_ = false;
+  char reject_ = 0;
+  char session_[kSessionSize] = {};
+};
@@ -0,0 +1,178 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "soupbintcp.hpp"
+#include <arpa/inet.h>
+#include <cassert>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+struct Parser {
+  static bool Valid(const char *buf, size_t len) { return len >= 2; }
+
+  void ParseMessage(uint64_t seqno, const char *buf) {
+    msgs.emplace_back(seqno, std::string(buf, 2));
+  }
+
+  std::vector<std::pair<uint64_t, std::string>> msgs;
+};
+
+static std::string Packet(char type, std::string payload) {
+  std::string s;
+  s.push_back((payload.size() + 1) >> 8);
+  s.push_back(payload.size() + 1);
+  s.push_back(type);
+  return s + payload;
+}
+
+int main(int argc, char *argv[]) {
+
+  {
+    // Test login, sequenced data and end of session
+    Parser parser;
+    SoupBinTCP<Parser> soup(parser);
+    std::string s = Packet('+', "debug") + Packet('A', "SESSION001" +
+                                                  std::string(18, ' ') + "42");
+    s += Packet('S', "A1") + Packet('H', "") + Packet('S', "E2");
+    size_t used = soup.ParseStream(s.data(), s.size());
+    assert(used == s.size());
+    assert(soup.LoggedIn());
+    assert(std::string(soup.Session(), 10) == "SESSION001");
+    assert(parser.msgs.size() == 2);
+    assert(parser.msgs[0] == std::make_pair(42ul, std::string("A1")));
+    assert(parser.msgs[1] == std::make_pair(43ul, std::string("E2")));
+
+    // partial packets are left for the next call
+    std::string t = Packet('S', "D3") + Packet('Z', "");
+    used = soup.ParseStream(t.data(), 3);
+    assert(used == 0);
+    used = soup.ParseStream(t.data(), 6);
+    assert(used == 5);
+    assert(parser.msgs.back() == std::make_pair(44ul, std::string("D3")));
+    used = soup.ParseStream(t.data() + 5, t.size() - 5);
+    assert(used == 3);
+    assert(soup.EndOfSession());
+
+    // too short for the parser, skipped and counted
+    std::string u = Packet('S', "") + Packet('S', "F") + Packet('S', "G6");
+    used = soup.ParseStream(u.data(), u.size());
+    assert(used == u.size());
+    assert(soup.Invalid() == 2);
+    assert(parser.msgs.back() == std::make_pair(47ul, std::string("G6")));
+  }
+
+  {
+    // Test login reject and request encoding
+    Parser parser;
+    SoupBinTCP<Parser> soup(parser);
+    std::string s = Packet('J', "A");
+    soup.ParseStream(s.data(), s.size());
+    assert(!soup.LoggedIn());
+    assert(soup.Rejected() == 'A');
+    char buf[64];
+    size_t n = SoupBinTCP<Parser>::LoginRequest(buf, "user", "pass", "", 1);
+    assert(n == 49);
+    assert(std::string(buf + 2, 47) ==
+           "Luser  pass                " + std::string(19, ' ') + "1");
+  }
+
+  {
+    // Test receiving over loopback TCP
+    int srv = socket(AF_INET, SOCK_STREAM, 0);
+    assert(srv != -1);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int err = bind(srv, (sockaddr *)&addr, sizeof(addr));
+    assert(err == 0);
+    socklen_t addrlen = sizeof(addr);
+    err = getsockname(srv, (sockaddr *)&addr, &addrlen);
+    assert(err == 0);
+    err = listen(srv, 1);
+    assert(err == 0);
+
+    const int count = 10000;
+    std::thread server([srv, count] {
+      int fd = accept(srv, nullptr, nullptr);
+      assert(fd != -1);
+      char login[64];
+      ssize_t r = recv(fd, login, 49, MSG_WAITALL);
+      assert(r == 49);
+      assert(login[2] == 'L');
+      std::string s =
+          Packet('A', "SESSION001" + std::string(19, ' ') + "1");
+      for (int i = 0; i < count; ++i) {
+        s += Packet('S', std::string(1, 'A' + i % 26) +
+                             std::string(i % 50 + 1, 'x'));
+      }
+      s += Packet('Z', "");
+      // send in odd sized chunks to split packets
+      for (size_t i = 0; i < s.size(); i += 1000) {
+        size_t n = std::min<size_t>(1000, s.size() - i);
+        r = send(fd, s.data() + i, n, 0);
+        assert(r == (ssize_t)n);
+      }
+      close(fd);
+    });
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    err = connect(fd, (sockaddr *)&addr, sizeof(addr));
+    assert(err == 0);
+    char buf[4096];
+    size_t n = SoupBinTCP<Parser>::LoginRequest(buf, "user", "pass", "", 1);
+    ssize_t sent = send(fd, buf, n, 0);
+    assert(sent == (ssize_t)n);
+
+    Parser parser;
+    SoupBinTCP<Parser> soup(parser);
+    size_t len = 0;
+    for (;;) {
+      ssize_t r = recv(fd, buf + len, sizeof(buf) - len, 0);
+      assert(r >= 0);
+      if (r == 0) {
+        break;
+      }
+      len += r;
+      size_t used = soup.ParseStream(buf, len);
+      std::memmove(buf, buf + used, len - used);
+      len -= used;
+    }
+    server.join();
+    close(fd);
+    close(srv);
+
+    assert(len == 0);
+    assert(soup.EndOfSession());
+    assert(parser.msgs.size() == count);
+    for (int i = 0; i < count; ++i) {
+      assert(parser.msgs[i].first == (uint64_t)i + 1);
+      assert(parser.msgs[i].second[0] == 'A' + i % 26);
+    }
+  }
+
+  return 0;
+}
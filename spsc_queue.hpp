@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+SPSCQueue
+
+Bounded single producer single consumer lock-free queue, for passing
+values between two threads such as the stages of a pipeline.
+
+The capacity is rounded up to a power of two so slots are found by
+masking free running indices. Each side owns one index and keeps a cached
+copy of the other side's, so the shared cache line of the other side is
+only read when the queue looks full to the producer or empty to the
+consumer. The two sides are on separate cache lines.
+
+emplace_n and consume_n move a batch of values with a single index update.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+template <typename T> class SPSCQueue {
+public:
+  explicit SPSCQueue(size_t capacity) {
+    if (capacity == 0) {
+      throw std::invalid_argument("SPSCQueue: capacity is zero");
+    }
+    capacity_ = 1;
+    while (capacity_ < capacity) {
+      capacity_ *= 2;
+    }
+    mask_ = capacity_ - 1;
+    size_t align = alignof(T) > kCacheLine ? alignof(T) : kCacheLine;
+    if (posix_memalign(reinterpret_cast<void **>(&slots_), align,
+                       capacity_ * sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+  }
+
+  ~SPSCQueue() {
+    while (front()) {
+      pop();
+    }
+    std::free(slots_);
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // Number of values, exact only when called from one of the two threads
+  // while the other is idle
+  size_t size() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  // Producer
+
+  // Construct a value, waiting for space
+  template <typename... Args> void emplace(Args &&... args) {
+    while (!try_emplace(std::forward<Args>(args)...)) {
+    }
+  }
+
+  // Construct a value, returns false if the queue is full
+  template <typename... Args> bool try_emplace(Args &&... args) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_cache_ == capacity_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head - tail_cache_ == capacity_) {
+        return false;
+      }
+    }
+    new (&slots_[head & mask_]) T(std::forward<Args>(args)...);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Construct up to n values, the i-th from f(i), and publish them at
+  // once. Returns the number of values added, less than n if the queue
+  // is too full.
+  template <typename F> size_t emplace_n(size_t n, F &&f) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (capacity_ - (head - tail_cache_) < n) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+    }
+    size_t free = capacity_ - (head - tail_cache_);
+    if (n > free) {
+      n = free;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      new (&slots_[(head + i) & mask_]) T(f(i));
+    }
+    head_.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+  // Consumer
+
+  // Oldest value or nullptr if empty
+  T *front() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_cache_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail == head_cache_) {
+        return nullptr;
+      }
+    }
+    return &slots_[tail & mask_];
+  }
+
+  // Remove the value returned by front, which must not be nullptr
+  void pop() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    slots_[tail & mask_].~T();
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  // Pass up to n of the oldest values to f(T &) and remove them at once.
+  // Returns the number of values consumed.
+  template <typename F> size_t consume_n(size_t n, F &&f) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (head_cache_ - tail < n) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+    }
+    size_t available = head_cache_ - tail;
+    if (n > available) {
+      n = available;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      T &value = slots_[(tail + i) & mask_];
+      f(value);
+      value.~T();
+    }
+    tail_.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+private:
+  SPSCQueue(const SPSCQueue &) = delete;
+  SPSCQueue &operator=(const SPSCQueue &) = delete;
+
+  static constexpr size_t kCacheLine = 64;
+
+  size_t capacity_;
+  size_t mask_;
+  T *slots_ = nullptr;
+  char pad0_[kCacheLine];
+  // Written by the producer
+  std::atomic<size_t> head_{0};
+  size_t tail_cache_ = 0;
+  char pad1_[kCacheLine];
+  // Written by the consumer
+  std::atomic<size_t> tail_{0};
+  size_t head_cache_ = 0;
+  char pad2_[kCacheLine];
+};
@@ -0,0 +1,148 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "spsc_queue.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+struct Counted {
+  Counted(int v) : value(v) { live++; }
+  Counted(const Counted &other) : value(other.value) { live++; }
+  ~Counted() { live--; }
+
+  int value;
+  static int live;
+};
+
+int Counted::live = 0;
+
+static void TestBasic() {
+  SPSCQueue<Counted> q(5);
+  assert(q.capacity() == 8);
+  assert(q.empty() && q.front() == nullptr);
+  for (int i = 0; i < 8; ++i) {
+    bool pushed = q.try_emplace(i);
+    assert(pushed);
+  }
+  bool pushed = q.try_emplace(8);
+  assert(!pushed);
+  assert(q.size() == 8 && Counted::live == 8);
+  // Wrap around a few times
+  for (int i = 0; i < 100; ++i) {
+    assert(q.front()->value == i);
+    q.pop();
+    q.emplace(i + 8);
+  }
+  size_t n = q.emplace_n(4, [](size_t i) { return Counted(int(i)); });
+  assert(n == 0);
+  int next = 100;
+  n = q.consume_n(3, [&](Counted &c) {
+    assert(c.value == next);
+    next++;
+  });
+  assert(n == 3);
+  n = q.emplace_n(4, [](size_t i) { return Counted(1000 + int(i)); });
+  assert(n == 3);
+  n = q.consume_n(100, [&](Counted &c) {
+    if (next < 108) {
+      assert(c.value == next);
+    } else {
+      assert(c.value == 1000 + next - 108);
+    }
+    next++;
+  });
+  assert(n == 8);
+  assert(q.empty());
+  assert(Counted::live == 0);
+  q.emplace(1);
+  q.emplace(2);
+}
+
+// Values left in the queue are destroyed with it
+static void TestDestroy() {
+  assert(Counted::live == 0);
+  {
+    SPSCQueue<Counted> q(16);
+    q.emplace(1);
+    q.emplace(2);
+  }
+  assert(Counted::live == 0);
+  {
+    SPSCQueue<std::unique_ptr<std::string>> q(4);
+    q.emplace(new std::string("leak"));
+  }
+}
+
+// Single and batched transfer between two threads, yielding when stalled
+// as they may share a core
+static void TestThreads(bool batch) {
+  const uint64_t count = 100000;
+  SPSCQueue<uint64_t> q(1000);
+  std::thread producer([&] {
+    uint64_t i = 0;
+    while (i < count) {
+      size_t n = 0;
+      if (batch) {
+        n = q.emplace_n(std::min<uint64_t>(count - i, 64),
+                        [i](size_t j) { return i + j; });
+      } else if (q.try_emplace(i)) {
+        n = 1;
+      }
+      if (n == 0) {
+        std::this_thread::yield();
+      }
+      i += n;
+    }
+  });
+  uint64_t next = 0;
+  while (next < count) {
+    size_t n = 0;
+    if (batch) {
+      n = q.consume_n(64, [&](uint64_t v) {
+        assert(v == next);
+        next++;
+      });
+    } else if (uint64_t *v = q.front()) {
+      assert(*v == next);
+      next++;
+      q.pop();
+      n = 1;
+    }
+    if (n == 0) {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  assert(q.empty());
+}
+
+int main(int argc, char *argv[]) {
+  TestBasic();
+  TestDestroy();
+  TestThreads(false);
+  TestThreads(true);
+  return 0;
+}
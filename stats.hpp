@@ -0,0 +1,196 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+Feed statistics
+
+Parsers and Feed take a Stats policy as template parameter. NullStats
+is the default and compiles to nothing. SharedStats records into a
+FeedStats struct, normally placed in a POSIX shared memory segment by
+StatsSegment so that an external process (see stats_dump.cpp) can read
+the counters while the feed is running.
+
+There is a single writer, the feed thread. Counters are updated with
+relaxed load/store pairs, no locked instructions are used.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <type_traits>
+#include <unistd.h>
+
+struct alignas(64) FeedStats {
+  static constexpr uint64_t kMagic = 0x5350415254414e31; // "SPARTAN1"
+  static constexpr uint64_t kVersion = 1;
+  static constexpr size_t kTypes = 256;
+  static constexpr size_t kLatencyBuckets = 32; // log2 of ticks
+  static constexpr size_t kProbeBuckets = 16;   // probe length, last is >=
+
+  using Counter = std::atomic<uint64_t>;
+  static_assert(sizeof(Counter) == 8, "");
+
+  // Header, written once by the creator
+  uint64_t magic;
+  uint64_t version;
+  uint64_t size;
+
+  // Parser, indexed by message type
+  alignas(64) Counter messages[kTypes];
+  Counter latency[kTypes][kLatencyBuckets];
+
+  // Feed, order map
+  alignas(64) Counter lookups;
+  Counter misses;
+  Counter unknown_refs;
+  Counter duplicate_refs;
+  Counter probes;
+  Counter probe_max;
+  Counter probe_hist[kProbeBuckets];
+};
+
+static_assert(std::is_standard_layout<FeedStats>::value, "");
+
+class NullStats {
+public:
+  static constexpr bool enabled = false;
+
+  uint64_t Start() const { return 0; }
+  void Message(uint8_t type, uint64_t start) {}
+  void Lookup(size_t probes) {}
+  void Miss(bool unknown) {}
+  void DuplicateRef() {}
+};
+
+class SharedStats {
+public:
+  static constexpr bool enabled = true;
+
+  explicit SharedStats(FeedStats *stats) : stats_(stats) {}
+
+  uint64_t Start() const { return __builtin_ia32_rdtsc(); }
+
+  void Message(uint8_t type, uint64_t start) {
+    uint64_t ticks = __builtin_ia32_rdtsc() - start;
+    size_t bucket = ticks ? 64 - __builtin_clzll(ticks) : 0;
+    if (bucket >= FeedStats::kLatencyBuckets) {
+      bucket = FeedStats::kLatencyBuckets - 1;
+    }
+    inc(stats_->messages[type]);
+    inc(stats_->latency[type][bucket]);
+  }
+
+  void Lookup(size_t probes) {
+    inc(stats_->lookups);
+    inc(stats_->probes, probes);
+    if (probes > stats_->probe_max.load(std::memory_order_relaxed)) {
+      stats_->probe_max.store(probes, std::memory_order_relaxed);
+    }
+    if (probes >= FeedStats::kProbeBuckets) {
+      probes = FeedStats::kProbeBuckets - 1;
+    }
+    inc(stats_->probe_hist[probes]);
+  }
+
+  void Miss(bool unknown) {
+    inc(stats_->lookups);
+    inc(stats_->misses);
+    if (unknown) {
+      inc(stats_->unknown_refs);
+    }
+  }
+
+  void DuplicateRef() { inc(stats_->duplicate_refs); }
+
+private:
+  static void inc(FeedStats::Counter &c, uint64_t n = 1) {
+    // Single writer, avoid the locked add
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  FeedStats *stats_;
+};
+
+class StatsSegment {
+public:
+  // Create (and zero) or attach to the shared memory segment name
+  StatsSegment(const std::string &name, bool create = true)
+      : name_(name), create_(create) {
+    int fd = shm_open(name.c_str(), create ? O_RDWR | O_CREAT : O_RDONLY,
+                      0644);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), "shm_open");
+    }
+    if (create && ftruncate(fd, sizeof(FeedStats)) == -1) {
+      int err = errno;
+      close(fd);
+      throw std::system_error(err, std::system_category(), "ftruncate");
+    }
+    void *p = mmap(nullptr, sizeof(FeedStats),
+                   create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                   fd, 0);
+    int err = errno;
+    close(fd);
+    if (p == MAP_FAILED) {
+      throw std::system_error(err, std::system_category(), "mmap");
+    }
+    stats_ = static_cast<FeedStats *>(p);
+    if (create) {
+      std::memset(p, 0, sizeof(FeedStats));
+      stats_->version = FeedStats::kVersion;
+      stats_->size = sizeof(FeedStats);
+      std::atomic_thread_fence(std::memory_order_release);
+      stats_->magic = FeedStats::kMagic;
+    } else if (stats_->magic != FeedStats::kMagic ||
+               stats_->version != FeedStats::kVersion ||
+               stats_->size != sizeof(FeedStats)) {
+      munmap(p, sizeof(FeedStats));
+      throw std::runtime_error("incompatible stats segment " + name);
+    }
+  }
+
+  ~StatsSegment() {
+    munmap(stats_, sizeof(FeedStats));
+    if (create_) {
+      shm_unlink(name_.c_str());
+    }
+  }
+
+  FeedStats *get() const { return stats_; }
+
+private:
+  StatsSegment(const StatsSegment &) = delete;
+  StatsSegment &operator=(const StatsSegment &) = delete;
+
+  std::string name_;
+  bool create_;
+  FeedStats *stats_ = nullptr;
+};
@@ -0,0 +1,96 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+// Print the statistics recorded by a running feed, see stats.hpp
+
+#include "stats.hpp"
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+static uint64_t get(const FeedStats::Counter &c) {
+  return c.load(std::memory_order_relaxed);
+}
+
+static void dump(const FeedStats &stats) {
+  cout << "type     count    latency log2(ticks) histogram" << endl;
+  for (size_t t = 0; t < FeedStats::kTypes; ++t) {
+    uint64_t count = get(stats.messages[t]);
+    if (count == 0) {
+      continue;
+    }
+    if (t >= 0x20 && t < 0x7f) {
+      cout << "'" << (char)t << "' ";
+    } else {
+      cout << "0x" << hex << setw(2) << setfill('0') << t << dec
+           << setfill(' ');
+    }
+    cout << setw(12) << count;
+    for (size_t b = 0; b < FeedStats::kLatencyBuckets; ++b) {
+      uint64_t n = get(stats.latency[t][b]);
+      if (n != 0) {
+        cout << " " << b << ":" << n;
+      }
+    }
+    cout << endl;
+  }
+
+  uint64_t lookups = get(stats.lookups);
+  uint64_t misses = get(stats.misses);
+  uint64_t hits = lookups - misses;
+  cout << "lookups " << lookups << " misses " << misses << " unknown refs "
+       << get(stats.unknown_refs) << " duplicate refs "
+       << get(stats.duplicate_refs) << endl;
+  cout << "probe mean "
+       << (hits ? (double)get(stats.probes) / hits : 0.0) << " max "
+       << get(stats.probe_max) << " histogram";
+  for (size_t b = 0; b < FeedStats::kProbeBuckets; ++b) {
+    cout << " " << get(stats.probe_hist[b]);
+  }
+  cout << endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    cerr << "usage: " << argv[0] << " SHM_NAME [INTERVAL_SECONDS]" << endl;
+    return 1;
+  }
+
+  try {
+    StatsSegment segment(argv[1], false);
+    int interval = argc > 2 ? atoi(argv[2]) : 0;
+
+    dump(*segment.get());
+    while (interval > 0) {
+      std::this_thread::sleep_for(std::chrono::seconds(interval));
+      cout << endl;
+      dump(*segment.get());
+    }
+  } catch (const std::exception &e) {
+    cerr << argv[0] << ": " << e.what() << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,91 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+TSC clock
+
+Converts time stamp counter readings to wall clock time. Reading the TSC
+takes a few nanoseconds and no system call, so it can be done on the hot
+path and converted later by another thread.
+
+The tick rate is measured against CLOCK_REALTIME the way itch.cpp does,
+over the whole time since the clock was created so it gets more precise
+the longer it runs. Each Calibrate also moves the reference point to the
+current wall clock time, so adjustments of the system clock are followed.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+
+class TscClock {
+public:
+  static uint64_t Now() { return __builtin_ia32_rdtsc(); }
+
+  TscClock() {
+    Sample(start_tsc_, start_ns_);
+    tsc_ = start_tsc_;
+    ns_ = start_ns_;
+  }
+
+  // Measure the rate since construction, needs some time to have passed,
+  // a few milliseconds give a rate within a few parts per million
+  void Calibrate() {
+    Sample(tsc_, ns_);
+    if (ns_ > start_ns_ && tsc_ > start_tsc_) {
+      ticks_per_ns_ = double(tsc_ - start_tsc_) / (ns_ - start_ns_);
+    }
+  }
+
+  // Nanoseconds since the epoch at the TSC reading tsc
+  uint64_t ToNanos(uint64_t tsc) const {
+    return ns_ + int64_t(int64_t(tsc - tsc_) / ticks_per_ns_);
+  }
+
+  // TSC reading of the last calibration
+  uint64_t Calibrated() const { return tsc_; }
+
+  double TicksPerNs() const { return ticks_per_ns_; }
+
+private:
+  // Read both clocks, the TSC halfway through the fastest of a few
+  // clock_gettime calls
+  static void Sample(uint64_t &tsc, uint64_t &ns) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 5; ++i) {
+      timespec ts;
+      uint64_t start = Now();
+      clock_gettime(CLOCK_REALTIME, &ts);
+      uint64_t stop = Now();
+      if (i == 0 || stop - start < best) {
+        best = stop - start;
+        tsc = start + best / 2;
+        ns = uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+      }
+    }
+  }
+
+  uint64_t start_tsc_ = 0, start_ns_ = 0; // first sample
+  uint64_t tsc_ = 0, ns_ = 0;             // last sample
+  double ticks_per_ns_ = 1.0;
+};
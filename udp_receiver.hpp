@@ -0,0 +1,276 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+UDP multicast receiver
+
+Receives datagrams with recvmmsg, up to a batch per system call, into a
+preallocated ring of cache line aligned slots and passes each one to
+Handler::ParsePacket(const char *, size_t), normally MoldUDP64, PitchSUH
+or a LineArbiter adapter. Packets stay valid in the ring until it wraps,
+that is for at least Slots() - Batch() further packets. Datagrams larger
+than a slot are truncated by the kernel, they are counted in Truncated()
+and not passed on.
+
+Optionally the kernel timestamps every datagram on receive
+(SO_TIMESTAMPING software timestamps), available from Timestamp() while
+the handler runs, and the socket busy polls the device queue
+(SO_BUSY_POLL). Run either blocks in the kernel or spins on non blocking
+receives.
+
+Errors setting up the socket throw std::system_error.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <linux/net_tstamp.h>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <system_error>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// Open a UDP socket receiving datagrams sent to address:port. A multicast
+// group is joined on the interface with address iface, a unicast address
+// is bound directly. Returns the socket.
+inline int OpenUdpSocket(const std::string &address, uint16_t port,
+                         const std::string &iface = "0.0.0.0") {
+  auto fail = [](int fd, const std::string &what) {
+    int err = errno;
+    if (fd != -1) {
+      close(fd);
+    }
+    throw std::system_error(err, std::system_category(), what);
+  };
+  in_addr addr, ifaddr;
+  if (inet_aton(address.c_str(), &addr) == 0 ||
+      inet_aton(iface.c_str(), &ifaddr) == 0) {
+    errno = EINVAL;
+    fail(-1, "invalid address " + address + " " + iface);
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1) {
+    fail(fd, "socket");
+  }
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+    fail(fd, "SO_REUSEADDR");
+  }
+  sockaddr_in sa = {};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr = addr;
+  if (bind(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) == -1) {
+    fail(fd, "bind");
+  }
+  if (IN_MULTICAST(ntohl(addr.s_addr))) {
+    ip_mreq mreq = {};
+    mreq.imr_multiaddr = addr;
+    mreq.imr_interface = ifaddr;
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) ==
+        -1) {
+      fail(fd, "IP_ADD_MEMBERSHIP");
+    }
+  }
+  return fd;
+}
+
+template <typename Handler> class UdpReceiver {
+
+public:
+  static constexpr size_t kBatch = 64;
+  static constexpr size_t kSlots = 1024;
+  static constexpr size_t kSlotSize = 2048;
+
+  // Slot size is rounded up to a multiple of the cache line
+  UdpReceiver(Handler &handler, size_t batch = kBatch, size_t slots = kSlots,
+              size_t slot_size = kSlotSize)
+      : handler_(handler), batch_(std::max<size_t>(batch, 1)),
+        slots_(std::max(slots, batch_)),
+        slot_size_((std::max<size_t>(slot_size, 1) + 63) & ~size_t(63)),
+        msgs_(batch_), iovs_(batch_), control_(batch_) {
+    void *ring = nullptr;
+    if (posix_memalign(&ring, 64, slots_ * slot_size_) != 0) {
+      throw std::bad_alloc();
+    }
+    ring_.reset(static_cast<char *>(ring));
+  }
+
+  ~UdpReceiver() {
+    if (fd_ != -1) {
+      close(fd_);
+    }
+  }
+
+  // Receive datagrams sent to address:port. A multicast group is joined on
+  // the interface with address iface, a unicast address is bound directly.
+  void Open(const std::string &address, uint16_t port,
+            const std::string &iface = "0.0.0.0") {
+    if (fd_ != -1) {
+      close(fd_);
+      fd_ = -1;
+    }
+    fd_ = OpenUdpSocket(address, port, iface);
+  }
+
+  // Kernel software receive timestamps
+  void EnableTimestamps() {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    SetOption(SOL_SOCKET, SO_TIMESTAMPING, flags, "SO_TIMESTAMPING");
+    timestamps_ = true;
+  }
+
+  // Busy poll the device queue for up to usec when no data is ready
+  void SetBusyPoll(int usec) {
+    SetOption(SOL_SOCKET, SO_BUSY_POLL, usec, "SO_BUSY_POLL");
+  }
+
+  void SetReceiveBuffer(int bytes) {
+    SetOption(SOL_SOCKET, SO_RCVBUF, bytes, "SO_RCVBUF");
+  }
+
+  // Receive one batch and pass it to the handler, returns number of
+  // datagrams. Without wait returns 0 immediately if none are queued.
+  size_t Poll(bool wait = false) {
+    size_t pos = pos_;
+    size_t n = std::min(batch_, slots_ - pos);
+    for (size_t i = 0; i < n; ++i) {
+      iovs_[i].iov_base = ring_.get() + (pos + i) * slot_size_;
+      iovs_[i].iov_len = slot_size_;
+      msghdr &hdr = msgs_[i].msg_hdr;
+      hdr = msghdr();
+      hdr.msg_iov = &iovs_[i];
+      hdr.msg_iovlen = 1;
+      if (timestamps_) {
+        hdr.msg_control = control_[i].data;
+        hdr.msg_controllen = sizeof(control_[i].data);
+      }
+    }
+    int flags = wait ? MSG_WAITFORONE : MSG_DONTWAIT;
+    int count = recvmmsg(fd_, msgs_.data(), n, flags, nullptr);
+    if (count <= 0) {
+      if (count == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+          errno != EINTR) {
+        Throw("recvmmsg");
+      }
+      return 0;
+    }
+    for (int i = 0; i < count; ++i) {
+      if (msgs_[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        truncated_++;
+        continue;
+      }
+      if (timestamps_) {
+        timestamp_ = ReadTimestamp(msgs_[i].msg_hdr);
+      }
+      handler_.ParsePacket(static_cast<const char *>(iovs_[i].iov_base),
+                           msgs_[i].msg_len);
+    }
+    packets_ += count;
+    pos_ = (pos + count) % slots_;
+    return count;
+  }
+
+  // Receive until stop is set. Spinning never blocks in the kernel and
+  // trades a core for lower latency, otherwise stop is checked at least
+  // every 100 ms.
+  void Run(const std::atomic<bool> &stop, bool spin = false) {
+    if (!spin) {
+      timeval tv = {0, 100000};
+      SetOption(SOL_SOCKET, SO_RCVTIMEO, tv, "SO_RCVTIMEO");
+    }
+    while (!stop.load(std::memory_order_relaxed)) {
+      Poll(!spin);
+    }
+  }
+
+  // Receive time in nanoseconds since the epoch of the packet being
+  // handled, 0 without timestamps
+  uint64_t Timestamp() const { return timestamp_; }
+
+  uint64_t Packets() const { return packets_; }
+  // Datagrams dropped for not fitting in a slot
+  uint64_t Truncated() const { return truncated_; }
+  size_t Batch() const { return batch_; }
+  size_t Slots() const { return slots_; }
+  size_t SlotSize() const { return slot_size_; }
+  int Fd() const { return fd_; }
+
+private:
+  UdpReceiver(const UdpReceiver &) = delete;
+  UdpReceiver &operator=(const UdpReceiver &) = delete;
+
+  struct Free {
+    void operator()(char *p) const { free(p); }
+  };
+
+  struct Control {
+    alignas(cmsghdr) char data[CMSG_SPACE(sizeof(timespec) * 3)];
+  };
+
+  uint64_t ReadTimestamp(msghdr &hdr) {
+    for (cmsghdr *c = CMSG_FIRSTHDR(&hdr); c; c = CMSG_NXTHDR(&hdr, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPING) {
+        timespec ts[3];
+        std::memcpy(ts, CMSG_DATA(c), sizeof(ts));
+        return uint64_t(ts[0].tv_sec) * 1000000000 + ts[0].tv_nsec;
+      }
+    }
+    return 0;
+  }
+
+  template <typename T>
+  void SetOption(int level, int name, const T &value, const char *what) {
+    if (setsockopt(fd_, level, name, &value, sizeof(value)) == -1) {
+      Throw(what);
+    }
+  }
+
+  static void Throw(const char *what) {
+    throw std::system_error(errno, std::system_category(), what);
+  }
+
+  Handler &handler_;
+  const size_t batch_;
+  const size_t slots_;
+  const size_t slot_size_;
+  std::unique_ptr<char[], Free> ring_;
+  std::vector<mmsghdr> msgs_;
+  std::vector<iovec> iovs_;
+  std::vector<Control> control_;
+  int fd_ = -1;
+  bool timestamps_ = false;
+  size_t pos_ = 0;
+  uint64_t timestamp_ = 0;
+  uint64_t packets_ = 0;
+  uint64_t truncated_ = 0;
+};
@@ -0,0 +1,191 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "moldudp64.hpp"
+#include "udp_receiver.hpp"
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct Handler {
+  void ParsePacket(const char *buf, size_t len) {
+    packets.emplace_back(buf, std::string(buf, len));
+  }
+
+  std::vector<std::pair<const char *, std::string>> packets;
+};
+
+struct Parser {
+  static bool Valid(const char *buf, size_t len) { return len > 0; }
+
+  void ParseMessage(uint64_t seqno, const char *buf) { seqnos.push_back(seqno); }
+
+  std::vector<uint64_t> seqnos;
+};
+
+// Publishes datagrams to address:port over loopback
+struct Publisher {
+  Publisher(const std::string &address, uint16_t port) {
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(fd != -1);
+    in_addr lo;
+    inet_aton("127.0.0.1", &lo);
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &lo, sizeof(lo));
+    unsigned char loop = 1;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(port);
+    inet_aton(address.c_str(), &dst.sin_addr);
+  }
+
+  ~Publisher() { close(fd); }
+
+  bool Send(const std::string &s) {
+    return sendto(fd, s.data(), s.size(), 0,
+                  reinterpret_cast<const sockaddr *>(&dst),
+                  sizeof(dst)) == ssize_t(s.size());
+  }
+
+  int fd;
+  sockaddr_in dst = {};
+};
+
+template <typename Receiver> static size_t Drain(Receiver &rx, size_t want) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  size_t calls = 0;
+  while (rx.Packets() < want && std::chrono::steady_clock::now() < deadline) {
+    if (rx.Poll() > 0) {
+      calls++;
+    }
+  }
+  return calls;
+}
+
+static std::string MoldPacket(uint64_t seqno) {
+  std::string s = "SESSION001";
+  for (int i = 7; i >= 0; --i) {
+    s.push_back(seqno >> (8 * i));
+  }
+  s += std::string("\0\1\0\1A", 5);
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+  const uint16_t port = 31000 + getpid() % 1000;
+
+  // Loopback multicast needs a multicast capable lo, fall back to unicast
+  std::string address = "239.255.0.1";
+  {
+    Handler handler;
+    UdpReceiver<Handler> rx(handler);
+    try {
+      rx.Open(address, port, "127.0.0.1");
+      Publisher pub(address, port);
+      if (!pub.Send("probe") || Drain(rx, 1) == 0) {
+        address = "127.0.0.1";
+      }
+    } catch (const std::system_error &e) {
+      address = "127.0.0.1";
+    }
+  }
+  std::cout << "testing over " << address << std::endl;
+
+  {
+    // Test batched receive into the ring with timestamps
+    Handler handler;
+    UdpReceiver<Handler> rx(handler, 16, 64);
+    rx.Open(address, port, "127.0.0.1");
+    rx.EnableTimestamps();
+    try {
+      rx.SetBusyPoll(50);
+    } catch (const std::system_error &e) {
+      // needs CAP_NET_ADMIN on some kernels
+    }
+    Publisher pub(address, port);
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t start = uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+    for (int i = 0; i < 100; ++i) {
+      bool sent = pub.Send(std::to_string(i));
+      assert(sent);
+    }
+    size_t calls = Drain(rx, 100);
+    assert(rx.Packets() == 100);
+    assert(handler.packets.size() == 100);
+    assert(calls < 100); // more than one datagram per system call
+    assert(rx.Timestamp() >= start);
+    assert(rx.Timestamp() < start + 10000000000ull);
+    for (size_t i = 0; i < 100; ++i) {
+      auto &p = handler.packets[i];
+      assert(p.second == std::to_string(i));
+      assert(reinterpret_cast<uintptr_t>(p.first) % 64 == 0);
+    }
+    // the ring wrapped around
+    assert(handler.packets[0].first == handler.packets[64].first);
+  }
+
+  {
+    // Test datagrams larger than a slot are counted and dropped
+    Handler handler;
+    UdpReceiver<Handler> rx(handler, 16, 64, 100);
+    assert(rx.SlotSize() == 128);
+    rx.Open(address, port, "127.0.0.1");
+    Publisher pub(address, port);
+    bool sent = pub.Send(std::string(128, 'a'));
+    sent = pub.Send(std::string(129, 'b')) && sent;
+    sent = pub.Send(std::string(1, 'c')) && sent;
+    assert(sent);
+    Drain(rx, 3);
+    assert(rx.Packets() == 3 && rx.Truncated() == 1);
+    assert(handler.packets.size() == 2);
+    assert(handler.packets[0].second == std::string(128, 'a'));
+    assert(handler.packets[1].second == "c");
+  }
+
+  {
+    // Test feeding a framing decoder from a receive loop on its own thread
+    Parser parser;
+    MoldUDP64<Parser> mold(parser);
+    UdpReceiver<MoldUDP64<Parser>> rx(mold);
+    rx.Open(address, port, "127.0.0.1");
+    std::atomic<bool> stop(false);
+    std::thread t([&] { rx.Run(stop, true); });
+    Publisher pub(address, port);
+    for (uint64_t seqno = 1; seqno <= 50; ++seqno) {
+      pub.Send(MoldPacket(seqno));
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (rx.Packets() < 50 && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::yield();
+    }
+    stop = true;
+    t.join();
+    assert(parser.seqnos.size() == 50);
+    assert(mold.NextSeqno() == 51);
+  }
+
+  return 0;
+}
@@ -0,0 +1,542 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+/*
+io_uring receive and file replay backends
+
+IoUring is a minimal ring built directly on the io_uring system calls,
+no liburing required. With SQ polling a kernel thread picks up new
+submissions, and completions are always read from the shared completion
+ring, so a busy feed thread makes no system calls at all.
+
+UringReceiver keeps a multishot receive armed on a UDP socket. The kernel
+picks receive buffers from a group of provided buffers, each completion
+carries one datagram which is passed to Handler::ParsePacket and its
+buffer is then handed straight back to the kernel. Buffers are provided
+with IORING_OP_PROVIDE_BUFFERS rather than a registered buffer ring,
+which is not reliable on all kernels.
+
+UringFileReader replays a file through a ring of registered buffers,
+keeping reads in flight ahead of the parser. Like GzipReader, messages
+straddling two buffers are completed in the headroom of the second.
+
+Kernels without io_uring, or with it disabled, make the constructors
+throw std::system_error.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+class IoUring {
+public:
+  IoUring(unsigned entries, bool sqpoll = false, unsigned sqpoll_idle = 1000) {
+    io_uring_params p = {};
+    if (sqpoll) {
+      p.flags |= IORING_SETUP_SQPOLL;
+      p.sq_thread_idle = sqpoll_idle; // ms
+    }
+    fd_ = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd_ < 0) {
+      Throw("io_uring_setup");
+    }
+    sqpoll_ = sqpoll;
+    sq_entries_ = p.sq_entries;
+
+    sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+      sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+    sq_ptr_ = Map(sq_size_, IORING_OFF_SQ_RING);
+    cq_ptr_ = single ? sq_ptr_ : Map(cq_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(Map(sqes_size_, IORING_OFF_SQES));
+
+    char *sq = static_cast<char *>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_flags_ = reinterpret_cast<unsigned *>(sq + p.sq_off.flags);
+    unsigned *array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i) {
+      array[i] = i;
+    }
+    tail_ = *sq_tail_;
+
+    char *cq = static_cast<char *>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+  }
+
+  ~IoUring() {
+    if (sqes_) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) {
+      munmap(cq_ptr_, cq_size_);
+    }
+    if (sq_ptr_) {
+      munmap(sq_ptr_, sq_size_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  // Next free submission entry, zeroed, or nullptr if the queue is full
+  io_uring_sqe *GetSqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (tail_ - head >= sq_entries_) {
+      return nullptr;
+    }
+    io_uring_sqe *sqe = &sqes_[tail_ & sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    tail_++;
+    return sqe;
+  }
+
+  // Publish queued entries to the kernel, optionally waiting for
+  // completions. With SQ polling this only enters the kernel to wake up
+  // an idle poller or to wait.
+  void Submit(unsigned wait = 0) {
+    unsigned pending = tail_ - *sq_tail_;
+    __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    if (sqpoll_) {
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) &
+          IORING_SQ_NEED_WAKEUP) {
+        flags |= IORING_ENTER_SQ_WAKEUP;
+      } else if (!wait) {
+        return;
+      }
+    } else if (pending == 0 && !wait) {
+      return;
+    }
+    Enter(pending, wait, flags);
+  }
+
+  // Oldest unseen completion or nullptr
+  io_uring_cqe *PeekCqe() {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      return nullptr;
+    }
+    return &cqes_[head & cq_mask_];
+  }
+
+  // Release the completion returned by PeekCqe
+  void SeenCqe() {
+    __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+  }
+
+  // Block until at least one completion is ready
+  void WaitCqe() {
+    if (!PeekCqe()) {
+      Enter(0, 1, IORING_ENTER_GETEVENTS);
+    }
+  }
+
+  void RegisterBuffers(const iovec *iovs, unsigned n) {
+    Register(IORING_REGISTER_BUFFERS, iovs, n, "IORING_REGISTER_BUFFERS");
+  }
+
+  int Fd() const { return fd_; }
+
+private:
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  void *Map(size_t size, uint64_t offset) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, offset);
+    if (p == MAP_FAILED) {
+      Throw("io_uring mmap");
+    }
+    return p;
+  }
+
+  void Enter(unsigned submit, unsigned wait, unsigned flags) {
+    for (;;) {
+      int ret = syscall(__NR_io_uring_enter, fd_, submit, wait, flags,
+                        nullptr, 0);
+      if (ret >= 0) {
+        return;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EBUSY || errno == EAGAIN) {
+        // Completion queue full, the caller has to reap first
+        return;
+      }
+      Throw("io_uring_enter");
+    }
+  }
+
+  void Register(unsigned op, const void *arg, unsigned n, const char *what) {
+    if (syscall(__NR_io_uring_register, fd_, op, arg, n) < 0) {
+      Throw(what);
+    }
+  }
+
+  static void Throw(const char *what) {
+    throw std::system_error(errno, std::system_category(), what);
+  }
+
+  int fd_ = -1;
+  bool sqpoll_ = false;
+  unsigned sq_entries_ = 0;
+  unsigned tail_ = 0; // local submission tail
+
+  void *sq_ptr_ = nullptr;
+  void *cq_ptr_ = nullptr;
+  size_t sq_size_ = 0;
+  size_t cq_size_ = 0;
+  size_t sqes_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned *sq_flags_;
+  unsigned sq_mask_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe *cqes_;
+};
+
+template <typename Handler> class UringReceiver {
+
+public:
+  static constexpr size_t kBuffers = 1024;
+  static constexpr size_t kBufferSize = 2048;
+  static constexpr uint16_t kGroup = 0;
+
+  // Receive from the UDP socket fd, for example from OpenUdpSocket. The
+  // socket stays owned by the caller.
+  UringReceiver(Handler &handler, int fd, size_t nbuffers = kBuffers,
+                bool sqpoll = false)
+      : handler_(handler), fd_(fd), ring_(256, sqpoll), nbuffers_(nbuffers) {
+    if (nbuffers == 0 || nbuffers > 65536) {
+      throw std::invalid_argument("uring: bad buffer count");
+    }
+    size_ = nbuffers_ * kBufferSize;
+    void *p = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::system_error(errno, std::system_category(), "mmap");
+    }
+    data_ = static_cast<char *>(p);
+    Provide(0, nbuffers_);
+    Arm();
+  }
+
+  ~UringReceiver() { munmap(data_, size_); }
+
+  // Handle all ready completions, returns number of datagrams. With wait
+  // blocks in the kernel until at least one completion is ready.
+  size_t Poll(bool wait = false) {
+    if (wait) {
+      ring_.WaitCqe();
+    }
+    size_t count = 0;
+    bool returned = false;
+    while (io_uring_cqe *cqe = ring_.PeekCqe()) {
+      uint64_t op = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      ring_.SeenCqe();
+      if (op == kProvideOp) {
+        if (res < 0) {
+          Throw(res, "uring provide buffers");
+        }
+        continue;
+      }
+      if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0) {
+          handler_.ParsePacket(data_ + bid * kBufferSize, res);
+          count++;
+        }
+        Provide(bid, 1);
+        returned = true;
+      }
+      if (res < 0 && res != -ENOBUFS) {
+        Throw(res, "uring recv");
+      }
+      if (!(flags & IORING_CQE_F_MORE)) {
+        // Multishot stopped, for example when out of buffers
+        rearm_ = true;
+      }
+    }
+    if (rearm_) {
+      Arm();
+    } else if (returned) {
+      ring_.Submit();
+    }
+    packets_ += count;
+    return count;
+  }
+
+  void Run(const std::atomic<bool> &stop, bool spin = false) {
+    while (!stop.load(std::memory_order_relaxed)) {
+      Poll(!spin);
+    }
+  }
+
+  uint64_t Packets() const { return packets_; }
+
+private:
+  static constexpr uint64_t kRecvOp = 0;
+  static constexpr uint64_t kProvideOp = 1;
+
+  io_uring_sqe *GetSqe() {
+    io_uring_sqe *sqe;
+    while (!(sqe = ring_.GetSqe())) {
+      ring_.Submit();
+    }
+    return sqe;
+  }
+
+  // Hand count buffers starting at bid to the kernel, queued behind any
+  // receive already submitted
+  void Provide(unsigned bid, unsigned count) {
+    io_uring_sqe *sqe = GetSqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = reinterpret_cast<uint64_t>(data_ + bid * kBufferSize);
+    sqe->len = kBufferSize;
+    sqe->off = bid;
+    sqe->buf_group = kGroup;
+    sqe->user_data = kProvideOp;
+  }
+
+  void Arm() {
+    io_uring_sqe *sqe = GetSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd_;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kGroup;
+    sqe->user_data = kRecvOp;
+    ring_.Submit();
+    rearm_ = false;
+  }
+
+  static void Throw(int res, const char *what) {
+    throw std::system_error(-res, std::system_category(), what);
+  }
+
+  Handler &handler_;
+  int fd_;
+  IoUring ring_;
+  const size_t nbuffers_;
+  size_t size_;
+  char *data_;
+  bool rearm_ = false;
+  uint64_t packets_ = 0;
+};
+
+class UringFileReader {
+public:
+  static constexpr size_t kBufferSize = 4 << 20;
+  static constexpr size_t kBuffers = 8;
+  static constexpr size_t kHeadroom = 64 << 10;
+
+  UringFileReader(const std::string &fname, size_t buffer_size = kBufferSize,
+                  size_t nbuffers = kBuffers, bool sqpoll = false)
+      : buffer_size_(buffer_size), buffers_(std::max<size_t>(nbuffers, 2)),
+        ring_(buffers_.size(), sqpoll) {
+    fd_ = open(fname.c_str(), O_RDONLY);
+    if (fd_ == -1) {
+      throw std::system_error(errno, std::system_category(), "open " + fname);
+    }
+    struct stat st;
+    fstat(fd_, &st);
+    size_ = st.st_size;
+    size_t stride = kHeadroom + buffer_size_;
+    void *p = mmap(nullptr, stride * buffers_.size(), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED) {
+      close(fd_);
+      throw std::system_error(errno, std::system_category(), "mmap");
+    }
+    mem_ = static_cast<char *>(p);
+    std::vector<iovec> iovs(buffers_.size());
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      buffers_[i].data = mem_ + i * stride + kHeadroom;
+      iovs[i].iov_base = mem_ + i * stride;
+      iovs[i].iov_len = stride;
+    }
+    ring_.RegisterBuffers(iovs.data(), iovs.size());
+  }
+
+  ~UringFileReader() {
+    munmap(mem_, (kHeadroom + buffer_size_) * buffers_.size());
+    close(fd_);
+  }
+
+  // Read the file and call parse(const char *buf, size_t len) for each
+  // chunk. parse returns the number of bytes consumed, the remainder is
+  // passed again at the front of the next chunk. Returns bytes read.
+  template <typename Parse> uint64_t Run(Parse parse) {
+    offset_ = 0;
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      Read(i);
+    }
+    ring_.Submit();
+
+    uint64_t total = 0;
+    const char *carry = nullptr;
+    size_t carry_len = 0;
+    for (size_t n = 0;; ++n) {
+      size_t idx = n % buffers_.size();
+      Buffer &buf = buffers_[idx];
+      while (!buf.done) {
+        Reap(true);
+      }
+      if (carry_len > kHeadroom) {
+        throw std::runtime_error("uring: message larger than headroom");
+      }
+      char *begin = buf.data - carry_len;
+      if (carry_len > 0) {
+        std::memcpy(begin, carry, carry_len);
+      }
+      if (n > 0) {
+        // The previous buffer is free once its tail has been copied
+        Read((n - 1) % buffers_.size());
+        ring_.Submit();
+      }
+
+      size_t len = carry_len + buf.len;
+      size_t used = len > 0 ? parse(begin, len) : 0;
+      carry = begin + used;
+      carry_len = len - used;
+      total += buf.len;
+
+      if (buf.len < buf.want || buf.want == 0) {
+        // End of file, wait for the reads still in flight
+        while (inflight_ > 0) {
+          Reap(true);
+        }
+        return total;
+      }
+    }
+  }
+
+private:
+  UringFileReader(const UringFileReader &) = delete;
+  UringFileReader &operator=(const UringFileReader &) = delete;
+
+  struct Buffer {
+    char *data = nullptr;
+    uint64_t offset = 0;
+    size_t want = 0;
+    size_t len = 0;
+    bool done = false;
+  };
+
+  // Fill buffer idx with the next part of the file
+  void Read(size_t idx) {
+    Buffer &buf = buffers_[idx];
+    buf.offset = offset_;
+    buf.want =
+        std::min<uint64_t>(buffer_size_, size_ - std::min(size_, offset_));
+    buf.len = 0;
+    buf.done = buf.want == 0;
+    offset_ += buf.want;
+    if (!buf.done) {
+      Submit(idx);
+    }
+  }
+
+  void Submit(size_t idx) {
+    Buffer &buf = buffers_[idx];
+    io_uring_sqe *sqe;
+    while (!(sqe = ring_.GetSqe())) {
+      ring_.Submit();
+      Reap(false);
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uint64_t>(buf.data + buf.len);
+    sqe->len = buf.want - buf.len;
+    sqe->off = buf.offset + buf.len;
+    sqe->buf_index = idx;
+    sqe->user_data = idx;
+    inflight_++;
+  }
+
+  void Reap(bool wait) {
+    if (wait) {
+      ring_.WaitCqe();
+    }
+    while (io_uring_cqe *cqe = ring_.PeekCqe()) {
+      size_t idx = cqe->user_data;
+      int res = cqe->res;
+      ring_.SeenCqe();
+      inflight_--;
+      Buffer &buf = buffers_[idx];
+      if (res < 0) {
+        errno = -res;
+        throw std::system_error(errno, std::system_category(), "uring read");
+      }
+      buf.len += res;
+      if (res > 0 && buf.len < buf.want) {
+        // Short read, fetch the rest
+        Submit(idx);
+        ring_.Submit();
+      } else {
+        buf.done = true;
+      }
+    }
+  }
+
+  const size_t buffer_size_;
+  std::vector<Buffer> buffers_;
+  IoUring ring_;
+  int fd_ = -1;
+  uint64_t size_ = 0;
+  uint64_t offset_ = 0;
+  size_t inflight_ = 0;
+  char *mem_ = nullptr;
+};
@@ -0,0 +1,224 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+// Compares the io_uring backends against the mmap and recvmmsg paths.
+//
+// uring_bench FILE replays an ITCH file through Itch50Parser::ParseMany
+// from a memory mapping and from UringFileReader, without and with SQ
+// polling. uring_bench -u [-n PACKETS] sends datagrams over loopback and
+// receives them with UdpReceiver and UringReceiver. Both report
+// throughput and the CPU time used by the parsing or receiving thread.
+
+#include "feed.hpp"
+#include "itch.hpp"
+#include "udp_receiver.hpp"
+#include "uring.hpp"
+#include <atomic>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <chrono>
+#include <ctime>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+class Handler {
+public:
+  void OnQuote(OrderBook *book, bool top) { count++; }
+
+  void OnTrade(OrderBook *book, int64_t shares, int64_t price, bool top) {
+    count++;
+  }
+
+  uint64_t count = 0;
+};
+
+struct Counter {
+  void ParsePacket(const char *buf, size_t len) { bytes += len; }
+
+  uint64_t bytes = 0;
+};
+
+static double ThreadCpu() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double Now() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void Report(const char *name, uint64_t bytes, double secs,
+                   double cpu) {
+  std::cout << name << ": " << bytes << " bytes in " << secs << " s, "
+            << bytes / secs / 1e6 << " MB/s, cpu " << cpu << " s"
+            << std::endl;
+}
+
+// Time parse(parser) on a fresh feed, parse returns the bytes processed
+template <typename Parse> static void TimeFile(const char *name, Parse parse) {
+  Handler handler;
+  Feed<Handler> feed(handler, 1000000, true, true);
+  Itch50Parser<Feed<Handler>> parser(feed);
+  double start = Now(), cpu = ThreadCpu();
+  uint64_t bytes = parse(parser);
+  Report(name, bytes, Now() - start, ThreadCpu() - cpu);
+}
+
+static void BenchFile(const std::string &fname) {
+  TimeFile("mmap", [&](Itch50Parser<Feed<Handler>> &parser) {
+    boost::iostreams::mapped_file_source file(fname);
+    parser.ParseMany(file.data(), file.size());
+    return file.size();
+  });
+  for (bool sqpoll : {false, true}) {
+    try {
+      TimeFile(sqpoll ? "uring sqpoll" : "uring",
+               [&](Itch50Parser<Feed<Handler>> &parser) {
+                 UringFileReader reader(fname, UringFileReader::kBufferSize,
+                                        UringFileReader::kBuffers, sqpoll);
+                 return reader.Run([&](const char *buf, size_t len) {
+                   return parser.ParseMany(buf, len);
+                 });
+               });
+    } catch (const std::system_error &e) {
+      std::cout << (sqpoll ? "uring sqpoll" : "uring")
+                << " unavailable: " << e.what() << std::endl;
+    }
+  }
+}
+
+// Receive count datagrams sent to port on loopback with receive(stop),
+// running on its own thread until stop is set
+template <typename Receive>
+static void TimeReceive(const char *name, uint16_t port, size_t count,
+                        Receive receive) {
+  std::atomic<bool> stop(false);
+  std::atomic<bool> ready(false);
+  std::exception_ptr error;
+  Counter counter;
+  double cpu = 0, start = 0, secs = 0;
+  std::thread rx([&] {
+    double begin = ThreadCpu();
+    try {
+      receive(counter, stop, ready);
+    } catch (...) {
+      error = std::current_exception();
+      ready = true;
+    }
+    cpu = ThreadCpu() - begin;
+    secs = Now() - start;
+  });
+  while (!ready) {
+    std::this_thread::yield();
+  }
+  if (error) {
+    rx.join();
+    std::rethrow_exception(error);
+  }
+
+  int tx = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in dst = {};
+  dst.sin_family = AF_INET;
+  dst.sin_port = htons(port);
+  inet_aton("127.0.0.1", &dst.sin_addr);
+  char payload[1024] = {};
+  start = Now();
+  for (size_t i = 0; i < count; ++i) {
+    sendto(tx, payload, sizeof(payload), 0,
+           reinterpret_cast<sockaddr *>(&dst), sizeof(dst));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  stop = true;
+  // Wake up a receiver blocked in the kernel
+  sendto(tx, payload, 1, 0, reinterpret_cast<sockaddr *>(&dst), sizeof(dst));
+  rx.join();
+  close(tx);
+  Report(name, counter.bytes, secs, cpu);
+}
+
+static void BenchReceive(size_t count) {
+  const uint16_t port = 31000 + getpid() % 1000;
+  TimeReceive("recvmmsg", port, count,
+              [&](Counter &counter, std::atomic<bool> &stop,
+                  std::atomic<bool> &ready) {
+                UdpReceiver<Counter> rx(counter);
+                rx.Open("127.0.0.1", port);
+                rx.SetReceiveBuffer(64 << 20);
+                ready = true;
+                rx.Run(stop);
+              });
+  for (bool sqpoll : {false, true}) {
+    const char *name = sqpoll ? "uring sqpoll" : "uring";
+    try {
+      TimeReceive(name, port, count, [&](Counter &counter,
+                                         std::atomic<bool> &stop,
+                                         std::atomic<bool> &ready) {
+        int fd = OpenUdpSocket("127.0.0.1", port);
+        int size = 64 << 20;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        std::unique_ptr<UringReceiver<Counter>> rx;
+        try {
+          rx.reset(new UringReceiver<Counter>(
+              counter, fd, UringReceiver<Counter>::kBuffers, sqpoll));
+        } catch (...) {
+          close(fd);
+          throw;
+        }
+        ready = true;
+        rx->Run(stop);
+        close(fd);
+      });
+    } catch (const std::system_error &e) {
+      std::cout << name << " unavailable: " << e.what() << std::endl;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  bool udp = false;
+  size_t count = 1000000;
+  while ((opt = getopt(argc, argv, "un:")) != -1) {
+    if (opt == 'u') {
+      udp = true;
+    } else if (opt == 'n') {
+      count = atol(optarg);
+    }
+  }
+  if (!udp && optind >= argc) {
+    std::cerr << "usage: " << argv[0] << " FILE | -u [-n PACKETS]"
+              << std::endl;
+    return 1;
+  }
+  if (udp) {
+    BenchReceive(count);
+  } else {
+    BenchFile(argv[optind]);
+  }
+  return 0;
+}
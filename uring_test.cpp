@@ -0,0 +1,142 @@
+/*
+Copyright (c) 2015 Erik Rigtorp <erik@rigtorp.se>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "udp_receiver.hpp"
+#include "uring.hpp"
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+struct Handler {
+  void ParsePacket(const char *buf, size_t len) {
+    packets.emplace_back(buf, len);
+  }
+
+  std::vector<std::string> packets;
+};
+
+// Length prefixed messages like an ITCH file
+static std::string MakeFile(size_t count) {
+  std::mt19937 rng(1);
+  std::string s;
+  for (size_t i = 0; i < count; ++i) {
+    size_t len = 3 + rng() % 48;
+    s.push_back(len >> 8);
+    s.push_back(len);
+    for (size_t j = 0; j < len; ++j) {
+      s.push_back(char(i + j));
+    }
+  }
+  return s;
+}
+
+static std::vector<std::string> Split(const char *buf, size_t len,
+                                      size_t &used) {
+  std::vector<std::string> msgs;
+  size_t i = 0;
+  while (i + 2 <= len) {
+    size_t msg_len = uint8_t(buf[i]) << 8 | uint8_t(buf[i + 1]);
+    if (i + 2 + msg_len > len) {
+      break;
+    }
+    msgs.emplace_back(buf + i, msg_len + 2);
+    i += msg_len + 2;
+  }
+  used = i;
+  return msgs;
+}
+
+static void TestFile(bool sqpoll) {
+  std::string content = MakeFile(2000);
+  char fname[] = "/tmp/uring_testXXXXXX";
+  int fd = mkstemp(fname);
+  assert(fd != -1);
+  ssize_t written = write(fd, content.data(), content.size());
+  assert(written == ssize_t(content.size()));
+  close(fd);
+
+  size_t used;
+  std::vector<std::string> expect = Split(content.data(), content.size(), used);
+  std::vector<std::string> got;
+  size_t chunks = 0;
+  UringFileReader reader(fname, 4096, 3, sqpoll);
+  uint64_t bytes = reader.Run([&](const char *buf, size_t len) {
+    chunks++;
+    size_t used;
+    auto msgs = Split(buf, len, used);
+    got.insert(got.end(), msgs.begin(), msgs.end());
+    return used;
+  });
+  unlink(fname);
+  assert(bytes == content.size());
+  assert(got == expect);
+  assert(chunks >= content.size() / 4096);
+}
+
+static void TestReceive(bool sqpoll) {
+  const uint16_t port = 32000 + getpid() % 1000;
+  int fd = OpenUdpSocket("127.0.0.1", port);
+  Handler handler;
+  UringReceiver<Handler> rx(handler, fd, 16, sqpoll);
+
+  int tx = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in dst = {};
+  dst.sin_family = AF_INET;
+  dst.sin_port = htons(port);
+  inet_aton("127.0.0.1", &dst.sin_addr);
+  // More datagrams than buffers, the receive is rearmed once drained
+  for (int i = 0; i < 100; ++i) {
+    std::string s = std::to_string(i);
+    sendto(tx, s.data(), s.size(), 0, reinterpret_cast<sockaddr *>(&dst),
+           sizeof(dst));
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (rx.Packets() < 100 && std::chrono::steady_clock::now() < deadline) {
+    rx.Poll();
+  }
+  close(tx);
+  close(fd);
+  assert(rx.Packets() == 100);
+  for (int i = 0; i < 100; ++i) {
+    assert(handler.packets[i] == std::to_string(i));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    IoUring probe(8);
+  } catch (const std::system_error &e) {
+    std::cout << "io_uring unavailable, skipping: " << e.what() << std::endl;
+    return 0;
+  }
+
+  TestFile(false);
+  TestFile(true);
+  TestReceive(false);
+  TestReceive(true);
+
+  return 0;
+}